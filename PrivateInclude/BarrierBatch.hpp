@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <volk.h>
+
+namespace R2::VK
+{
+    // Collects the image and buffer barriers for one command buffer so they can be recorded
+    // as a single dependency right before the next command that needs them. Barriers are
+    // always described with the sync2 structures and converted on devices without sync2.
+    class BarrierBatch
+    {
+    public:
+        BarrierBatch(VkCommandBuffer cb);
+        // Returns false if the barrier was folded into a pending one for the same range
+        bool Add(const VkImageMemoryBarrier2& barrier);
+        bool Add(const VkBufferMemoryBarrier2& barrier);
+        void Flush();
+        bool IsEmpty() const;
+
+        static void Write(VkCommandBuffer cb, const VkImageMemoryBarrier2* imageBarriers, uint32_t numImageBarriers,
+                          const VkBufferMemoryBarrier2* bufferBarriers, uint32_t numBufferBarriers);
+    private:
+        VkCommandBuffer cb;
+        std::vector<VkImageMemoryBarrier2> imageBarriers;
+        std::vector<VkBufferMemoryBarrier2> bufferBarriers;
+    };
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <stdint.h>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <volk.h>
+
+namespace R2::VK
+{
+    struct Handles;
+    struct DescriptorPoolStats;
+    class DescriptorSetLayout;
+
+    // A list of descriptor pools that grows when all of them are full. The first pool is made
+    // with the sizes it's given; later ones are sized from the mix of descriptor types in the
+    // live sets, each with twice the sets of the one before.
+    class DescriptorPoolChain
+    {
+    public:
+        DescriptorPoolChain(const Handles* handles, VkDescriptorPoolCreateFlags flags,
+                            const VkDescriptorPoolSize* initialSizes, uint32_t numInitialSizes, uint32_t initialMaxSets);
+        ~DescriptorPoolChain();
+
+        VkDescriptorSet Allocate(DescriptorSetLayout* layout, uint32_t variableDescriptorCount);
+        // Queues the set to be freed once the GPU has finished frameNumber. Only for chains
+        // created with VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT.
+        void Free(VkDescriptorSet set, uint64_t frameNumber);
+        // Frees the sets queued for frames up to completedFrameNumber
+        void Reclaim(uint64_t completedFrameNumber);
+        // Resets every pool, freeing all of their sets
+        void Reset();
+
+        VkDescriptorPool GetFirstPool() const;
+        void GetStats(std::vector<DescriptorPoolStats>& stats);
+    private:
+        // Core descriptor types 0-10, then acceleration structures
+        static const uint32_t NUM_DESCRIPTOR_TYPES = 12;
+
+        struct Pool
+        {
+            VkDescriptorPool Handle;
+            uint32_t MaxSets;
+            uint32_t NumSets;
+            uint32_t MaxDescriptors;
+            uint32_t NumDescriptors;
+        };
+
+        // What a set takes up, so it can be given back when it's freed
+        struct SetRecord
+        {
+            uint32_t PoolIndex;
+            uint32_t TypeCounts[NUM_DESCRIPTOR_TYPES];
+        };
+
+        struct PendingFree
+        {
+            VkDescriptorSet Set;
+            uint64_t FrameNumber;
+        };
+
+        void createPool(const VkDescriptorPoolSize* sizes, uint32_t numSizes, uint32_t maxSets);
+        void createGrowthPool(const uint32_t* requestCounts);
+        void recordAllocation(VkDescriptorSet set, uint32_t poolIndex, const uint32_t* typeCounts);
+
+        const Handles* handles;
+        VkDescriptorPoolCreateFlags flags;
+        // Sets are only tracked individually when they can be freed individually
+        bool trackSets;
+        uint32_t initialMaxSets;
+        std::mutex mutex;
+        std::vector<Pool> pools;
+        uint32_t currentPool;
+        uint64_t liveTypeCounts[NUM_DESCRIPTOR_TYPES];
+        uint64_t liveSets;
+        std::unordered_map<VkDescriptorSet, SetRecord> setRecords;
+        std::deque<PendingFree> pendingFrees;
+    };
+}
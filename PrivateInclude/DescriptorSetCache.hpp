@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace R2::VK
+{
+    class DescriptorSet;
+
+    // Descriptor sets from DescriptorSetUpdater::GetCachedSet, keyed by their layout and
+    // everything written to them. A set is deleted as soon as its layout or any of the
+    // textures, views, buffers or samplers it references is destroyed.
+    class DescriptorSetCache
+    {
+    public:
+        ~DescriptorSetCache();
+        DescriptorSet* Find(const std::string& key);
+        // Takes ownership of the set. If another thread added the same key first, the set is
+        // deleted and the existing one is returned instead.
+        DescriptorSet* Add(const std::string& key, DescriptorSet* set, const std::vector<const void*>& resources);
+        void Invalidate(const void* resource);
+        uint32_t GetNumSets();
+    private:
+        struct Entry
+        {
+            DescriptorSet* Set;
+            std::vector<const void*> Resources;
+        };
+
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+        std::unordered_map<const void*, std::vector<std::string>> keysByResource;
+    };
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <volk.h>
+
+namespace R2::VK
+{
+    // Everything a VkGraphicsPipelineCreateInfo points to, filled in by PipelineBuilder so
+    // the pipeline can be created later or on another thread. CreateInfo points into the
+    // struct itself, so it can't be copied or moved once filled in.
+    struct GraphicsPipelineCreateData
+    {
+        GraphicsPipelineCreateData() = default;
+        GraphicsPipelineCreateData(const GraphicsPipelineCreateData&) = delete;
+        GraphicsPipelineCreateData& operator=(const GraphicsPipelineCreateData&) = delete;
+
+        std::vector<VkVertexInputBindingDescription> BindingDescs;
+        std::vector<VkVertexInputAttributeDescription> AttributeDescs;
+        std::vector<VkPipelineColorBlendAttachmentState> AttachmentBlendStates;
+        std::vector<VkPipelineShaderStageCreateInfo> ShaderStages;
+        std::vector<VkFormat> AttachmentFormats;
+        VkDynamicState DynamicStates[16];
+        VkRect2D Scissor;
+        VkViewport Viewport;
+
+        VkPipelineVertexInputStateCreateInfo VertexInputState;
+        VkPipelineInputAssemblyStateCreateInfo InputAssemblyState;
+        VkPipelineDynamicStateCreateInfo DynamicState;
+        VkPipelineRasterizationStateCreateInfo RasterizationState;
+        VkPipelineDepthStencilStateCreateInfo DepthStencilState;
+        VkPipelineMultisampleStateCreateInfo MultisampleState;
+        VkPipelineColorBlendStateCreateInfo ColorBlendState;
+        VkPipelineViewportStateCreateInfo ViewportState;
+        VkPipelineRenderingCreateInfo RenderingInfo;
+        VkGraphicsPipelineCreateInfo CreateInfo;
+    };
+}
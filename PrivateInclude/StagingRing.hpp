@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include <deque>
+
+namespace R2::VK
+{
+    // Tracks space in the staging buffer as a ring. Allocations made between two calls to
+    // EndFrame belong to that frame, and are handed back by Reclaim once the GPU has
+    // finished the frame. Not thread safe; the Core guards it with its upload mutex.
+    class StagingRing
+    {
+    public:
+        StagingRing(uint64_t size);
+        // Returns false if there isn't enough free space left in the ring
+        bool Allocate(uint64_t size, uint64_t alignment, uint64_t& offset);
+        // Gives back the unused end of the last allocation, if nothing has been allocated since
+        void Shrink(uint64_t allocationEnd, uint64_t unusedBytes);
+        void EndFrame(uint64_t frameNumber);
+        void Reclaim(uint64_t completedFrameNumber);
+        uint64_t GetSize() const;
+        uint64_t GetUsed() const;
+    private:
+        struct FrameRegion
+        {
+            uint64_t FrameNumber;
+            uint64_t End;
+            uint64_t Bytes;
+        };
+
+        uint64_t size;
+        uint64_t head;
+        uint64_t tail;
+        uint64_t used;
+        uint64_t frameBytes;
+        std::deque<FrameRegion> frames;
+    };
+}
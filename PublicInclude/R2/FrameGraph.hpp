@@ -1,6 +1,12 @@
 #pragma once
 #include <stdint.h>
 #include <string.h>
+#include <functional>
+#include <vector>
+
+#define VK_DEFINE_HANDLE(object) typedef struct object##_T* object;
+VK_DEFINE_HANDLE(VmaAllocation)
+#undef VK_DEFINE_HANDLE
 
 namespace R2
 {
@@ -8,10 +14,132 @@ namespace R2
     {
         struct TextureCreateInfo;
         struct BufferCreateInfo;
+        class Core;
+        class Texture;
+        class Buffer;
+        class CommandBuffer;
+        union ClearValue;
+        enum class AccessFlags : uint64_t;
+        enum class PipelineStageFlags : uint64_t;
+        enum class ImageLayout : uint32_t;
     }
 
+    class RenderGraph;
+
+    // Handles to resources in a RenderGraph. They're only valid for the graph that made them,
+    // until its next Reset.
+    struct RenderGraphTexture
+    {
+        static constexpr uint32_t Invalid = ~0u;
+
+        bool IsValid() const { return Index != Invalid; }
+
+        uint32_t Index = Invalid;
+    };
+
+    struct RenderGraphBuffer
+    {
+        static constexpr uint32_t Invalid = ~0u;
+
+        bool IsValid() const { return Index != Invalid; }
+
+        uint32_t Index = Invalid;
+    };
+
+    // Passed to a pass's setup function to declare what the pass uses. Anything the pass
+    // touches has to be declared here, since the graph records the barriers for it.
+    class RenderGraphBuilder
+    {
+    public:
+        RenderGraphTexture CreateTexture(const char* name, const VK::TextureCreateInfo& createInfo);
+        RenderGraphBuffer CreateBuffer(const char* name, const VK::BufferCreateInfo& createInfo);
+
+        void ReadTexture(RenderGraphTexture tex, VK::ImageLayout layout, VK::AccessFlags access, VK::PipelineStageFlags stage);
+        // Writes are assumed to only cover part of the texture, so earlier contents are kept
+        void WriteTexture(RenderGraphTexture tex, VK::ImageLayout layout, VK::AccessFlags access, VK::PipelineStageFlags stage);
+        void ReadBuffer(RenderGraphBuffer buf, VK::AccessFlags access, VK::PipelineStageFlags stage);
+        void WriteBuffer(RenderGraphBuffer buf, VK::AccessFlags access, VK::PipelineStageFlags stage);
+
+        // Attachments make the graph begin a render pass around the pass's execute function.
+        // The load and store ops come from how the texture is used by the rest of the graph.
+        void ColorAttachment(RenderGraphTexture tex);
+        void ColorAttachment(RenderGraphTexture tex, VK::ClearValue clearValue);
+        void DepthAttachment(RenderGraphTexture tex);
+        void DepthAttachment(RenderGraphTexture tex, VK::ClearValue clearValue);
+
+        // Keeps the pass even if nothing reads what it writes, e.g. for readbacks
+        void SetSideEffects();
+    private:
+        RenderGraphBuilder(RenderGraph* graph, uint32_t passIndex);
+        void attachment(RenderGraphTexture tex, bool isDepth, bool clear, const VK::ClearValue* clearValue);
+
+        RenderGraph* graph;
+        uint32_t passIndex;
+
+        friend class RenderGraph;
+    };
+
+    // Passes are added each frame, then Compile culls the ones whose results are never used
+    // and Execute records the rest in order, with the barriers between them. Textures and
+    // buffers created by passes are transient: they're owned by the graph and their contents
+    // don't survive past Execute. Transient textures whose passes don't overlap share memory.
+    // Imported resources are assumed to be used after the graph, so writes to them are always
+    // kept and stored.
     class RenderGraph
     {
     public:
+        typedef std::function<void(RenderGraphBuilder& builder)> SetupFunction;
+        typedef std::function<void(VK::CommandBuffer cb, RenderGraph& graph)> ExecuteFunction;
+
+        RenderGraph(VK::Core* core);
+        ~RenderGraph();
+
+        RenderGraphTexture ImportTexture(const char* name, VK::Texture* texture);
+        RenderGraphBuffer ImportBuffer(const char* name, VK::Buffer* buffer);
+        void AddPass(const char* name, const SetupFunction& setup, ExecuteFunction execute);
+
+        void Compile();
+        void Execute(VK::CommandBuffer cb);
+        // Clears the passes and resources so the graph can be built again for the next frame.
+        // Transient resources are kept for the next Compile.
+        void Reset();
+
+        // Only valid from Compile until the next Reset
+        VK::Texture* GetTexture(RenderGraphTexture tex);
+        VK::Buffer* GetBuffer(RenderGraphBuffer buf);
+
+        uint32_t GetNumPasses() const;
+        uint32_t GetNumCulledPasses() const;
+        // Bytes of memory the aliased transient textures were placed in
+        uint64_t GetAliasedMemorySize() const;
+    private:
+        struct Resource;
+        struct ResourceAccess;
+        struct Pass;
+        struct PooledTexture;
+        struct PooledBuffer;
+        struct AliasedTexture;
+        struct AliasHeap;
+
+        uint32_t addResource(const char* name, bool isTexture);
+        void cullPasses();
+        void chooseAttachmentOps();
+        void allocateTransients();
+        void placeAliasedTextures(const std::vector<uint32_t>& aliasable);
+        void releaseAliasedTextures();
+        void executePass(VK::CommandBuffer cb, Pass& pass);
+
+        VK::Core* core;
+        std::vector<Resource> resources;
+        std::vector<Pass> passes;
+        std::vector<PooledTexture> texturePool;
+        std::vector<PooledBuffer> bufferPool;
+        // Kept between compiles and only laid out again when the transient textures change
+        std::vector<AliasedTexture> aliasedTextures;
+        std::vector<AliasHeap> aliasHeaps;
+        uint32_t numCulledPasses;
+        bool compiled;
+
+        friend class RenderGraphBuilder;
     };
-}
\ No newline at end of file
+}
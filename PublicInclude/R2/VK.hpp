@@ -7,6 +7,7 @@
 #include "VKEnums.hpp"
 #include "VKFrameSeparatedBuffer.hpp"
 #include "VKPipeline.hpp"
+#include "VKPipelineCompiler.hpp"
 #include "VKRenderPass.hpp"
 #include "VKSampler.hpp"
 #include "VKTexture.hpp"
\ No newline at end of file
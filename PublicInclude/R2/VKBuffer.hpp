@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include <vector>
 
 #define VK_DEFINE_HANDLE(object) typedef struct object##_T* object;
 VK_DEFINE_HANDLE(VkBuffer)
@@ -29,6 +30,7 @@ namespace R2::VK
 
     enum class AccessFlags : uint64_t;
     enum class PipelineStageFlags : uint64_t;
+    enum class QueueType : uint32_t;
 
     struct BufferCreateInfo
     {
@@ -49,8 +51,16 @@ namespace R2::VK
         void* Map();
         void Unmap();
         void CopyTo(VkCommandBuffer cb, Buffer* other, uint64_t numBytes, uint64_t srcOffset, uint64_t dstOffset);
+        // Like Texture::Acquire, only call these from one command buffer per frame
         void Acquire(CommandBuffer cb, AccessFlags access);
         void Acquire(CommandBuffer cb, AccessFlags access, PipelineStageFlags stage);
+        // Only waits on earlier accesses that overlap the given bytes, so work on disjoint parts
+        // of the buffer doesn't serialize.
+        void Acquire(CommandBuffer cb, uint64_t offset, uint64_t size, AccessFlags access, PipelineStageFlags stage);
+
+        // Queue family ownership transfer, see Texture::ReleaseOwnership.
+        void ReleaseOwnership(CommandBuffer cb, QueueType srcQueue, QueueType dstQueue);
+        void AcquireOwnership(CommandBuffer cb, QueueType srcQueue, QueueType dstQueue, AccessFlags access, PipelineStageFlags stage);
 
         ~Buffer();
     private:
@@ -61,7 +71,32 @@ namespace R2::VK
         uint64_t size;
         BufferUsage usage;
         
-        AccessFlags lastAccess;
-        PipelineStageFlags lastPipelineStage;
+        // State of a span of bytes, tracked the same way as a texture subresource
+        struct RangeState
+        {
+            uint64_t Start;
+            uint64_t End;
+            AccessFlags WriteAccess;
+            PipelineStageFlags WriteStage;
+            AccessFlags ReadAccess;
+            PipelineStageFlags ReadStage;
+        };
+
+        // Sorted, non-overlapping ranges covering the whole buffer. Neighbours with the same
+        // state are merged, so this is a single entry unless parts of the buffer are used differently.
+        std::vector<RangeState> ranges;
+        std::vector<RangeState> rangeScratch;
+
+        // Set once the buffer has been acquired or uploaded to. Until then, Core can upload
+        // to it on the transfer queue without waiting for this frame's graphics work.
+        bool contentsInitialized;
+        uint64_t transferUploadFrame;
+
+        friend class Core;
+
+        void writeOwnershipBarrier(CommandBuffer cb, uint32_t srcFamily, uint32_t dstFamily,
+            AccessFlags srcAccess, PipelineStageFlags srcStage, AccessFlags dstAccess, PipelineStageFlags dstStage);
+        void resetState(AccessFlags writeAccess, PipelineStageFlags writeStage, AccessFlags readAccess, PipelineStageFlags readStage);
+        static bool sameState(const RangeState& a, const RangeState& b);
     };
 }
\ No newline at end of file
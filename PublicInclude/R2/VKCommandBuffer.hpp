@@ -7,6 +7,8 @@ VK_DEFINE_HANDLE(VkCommandBuffer)
 VK_DEFINE_HANDLE(VkPipelineLayout)
 VK_DEFINE_HANDLE(VkDescriptorSet)
 #undef VK_DEFINE_HANDLE
+struct VkImageMemoryBarrier2;
+struct VkBufferMemoryBarrier2;
 
 namespace R2::VK
 {
@@ -123,7 +125,12 @@ namespace R2::VK
     };
 
     enum class ShaderStage;
+    enum class Topology;
+    enum class CullMode;
+    enum class PolygonMode;
+    enum class CompareOp : unsigned int;
 
+    class BarrierBatch;
     class DescriptorSet;
     class Event;
     class Pipeline;
@@ -170,13 +177,39 @@ namespace R2::VK
 
         void SetFragmentShadingRate(uint32_t fragWidth, uint32_t fragHeight, FragmentShadingRateCombineOp combineOps[2]);
 
+        // For pipelines built with PipelineBuilder::ExtendedDynamicState
+        void SetCullMode(CullMode mode);
+        void SetPrimitiveTopology(Topology topology);
+        void SetDepthTest(bool enable);
+        void SetDepthWrite(bool enable);
+        void SetDepthCompareOp(CompareOp op);
+        void SetDepthBias(bool enable, float constantBias, float slopeBias);
+        // Requires GraphicsSupportedFeatures::DynamicPolygonMode
+        void SetPolygonMode(PolygonMode mode);
+
         void SetEvent(Event* evt);
         void ResetEvent(Event* evt);
 
         void EndRendering();
 
+        void ExecuteCommands(const CommandBuffer* commandBuffers, uint32_t count);
+
+        // Records any barriers queued by Acquire calls. This happens automatically before
+        // draws, dispatches and copies, and when the native handle is requested.
+        void FlushBarriers();
         VkCommandBuffer GetNativeHandle();
     private:
+        CommandBuffer(VkCommandBuffer cb, BarrierBatch* barrierBatch);
+        // Returns false if the barrier was merged into one already waiting to be recorded
+        bool addBarrier(const VkImageMemoryBarrier2& barrier);
+        bool addBarrier(const VkBufferMemoryBarrier2& barrier);
+
         VkCommandBuffer cb;
+        // Null for command buffers that record barriers immediately
+        BarrierBatch* barrierBatch;
+
+        friend class Buffer;
+        friend class Core;
+        friend class Texture;
     };
 }
@@ -2,7 +2,11 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <vector>
+#include <deque>
 #include <mutex>
+#include <atomic>
+#include <string>
+#include <unordered_map>
 
 #define VK_DEFINE_HANDLE(object) typedef struct object##_T* object;
 VK_DEFINE_HANDLE(VmaAllocator)
@@ -17,9 +21,11 @@ VK_DEFINE_HANDLE(VkCommandBuffer)
 VK_DEFINE_HANDLE(VkSemaphore)
 VK_DEFINE_HANDLE(VkFence)
 VK_DEFINE_HANDLE(VkDescriptorPool)
+VK_DEFINE_HANDLE(VkPipelineCache)
 #undef VK_DEFINE_HANDLE
 
 struct VkDebugUtilsMessengerCallbackDataEXT;
+struct VkBufferImageCopy;
 
 typedef uint32_t VkBool32;
 typedef uint32_t VkFlags;
@@ -32,10 +38,12 @@ namespace R2::VK
 		uint32_t GraphicsFamilyIndex;
 		uint32_t PresentFamilyIndex;
 		uint32_t AsyncComputeFamilyIndex;
+		uint32_t TransferFamilyIndex;
 
 		VkQueue Graphics;
 		VkQueue Present;
 		VkQueue AsyncCompute;
+		VkQueue Transfer;
 	};
 
 	// Commonly used handles that are passed around via a reference to
@@ -50,6 +58,7 @@ namespace R2::VK
 		VkAllocationCallbacks* AllocCallbacks;
 		VmaAllocator Allocator;
 		VkDescriptorPool DescriptorPool;
+		VkPipelineCache PipelineCache;
 	};
 
 	class Texture;
@@ -62,9 +71,20 @@ namespace R2::VK
 	struct SwapchainCreateInfo;
 
 	class DeletionQueue;
+	class DescriptorPoolChain;
+	class DescriptorSetCache;
+	class StagingRing;
+	class BarrierBatch;
 	class CommandBuffer;
+	class RenderPass;
+	enum class PipelineStageFlags : uint64_t;
+	enum class AccessFlags : uint64_t;
+	enum class ImageLayout : uint32_t;
+	enum class QueueType : uint32_t;
 	class DescriptorSet;
 	class DescriptorSetLayout;
+	class Pipeline;
+	class ShaderModule;
 
 	class IDebugOutputReceiver
 	{
@@ -83,17 +103,82 @@ namespace R2::VK
 		bool RayTracing;
 		bool VariableRateShading;
 		bool DynamicRendering;
+		// Cull mode, topology, depth and depth bias state can be set on the command buffer
+		bool ExtendedDynamicState;
+		// Polygon modes other than Fill can be used
+		bool NonSolidFill;
+		// Polygon mode can be set on the command buffer too
+		bool DynamicPolygonMode;
 	};
 
 	void onFailedVkCheck(int res, const char* file, int line);
 
 #define VKCHECK(res) { if (res != 0) { R2::VK::onFailedVkCheck(res, __FILE__, __LINE__); } }
 
+	// Identifies an upload queued with Core::QueueBufferUpload or Core::QueueTextureUpload.
+	typedef uint64_t UploadToken;
+
+	// Barriers from Texture::Acquire and Buffer::Acquire over a frame. Emitted ones were
+	// recorded, Elided ones were skipped because the resource was already in a usable state,
+	// and Merged ones were folded into a barrier still waiting to be recorded for the same range.
+	struct BarrierStats
+	{
+		uint32_t Emitted;
+		uint32_t Elided;
+		uint32_t Merged;
+	};
+
+	// Occupancy of one of the pools CreateDescriptorSet allocates from. Descriptor counts come
+	// from the set layouts, with variable count bindings counted at the size they were allocated.
+	struct DescriptorPoolStats
+	{
+		uint32_t MaxSets;
+		uint32_t AllocatedSets;
+		uint32_t MaxDescriptors;
+		uint32_t AllocatedDescriptors;
+	};
+
+	// Upper bound on CoreCreateInfo::NumFramesInFlight. Per-frame storage is sized from this.
+	const uint32_t MAX_FRAMES_IN_FLIGHT = 4;
+
+	struct CoreCreateInfo
+	{
+		IDebugOutputReceiver* DebugOutputReceiver = nullptr;
+		bool EnableValidation = false;
+		const char** InstanceExtensions = nullptr;
+		const char** DeviceExtensions = nullptr;
+
+		// How many frames the CPU can record ahead of the GPU (1 to MAX_FRAMES_IN_FLIGHT).
+		// 1 minimises latency, 3 hides the wait in BeginFrame when GPU bound.
+		uint32_t NumFramesInFlight = 2;
+
+		// Skips the surface and swapchain extensions so the Core can run on machines with no
+		// display. Rendering goes to offscreen textures, and CreateSwapchain is unavailable.
+		bool Headless = false;
+
+		// Number of worker threads that record with BeginThreadCommandBuffer. Each one gets its
+		// own command pool per frame in flight, so recording never takes a lock.
+		uint32_t NumRecordingThreads = 0;
+
+		// Size of the staging ring that uploads are copied through. Space is handed back once
+		// the GPU finishes the frame that used it, so it only has to cover a few frames of uploads.
+		// Uploads bigger than a quarter of it are streamed through in chunks over several frames,
+		// taking at most a quarter of it each frame so other uploads still fit.
+		// It's raised if a quarter of it can't hold a row of the widest texture the device supports.
+		uint64_t StagingBufferSize = 128 * 1000 * 1000;
+
+		// Data from an earlier Core::SerializePipelineCache to start the pipeline cache with. It's
+		// ignored if it came from a different device or driver version, or has been damaged.
+		const void* PipelineCacheData = nullptr;
+		size_t PipelineCacheDataSize = 0;
+	};
+
 	class Core
 	{
 	public:
 		Core(IDebugOutputReceiver* dbgOutRecv = nullptr, bool enableValidation = false,
              const char** instanceExts = nullptr, const char** deviceExts = nullptr);
+		Core(const CoreCreateInfo& createInfo);
 
 		const GraphicsDeviceInfo& GetDeviceInfo() const;
 		const GraphicsSupportedFeatures& GetSupportedFeatures() const;
@@ -101,6 +186,16 @@ namespace R2::VK
 		Texture* CreateTexture(const TextureCreateInfo& createInfo);
 		void DestroyTexture(Texture* tex);
 
+		// Memory that several textures can be placed in, for textures that are never in use at
+		// the same time. The first use of an aliased texture has to discard its contents and wait
+		// for the previous occupant, see Texture::Discard. Textures don't own the memory, so destroy
+		// them before freeing it. Freeing is deferred until the GPU has finished the frame.
+		void GetTextureMemoryRequirements(const TextureCreateInfo& createInfo, uint64_t& size, uint64_t& alignment,
+		                                  uint32_t& memoryTypeBits);
+		VmaAllocation AllocateTextureMemory(uint64_t size, uint64_t alignment, uint32_t memoryTypeBits);
+		void FreeTextureMemory(VmaAllocation memory);
+		Texture* CreateAliasedTexture(const TextureCreateInfo& createInfo, VmaAllocation memory, uint64_t offset);
+
 		Buffer* CreateBuffer(const BufferCreateInfo& createInfo);
 		Buffer* CreateBuffer(const BufferCreateInfo& createInfo, void* initialData, size_t initialDataSize);
 		void DestroyBuffer(Buffer* buf);
@@ -110,21 +205,85 @@ namespace R2::VK
 
 		DescriptorSet* CreateDescriptorSet(DescriptorSetLayout* dsl);
 		DescriptorSet* CreateDescriptorSet(DescriptorSetLayout* dsl, uint32_t maxVariableDescriptors);
+		// Allocated from this frame's descriptor pools, which are reset all at once the next time
+		// the frame comes round. The set is only valid until then and mustn't be deleted.
+		// Layouts using UpdateAfterBind need CreateDescriptorSet instead.
+		DescriptorSet* CreateTransientDescriptorSet(DescriptorSetLayout* dsl);
 
 		void BeginFrame();
 		CommandBuffer GetFrameCommandBuffer();
 		CommandBuffer GetFrameCommandBuffer(int index);
 		VkSemaphore GetFrameCompletionSemaphore();
-		void QueueBufferUpload(Buffer* buffer, const void* data, uint64_t dataSize, uint64_t dataOffset);
+		UploadToken QueueBufferUpload(Buffer* buffer, const void* data, uint64_t dataSize, uint64_t dataOffset);
 		void QueueBufferToTextureCopy(Buffer* buffer, Texture* texture, uint64_t bufferOffset = 0);
-		void QueueTextureUpload(Texture* texture, void* data, uint64_t dataSize, int numMips = -1);
+		UploadToken QueueTextureUpload(Texture* texture, void* data, uint64_t dataSize, int numMips = -1);
+		// When the staging ring is full, the Queue functions keep a copy of the data and upload
+		// it in a later frame. These return false instead, so the caller can hold off and retry.
+		// They also return false while an earlier upload to the same resource is still waiting.
+		bool TryQueueBufferUpload(Buffer* buffer, const void* data, uint64_t dataSize, uint64_t dataOffset);
+		bool TryQueueTextureUpload(Texture* texture, const void* data, uint64_t dataSize, int numMips = -1);
+		bool IsUploadComplete(UploadToken token);
+		// Blocks until the upload has finished on the GPU. Only call it after the EndFrame that
+		// submits the frame the upload was queued in. Returns false straight away if some of a
+		// deferred upload hasn't been submitted yet, since that needs more frames to go by.
+		bool WaitForUpload(UploadToken token);
 		uint32_t GetFrameIndex() const;
 		uint32_t GetNextFrameIndex() const;
 		uint32_t GetPreviousFrameIndex() const;
 		uint32_t GetNumFramesInFlight() const;
 		void EndFrame();
 
+		// Worker thread recording. A thread index may only be used by one thread at a time.
+		// Primaries ended with EndThreadCommandBuffer join the frame's submission sorted by
+		// (submitOrder, threadIndex). The frame command buffer sits at order 0, ahead of other
+		// order 0 buffers, so use negative orders to run before it. Secondaries are run with
+		// CommandBuffer::ExecuteCommands inside a pass started with RenderPass::BeginSecondary.
+		// Textures and buffers track their state as barriers are recorded, without locking and
+		// without knowing the order buffers will be submitted in. So each one may only be acquired
+		// from a single command buffer per frame. If others use it too, put it in a state they
+		// can all use in a buffer that runs before theirs, and don't call Acquire on it from them.
+		CommandBuffer BeginThreadCommandBuffer(uint32_t threadIndex);
+		void EndThreadCommandBuffer(uint32_t threadIndex, CommandBuffer cb, int32_t submitOrder);
+		CommandBuffer BeginThreadSecondaryCommandBuffer(uint32_t threadIndex, const RenderPass& renderPass);
+		void EndThreadSecondaryCommandBuffer(CommandBuffer cb);
+		uint32_t GetNumRecordingThreads() const;
+
+		// Async compute. The frame's async compute command buffer runs on the async compute
+		// queue, or on the graphics queue if the device doesn't have one. Its submission waits
+		// for the previous frame's graphics work, and this frame's graphics submission waits
+		// for it at graphicsWaitStage. Shared resources must change queue ownership with
+		// ReleaseOwnership/AcquireOwnership. If it isn't submitted by EndFrame, it's submitted
+		// there with graphics waiting at AllCommands.
+		bool HasAsyncComputeQueue() const;
+		CommandBuffer GetAsyncComputeCommandBuffer();
+		void SubmitAsyncCompute(PipelineStageFlags graphicsWaitStage);
+
+		// Frame numbers start at 1 and increase by one on every BeginFrame. The frame timeline
+		// semaphore reaches a frame's number once the GPU has finished executing that frame.
+		uint64_t GetFrameNumber() const;
+		uint64_t GetCompletedFrameNumber();
+		bool IsFrameComplete(uint64_t frameNumber);
+		void WaitForFrame(uint64_t frameNumber);
+		VkSemaphore GetFrameTimelineSemaphore();
+
+		// Counts for the last frame that went through EndFrame
+		BarrierStats GetBarrierStats() const;
+		// One entry per pool, oldest first. More pools are added as the existing ones fill up.
+		void GetDescriptorPoolStats(std::vector<DescriptorPoolStats>& stats);
+		// Sets currently held by the cache behind DescriptorSetUpdater::GetCachedSet
+		uint32_t GetNumCachedDescriptorSets();
+
 		void WaitIdle();
+		bool IsHeadless() const;
+
+		// Everything compiled into the pipeline cache so far, for CoreCreateInfo::PipelineCacheData
+		// on the next run
+		void SerializePipelineCache(std::vector<uint8_t>& data);
+
+		// Returns the module from an earlier load of the same SPIR-V if it's still alive, with
+		// another reference added. The data is only read during the call, so it can point
+		// straight into a mapped file. Give the module back with ShaderModule::Release.
+		ShaderModule* LoadShaderModule(const uint32_t* data, size_t dataLength);
 
 		~Core();
 		const Handles* GetHandles() const;
@@ -144,26 +303,113 @@ namespace R2::VK
 			Texture* Texture;
 			uint64_t BufferOffset;
 			int numMips;
+			// Set for the chunks of a streamed texture, which each cover a range of block
+			// rows in a range of layers of a single mip
+			bool IsRegion;
+			uint32_t MipLevel;
+			uint32_t LayerStart;
+			uint32_t LayerCount;
+			uint32_t RowStart;
+			uint32_t RowCount;
+		};
+
+		// An upload waiting for staging space, either because the ring was full or because
+		// it's too big to stage in one go. Progress is how much of Data has been staged, and
+		// SubmitFrame the frame that submits the latest of it.
+		struct DeferredUpload
+		{
+			Buffer* Buffer;
+			Texture* Texture;
+			std::vector<char> Data;
+			uint64_t DataOffset;
+			int NumMips;
+			UploadToken Token;
+			uint64_t Progress;
+			uint64_t SubmitFrame;
+			uint32_t NextMip;
+			uint32_t NextLayer;
+			uint32_t NextRow;
+		};
+
+		struct ThreadCommandPool
+		{
+			VkCommandPool Pool;
+			std::vector<VkCommandBuffer> Primaries;
+			std::vector<BarrierBatch*> PrimaryBarriers;
+			std::vector<VkCommandBuffer> Secondaries;
+			uint32_t NumPrimariesUsed;
+			uint32_t NumSecondariesUsed;
+			uint32_t NumSubmitted;
+		};
+
+		struct ThreadSubmission
+		{
+			int32_t Order;
+			uint32_t ThreadIndex;
+			uint32_t Sequence;
+			VkCommandBuffer CommandBuffer;
 		};
 
 		struct PerFrameResources
 		{
 			VkCommandBuffer CommandBuffer;
 			VkCommandBuffer UploadCommandBuffer;
-			VkSemaphore UploadSemaphore;
+			VkCommandBuffer AsyncComputeCommandBuffer;
+			VkCommandBuffer TransferCommandBuffer;
+			BarrierBatch* Barriers;
+			BarrierBatch* AsyncComputeBarriers;
+			bool AsyncComputeRecording;
+			bool AsyncComputeSubmitted;
+			PipelineStageFlags AsyncComputeWaitStage;
 			VkSemaphore Completion;
-			VkFence Fence;
+			uint64_t FrameNumber;
 			DeletionQueue* DeletionQueue;
-			std::mutex BufferUploadMutex;
 
-			std::vector<BufferUpload> BufferUploads;
-			std::vector<BufferToTextureCopy> BufferToTextureCopies;
-			uint64_t StagingOffset;
-			Buffer* StagingBuffer;
-			char* StagingMapped;
+			std::vector<ThreadCommandPool> ThreadPools;
+			std::mutex ThreadSubmissionMutex;
+			std::vector<ThreadSubmission> ThreadSubmissions;
+
+			// The DescriptorSet objects are reused along with the pools
+			std::mutex TransientDescriptorMutex;
+			DescriptorPoolChain* TransientDescriptorPools;
+			std::vector<DescriptorSet*> TransientDescriptorSets;
+			uint32_t NumTransientDescriptorSetsUsed;
 		};
 
-		void writeFrameUploadCommands(uint32_t index, VkCommandBuffer cb);
+		bool reserveStaging(uint64_t size, uint64_t& offset);
+		bool reserveStagingLocked(uint64_t size, uint64_t& offset);
+		void closeStagingWindow();
+		UploadToken publishBufferUpload(Buffer* buffer, const void* data, uint64_t dataSize, uint64_t dataOffset,
+		                                uint64_t stagingOffset);
+		UploadToken publishTextureCopy(const BufferToTextureCopy& copy, const void* data, uint64_t dataSize);
+		UploadToken deferUpload(Buffer* buffer, Texture* texture, const void* data, uint64_t dataSize,
+		                        uint64_t dataOffset, int numMips);
+		bool hasDeferredUploadsTo(const void* destination) const;
+		bool isDeferredUploadPending(UploadToken token) const;
+		uint64_t stageNextChunk(DeferredUpload& upload, uint64_t maxChunkSize);
+		uint64_t stageTextureChunk(DeferredUpload& upload, uint64_t maxChunkSize);
+		void stageDeferredUploads();
+		void writeFrameUploadCommands(VkCommandBuffer cb);
+		PipelineStageFlags writeTransferUploadCommands(VkCommandBuffer transferCb, VkCommandBuffer graphicsCb);
+		void writeBufferUploads(const std::vector<BufferUpload>& uploads, VkCommandBuffer cb);
+		std::vector<Texture*> writeTextureCopies(const std::vector<BufferToTextureCopy>& copies, VkCommandBuffer cb);
+		static void addTextureCopyRegions(const BufferToTextureCopy& copy, std::vector<VkBufferImageCopy>& regions);
+		static bool textureCopiesOverlap(const BufferToTextureCopy& a, const BufferToTextureCopy& b);
+		void writeTextureTransitions(const std::vector<Texture*>& textures, VkCommandBuffer cb, ImageLayout layout,
+		                             AccessFlags access, PipelineStageFlags stage);
+		bool hasTransferQueue() const;
+		bool fitsTransferGranularity(const BufferToTextureCopy& copy) const;
+		void writeUploadVisibilityBarrier(VkCommandBuffer cb);
+		VkCommandBuffer allocateThreadCommandBuffer(uint32_t threadIndex, bool secondary);
+		uint32_t getQueueFamilyIndex(QueueType queue) const;
+		VkQueue getAsyncComputeQueue() const;
+		void countBarriers(uint32_t emitted, uint32_t elided, uint32_t merged);
+		Pipeline* findSharedPipeline(const std::string& key);
+		Pipeline* addSharedPipeline(const std::string& key, Pipeline* pipeline);
+		void releaseSharedPipeline(Pipeline* pipeline);
+		void releaseShaderModule(ShaderModule* mod);
+		// Called by resources as they're destroyed, to drop cached descriptor sets using them
+		void invalidateCachedDescriptors(const void* resource);
 
 		void setAllocCallbacks();
 		void createInstance(bool enableValidation, const char** instanceExts);
@@ -176,6 +422,8 @@ namespace R2::VK
 		void createCommandPool();
 		void createAllocator();
 		void createDescriptorPool();
+		DescriptorPoolChain* createTransientDescriptorPools();
+		void createPipelineCache(const void* data, size_t dataSize);
 
         DeletionQueue* getCurrentDq();
 
@@ -184,16 +432,81 @@ namespace R2::VK
 		GraphicsSupportedFeatures supportedFeatures;
 		VkDebugUtilsMessengerEXT messenger;
 		IDebugOutputReceiver* dbgOutRecv;
-		PerFrameResources perFrameResources[2];
+		PerFrameResources perFrameResources[MAX_FRAMES_IN_FLIGHT];
+		uint32_t numFramesInFlight;
+		bool headless;
+		uint32_t numRecordingThreads;
 		uint32_t frameIndex;
+		uint64_t frameNumber;
+		VkSemaphore frameTimeline;
+		VkCommandPool asyncComputeCommandPool;
+		VkSemaphore asyncComputeTimeline;
+		VkCommandPool transferCommandPool;
+		VkSemaphore transferTimeline;
+		// The transfer family's minImageTransferGranularity. Texture copies on that queue have to
+		// be whole mips or start and end on multiples of it.
+		uint32_t transferGranularity[3];
 		bool inFrame;
 		std::mutex queueMutex;
+		// Recording threads add to these, so they're reset at EndFrame rather than read in place
+		std::atomic<uint32_t> barriersEmitted;
+		std::atomic<uint32_t> barriersElided;
+		std::atomic<uint32_t> barriersMerged;
+		BarrierStats lastBarrierStats;
+
+		// Staging space comes from a single ring that spans frames. Threads copy into a window
+		// reserved from it, claiming space with an atomic add and registering in stagingWriters
+		// while they copy. uploadMutex guards the ring, the window and deferred uploads.
+		std::mutex uploadMutex;
+		std::atomic<uint64_t> stagingCursor;
+		uint64_t stagingWindowEnd;
+		uint64_t stagingWindowSize;
+		std::atomic<bool> stagingWindowOpen;
+		std::atomic<uint32_t> stagingWriters;
+
+		// Uploads recorded at the next EndFrame, which submits them as frame uploadSubmitFrame.
+		// The lock is only held to add to the lists.
+		std::mutex uploadListMutex;
+		uint64_t uploadSubmitFrame;
+		std::vector<BufferUpload> bufferUploads;
+		std::vector<BufferToTextureCopy> bufferToTextureCopies;
+		// Uploads to resources the GPU hasn't used yet, which can go through the transfer queue
+		std::vector<BufferUpload> transferBufferUploads;
+		std::vector<BufferToTextureCopy> transferTextureCopies;
+		// Uploads waiting for staging space, in the order they were queued. Only uploads to the
+		// same buffer or texture have to stay in that order, so deferredDestinations counts the
+		// waiting uploads to each one.
+		std::deque<DeferredUpload> deferredUploads;
+		std::atomic<bool> hasDeferredUploads;
+		std::unordered_map<const void*, uint32_t> deferredDestinations;
+		uint64_t uploadChunkSize;
+		// Deferred uploads with all of their data staged, mapped to the frame that submits the
+		// last of it. They're dropped once that frame has finished.
+		UploadToken nextUploadToken;
+		std::unordered_map<UploadToken, uint64_t> stagedUploadFrames;
+		StagingRing* stagingRing;
+		DescriptorPoolChain* descriptorPools;
+		DescriptorSetCache* descriptorSetCache;
+		Buffer* stagingBuffer;
+		char* stagingMapped;
+
+		// Pipelines from BuildShared, keyed by the builder state that made them
+		std::mutex sharedPipelineMutex;
+		std::unordered_map<std::string, Pipeline*> sharedPipelines;
+		// Modules from LoadShaderModule, keyed by a hash of their SPIR-V
+		std::mutex shaderModuleMutex;
+		std::unordered_map<uint64_t, ShaderModule*> shaderModules;
 
 		friend class Buffer;
 		friend class DescriptorSet;
+		friend class DescriptorSetLayout;
+		friend class DescriptorSetUpdater;
         friend class Event;
 		friend class Pipeline;
+		friend class PipelineBuilder;
+		friend class ComputePipelineBuilder;
 		friend class Sampler;
+		friend class ShaderModule;
 		friend class Texture;
 		friend class TextureView;
 	};
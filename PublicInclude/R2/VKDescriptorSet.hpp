@@ -1,13 +1,17 @@
 #pragma once
 #include <stdint.h>
 #include <R2/VKEnums.hpp>
+#include <string>
 #include <vector>
 
 #define VK_DEFINE_HANDLE(object) typedef struct object##_T* object;
 VK_DEFINE_HANDLE(VkDescriptorSet)
 VK_DEFINE_HANDLE(VkDescriptorSetLayout)
+VK_DEFINE_HANDLE(VkDescriptorPool)
+VK_DEFINE_HANDLE(VkDescriptorUpdateTemplate)
 #undef VK_DEFINE_HANDLE
-
+struct VkDescriptorImageInfo;
+struct VkDescriptorBufferInfo;
 
 namespace R2::VK
 {
@@ -18,6 +22,24 @@ namespace R2::VK
     class Buffer;
     class Sampler;
     enum class ImageLayout : uint32_t;
+    class DescriptorSetLayout;
+
+    enum class DescriptorType : uint32_t
+    {
+        Sampler = 0,
+        CombinedImageSampler = 1,
+        SampledImage = 2,
+        StorageImage = 3,
+        UniformTexelBuffer = 4,
+        StorageTexelBuffer = 5,
+        UniformBuffer = 6,
+        StorageBuffer = 7,
+        UniformBufferDynamic = 8,
+        StorageBufferDynamic = 9,
+        InputAttachment = 10,
+        InlineUniformBlock = 1000138000,
+        AccelerationStructure = 1000150000
+    };
 
     class DescriptorSet
     {
@@ -28,6 +50,16 @@ namespace R2::VK
     private:
         Core* core;
         VkDescriptorSet set;
+        // Null for sets that weren't allocated by Core
+        DescriptorSetLayout* setLayout;
+        // Set for sets from Core's descriptor pool chain, which frees them itself. Others go
+        // back to Handles::DescriptorPool through the deletion queue.
+        bool pooled;
+        // Transient sets go back to their pool when it's reset, not when they're destroyed
+        bool transient;
+
+        friend class Core;
+        friend class DescriptorSetUpdater;
     };
 
     class DescriptorSetLayout
@@ -37,25 +69,29 @@ namespace R2::VK
         ~DescriptorSetLayout();
         VkDescriptorSetLayout GetNativeHandle();
     private:
+        struct DescriptorCount
+        {
+            uint32_t Binding;
+            DescriptorType Type;
+            uint32_t Count;
+            bool Variable;
+        };
+
+        // Returns false if the binding isn't in the update template
+        bool getTemplateIndex(uint32_t binding, uint32_t arrayElement, DescriptorType type, uint32_t& index) const;
+
         Core* core;
         VkDescriptorSetLayout layout;
-    };
+        // What a set with this layout takes up in a descriptor pool
+        std::vector<DescriptorCount> descriptorCounts;
+        // Writes every descriptor in the set at once, in binding order. Only made for small
+        // layouts of image and buffer descriptors without variable counts.
+        VkDescriptorUpdateTemplate updateTemplate;
+        uint32_t numTemplateDescriptors;
 
-    enum class DescriptorType : uint32_t
-    {
-        Sampler = 0,
-        CombinedImageSampler = 1,
-        SampledImage = 2,
-        StorageImage = 3,
-        UniformTexelBuffer = 4,
-        StorageTexelBuffer = 5,
-        UniformBuffer = 6,
-        StorageBuffer = 7,
-        UniformBufferDynamic = 8,
-        StorageBufferDynamic = 9,
-        InputAttachment = 10,
-        InlineUniformBlock = 1000138000,
-        AccelerationStructure = 1000150000
+        friend class DescriptorSetLayoutBuilder;
+        friend class DescriptorSetUpdater;
+        friend class DescriptorPoolChain;
     };
 
     class DescriptorSetLayoutBuilder
@@ -88,11 +124,20 @@ namespace R2::VK
     public:
         DescriptorSetUpdater(Core* core, DescriptorSet* ds);
         DescriptorSetUpdater(Core* core, DescriptorSet* ds, int numDescriptors);
+        // For GetCachedSet, which picks the set to write to
+        DescriptorSetUpdater(Core* core, DescriptorSetLayout* layout);
         DescriptorSetUpdater& AddTexture(uint32_t binding, uint32_t arrayElement, DescriptorType type, Texture* tex, Sampler* sampler = nullptr);
         DescriptorSetUpdater& AddTextureWithLayout(uint32_t binding, uint32_t arrayElement, DescriptorType type, Texture* tex, ImageLayout layout, Sampler* sampler = nullptr);
         DescriptorSetUpdater& AddTextureView(uint32_t binding, uint32_t arrayElement, DescriptorType type, TextureView* texView, Sampler* sampler = nullptr);
         DescriptorSetUpdater& AddBuffer(uint32_t binding, uint32_t arrayElement, DescriptorType type, Buffer* tex);
+        // Sets that are written in full go through the layout's update template; anything
+        // else is written with vkUpdateDescriptorSets
         void Update();
+        // Returns a set of the updater's layout with exactly these descriptors, reusing one from
+        // an earlier call if there is one. Descriptors have to be added in the same order to
+        // match. Cached sets are owned by Core and are deleted when anything they reference is
+        // destroyed, so they shouldn't be kept past that or deleted by the caller.
+        DescriptorSet* GetCachedSet();
     private:
         enum class DSWriteType
         {
@@ -119,8 +164,16 @@ namespace R2::VK
             Sampler* Sampler;
         };
 
+        bool updateWithTemplate();
+        void writeCacheKey(std::string& key, std::vector<const void*>& resources) const;
+        static void fillImageInfo(const DSWrite& dw, VkDescriptorImageInfo& dii);
+        static void fillBufferInfo(const DSWrite& dw, VkDescriptorBufferInfo& dbi);
+
         std::vector<DSWrite> descriptorWrites;
+        Core* core;
         const Handles* handles;
         DescriptorSet* ds;
+        // Only set for updaters made for GetCachedSet
+        DescriptorSetLayout* layout;
     };
 }
\ No newline at end of file
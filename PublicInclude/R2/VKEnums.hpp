@@ -102,4 +102,11 @@ namespace R2::VK
     {
         return a = a | b;
     }
+
+    enum class QueueType : uint32_t
+    {
+        Graphics,
+        AsyncCompute,
+        Transfer
+    };
 }
\ No newline at end of file
@@ -1,4 +1,6 @@
 #pragma once
+#include <stdint.h>
+#include <R2/VKCore.hpp>
 
 namespace R2::VK
 {
@@ -8,7 +10,8 @@ namespace R2::VK
 
     class FrameSeparatedBuffer
     {
-        Buffer* buffers[2];
+        Buffer* buffers[MAX_FRAMES_IN_FLIGHT];
+        uint32_t numBuffers;
         Core* core;
     public:
         FrameSeparatedBuffer(Core* core, const BufferCreateInfo& bci);
@@ -1,6 +1,8 @@
 #pragma once
 #include <stdint.h>
 #include <vector>
+#include <string>
+#include <atomic>
 #include <R2/VKEnums.hpp>
 
 #define VK_DEFINE_HANDLE(object) typedef struct object##_T* object;
@@ -11,6 +13,7 @@ VK_DEFINE_HANDLE(VkDescriptorSetLayout)
 #undef VK_DEFINE_HANDLE
 
 struct VkPipelineShaderStageCreateInfo;
+struct VkComputePipelineCreateInfo;
 
 namespace R2::VK
 {
@@ -18,6 +21,7 @@ namespace R2::VK
     enum class TextureFormat;
     class DescriptorSetLayout;
     class Core;
+    struct GraphicsPipelineCreateData;
 
     struct VertexAttribute
     {
@@ -59,15 +63,42 @@ namespace R2::VK
         FrontAndBack = 3
     };
 
+    enum class PolygonMode
+    {
+        Fill = 0,
+        Line = 1,
+        Point = 2
+    };
+
     class ShaderModule
     {
     public:
         ShaderModule(const Handles* handles, const uint32_t* data, size_t dataLength);
         ~ShaderModule();
         VkShaderModule GetNativeHandle();
+
+        // Modules start with one reference, and are destroyed when the last one is released.
+        // Modules from Core::LoadShaderModule must be released rather than deleted.
+        void AddRef();
+        void Release();
     private:
+        ShaderModule(const Handles* handles, const uint32_t* data, size_t dataLength, uint64_t codeHash);
+
         VkShaderModule mod;
         const Handles* handles;
+        std::atomic<uint32_t> refCount;
+        // Set for modules from Core::LoadShaderModule, which keeps their SPIR-V to tell a
+        // hash collision apart from the same code
+        Core* core;
+        std::vector<uint32_t> code;
+        uint64_t codeHash;
+        // Never reused, unlike the handle, so shared pipelines can be keyed on it. Loading the
+        // same SPIR-V again returns the same module, so pipelines built from it still match.
+        uint64_t id;
+
+        friend class Core;
+        friend class PipelineBuilder;
+        friend class ComputePipelineBuilder;
     };
 
     class PipelineLayout
@@ -79,6 +110,11 @@ namespace R2::VK
     private:
         const Handles* handles;
         VkPipelineLayout layout;
+        // Never reused, unlike the handle, so shared pipelines can be keyed on it
+        uint64_t id;
+
+        friend class PipelineBuilder;
+        friend class ComputePipelineBuilder;
     };
 
     class PipelineLayoutBuilder
@@ -108,9 +144,20 @@ namespace R2::VK
         Pipeline(Core* core, VkPipeline pipeline);
         ~Pipeline();
         VkPipeline GetNativeHandle();
+
+        // Pipelines start with one reference, and are destroyed when the last one is released.
+        // Pipelines from BuildShared must be released rather than deleted.
+        void AddRef();
+        void Release();
     private:
         Core* core;
         VkPipeline pipeline;
+        std::atomic<uint32_t> refCount;
+        // Set for pipelines from BuildShared, which Core looks up by this key
+        std::string sharedKey;
+        bool isShared;
+
+        friend class Core;
     };
 
     class PipelineBuilder
@@ -135,8 +182,21 @@ namespace R2::VK
         PipelineBuilder& DepthBias(bool enable);
         PipelineBuilder& ConstantDepthBias(float b);
         PipelineBuilder& SlopeDepthBias(float b);
+        PipelineBuilder& PolygonMode(PolygonMode mode);
+        // Leaves cull mode, depth test, depth write, depth compare op, depth bias and polygon
+        // mode (if GraphicsSupportedFeatures::DynamicPolygonMode) to be set on the command
+        // buffer, along with the topology within its class (points, lines or triangles).
+        // They have to be set before drawing, and the values given to the builder are ignored.
+        // Requires GraphicsSupportedFeatures::ExtendedDynamicState.
+        PipelineBuilder& ExtendedDynamicState(bool enable);
         Pipeline* Build();
+        // Returns the pipeline an identical builder already made if there is one, with another
+        // reference added. Give it back with Pipeline::Release.
+        Pipeline* BuildShared();
     private:
+        void fillCreateData(GraphicsPipelineCreateData& data) const;
+        void writeStateKey(std::string& key) const;
+
         Core* core;
 
         struct ShaderStageCreateInfo {
@@ -151,6 +211,7 @@ namespace R2::VK
         Topology topology = Topology::TriangleList;
         VK::CullMode cullMode = VK::CullMode::Back;
         VkPipelineLayout layout;
+        uint64_t layoutId = 0;
         bool alphaBlend = false;
         bool alphaToCoverage = false;
         bool additiveBlend = false;
@@ -162,6 +223,10 @@ namespace R2::VK
         CompareOp depthCompareOp = CompareOp::Always;
         int numSamples = 1;
         uint32_t viewMask = 0;
+        VK::PolygonMode polygonMode = VK::PolygonMode::Fill;
+        bool extendedDynamicState = false;
+
+        friend class PipelineCompiler;
     };
 
     class ComputePipelineBuilder
@@ -171,9 +236,16 @@ namespace R2::VK
         ComputePipelineBuilder& SetShader(ShaderModule& mod);
         ComputePipelineBuilder& Layout(PipelineLayout* layout);
         Pipeline* Build();
+        // See PipelineBuilder::BuildShared
+        Pipeline* BuildShared();
     private:
+        void fillCreateInfo(VkComputePipelineCreateInfo& cpci) const;
+
         Core* core;
         ShaderModule* shaderModule;
         VkPipelineLayout pipelineLayout;
+        uint64_t layoutId = 0;
+
+        friend class PipelineCompiler;
     };
 }
\ No newline at end of file
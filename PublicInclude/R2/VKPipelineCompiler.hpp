@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace R2::VK
+{
+    class Core;
+    class Pipeline;
+    class PipelineBuilder;
+    class ComputePipelineBuilder;
+
+    // A pipeline being compiled by a PipelineCompiler. Copies refer to the same pipeline.
+    // Draw code can check IsReady each frame and use a fallback pipeline until it is.
+    class PendingPipeline
+    {
+    public:
+        PendingPipeline();
+        bool IsReady() const;
+        // Null until the pipeline is ready
+        Pipeline* Get() const;
+        // Blocks until the pipeline is ready
+        Pipeline* Wait() const;
+    private:
+        struct State
+        {
+            std::atomic<Pipeline*> Result;
+            std::atomic<bool> Ready;
+            std::mutex Mutex;
+            std::condition_variable Done;
+        };
+
+        std::shared_ptr<State> state;
+
+        friend class PipelineCompiler;
+    };
+
+    // Compiles pipelines on a pool of worker threads. The builder's state is captured when
+    // the compile is queued, but its shader modules and layout have to stay alive until the
+    // pipeline is ready.
+    class PipelineCompiler
+    {
+    public:
+        PipelineCompiler(Core* core, uint32_t numThreads);
+        // Waits for everything that's been queued to finish compiling
+        ~PipelineCompiler();
+
+        PendingPipeline Compile(const PipelineBuilder& builder);
+        PendingPipeline Compile(const ComputePipelineBuilder& builder);
+        // Creates all of the pipelines with a single vkCreateGraphicsPipelines call, which lets
+        // the driver spread the work across its own threads
+        void CompileBatch(const PipelineBuilder* builders, uint32_t count, PendingPipeline* pendingPipelines);
+
+        uint32_t GetNumQueued() const;
+    private:
+        struct Job;
+
+        void queueJob(Job* job);
+        void workerThread();
+        void runJob(Job* job);
+
+        Core* core;
+        std::vector<std::thread> workers;
+        std::mutex queueMutex;
+        std::condition_variable queueCondition;
+        std::deque<Job*> queue;
+        std::atomic<uint32_t> numQueued;
+        bool stopping;
+    };
+}
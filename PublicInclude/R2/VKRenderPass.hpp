@@ -3,6 +3,7 @@
 
 #define VK_DEFINE_HANDLE(object) typedef struct object##_T* object;
 VK_DEFINE_HANDLE(VkCommandBuffer)
+VK_DEFINE_HANDLE(VkRenderPass)
 #undef VK_DEFINE_HANDLE
 
 namespace R2::VK
@@ -77,8 +78,16 @@ namespace R2::VK
         RenderPass& ViewMask(uint32_t viewMask);
 
         void Begin(CommandBuffer cb);
+        // Begins the pass with its contents coming from secondary command buffers, which
+        // are recorded with Core::BeginThreadSecondaryCommandBuffer and run with
+        // CommandBuffer::ExecuteCommands.
+        void BeginSecondary(CommandBuffer cb);
         void End(CommandBuffer cb);
     private:
+        void begin(CommandBuffer cb, bool secondaryContents);
+        VkRenderPass getLegacyRenderPass() const;
+        void beginSecondaryCommandBuffer(VkCommandBuffer secondary) const;
+
         struct AttachmentInfo
         {
             Texture* Texture;
@@ -102,5 +111,7 @@ namespace R2::VK
         uint32_t viewMask;
         FragmentShadingRateAttachmentInfo fragmentShadingRateAttachment;
         bool useFragmentShadingRateAttachment;
+
+        friend class Core;
     };
 }
\ No newline at end of file
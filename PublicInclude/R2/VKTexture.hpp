@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include <vector>
 
 #define VK_DEFINE_HANDLE(object) typedef struct object##_T* object;
 VK_DEFINE_HANDLE(VkImage)
@@ -10,6 +11,9 @@ VK_DEFINE_HANDLE(VmaAllocation)
 
 typedef uint32_t VkFlags;
 typedef VkFlags VkImageAspectFlags;
+struct VkImageMemoryBarrier2;
+struct VkImageCreateInfo;
+struct VkMemoryRequirements;
 
 namespace R2::VK
 {
@@ -34,6 +38,7 @@ namespace R2::VK
 
     enum class AccessFlags : uint64_t;
     enum class PipelineStageFlags : uint64_t;
+    enum class QueueType : uint32_t;
 
     enum class TextureFormat
     {
@@ -366,6 +371,32 @@ namespace R2::VK
         uint8_t BytesPerBlock;
     };
 
+    // A range of mip levels and array layers. Remaining extends a range to the end of the texture.
+    struct TextureSubresourceRange
+    {
+        static constexpr uint32_t Remaining = ~0u;
+
+        static TextureSubresourceRange All()
+        {
+            return TextureSubresourceRange{ 0, Remaining, 0, Remaining };
+        }
+
+        static TextureSubresourceRange Mip(uint32_t mip)
+        {
+            return TextureSubresourceRange{ mip, 1, 0, Remaining };
+        }
+
+        static TextureSubresourceRange Layer(uint32_t layer)
+        {
+            return TextureSubresourceRange{ 0, Remaining, layer, 1 };
+        }
+
+        uint32_t MipStart;
+        uint32_t MipCount;
+        uint32_t LayerStart;
+        uint32_t LayerCount;
+    };
+
     TextureBlockInfo GetTextureBlockInfo(TextureFormat format);
     uint64_t CalculateTextureByteSize(TextureFormat format, uint32_t width, uint32_t height, uint32_t layers = 1);
 
@@ -421,6 +452,9 @@ namespace R2::VK
     public:
         Texture(Core* core, const TextureCreateInfo& createInfo);
         Texture(Core* core, VkImage image, ImageLayout layout, const TextureCreateInfo& createInfo, uint32_t usageFlags);
+        // Places the texture at memoryOffset in memory it shares with other textures, which
+        // isn't freed along with it. See Core::CreateAliasedTexture.
+        Texture(Core* core, const TextureCreateInfo& createInfo, VmaAllocation memory, uint64_t memoryOffset);
         VkImage GetNativeHandle();
         VkImage ReleaseHandle();
         VkImageView GetView();
@@ -435,9 +469,44 @@ namespace R2::VK
         uint32_t GetUsageFlags();
         uint32_t GetImageFlags();
 
+        // Not thread safe. Only acquire a texture from one command buffer per frame, see
+        // Core::BeginThreadCommandBuffer.
         void Acquire(CommandBuffer cb, ImageLayout layout, AccessFlags access, PipelineStageFlags stage);
+        // Only transitions the given mips and layers. The rest of the texture keeps its current state.
+        void Acquire(CommandBuffer cb, TextureSubresourceRange range, ImageLayout layout, AccessFlags access, PipelineStageFlags stage);
+
+        // Queue family ownership transfer. Record the release on the queue giving the texture up,
+        // then the acquire on the receiving queue once it has waited for the release's submission.
+        void ReleaseOwnership(CommandBuffer cb, QueueType srcQueue, QueueType dstQueue, ImageLayout layout);
+        void AcquireOwnership(CommandBuffer cb, QueueType srcQueue, QueueType dstQueue, AccessFlags access, PipelineStageFlags stage);
+
+        // Drops the contents, so the next Acquire transitions from the undefined layout. It still
+        // waits for earlier accesses to finish and makes earlier writes available.
+        void Discard();
+        // Also waits for otherStages and otherWrites, for when another texture was using the same memory
+        void Discard(PipelineStageFlags otherStages, AccessFlags otherWrites);
         ~Texture();
     private:
+        struct SubresourceState
+        {
+            ImageLayout Layout;
+            // The last write or layout transition, which later accesses have to wait for
+            AccessFlags WriteAccess;
+            PipelineStageFlags WriteStage;
+            // Reads since then that have already waited for it
+            AccessFlags ReadAccess;
+            PipelineStageFlags ReadStage;
+
+            bool operator==(const SubresourceState& other) const = default;
+        };
+
+        // A block of subresources that are all in the same state
+        struct SubresourceRun
+        {
+            TextureSubresourceRange Range;
+            SubresourceState State;
+        };
+
         int width;
         int height;
         int depth;
@@ -449,19 +518,43 @@ namespace R2::VK
         uint32_t usageFlags;
         uint32_t imageFlags;
 
-        void WriteLayoutTransition(CommandBuffer cb, ImageLayout layout);
-        void WriteLayoutTransition(CommandBuffer cb, ImageLayout oldLayout, ImageLayout newLayout);
+        void writeOwnershipBarrier(CommandBuffer cb, uint32_t srcFamily, uint32_t dstFamily, TextureSubresourceRange range,
+            ImageLayout oldLayout, ImageLayout newLayout, AccessFlags srcAccess, PipelineStageFlags srcStage,
+            AccessFlags dstAccess, PipelineStageFlags dstStage);
+        void fillBarrier(VkImageMemoryBarrier2& imb, TextureSubresourceRange range, ImageLayout oldLayout, ImageLayout newLayout,
+            AccessFlags srcAccess, PipelineStageFlags srcStage, AccessFlags dstAccess, PipelineStageFlags dstStage) const;
+        static bool planAccess(const SubresourceState& from, ImageLayout layout, AccessFlags access, PipelineStageFlags stage,
+            AccessFlags& srcAccess, PipelineStageFlags& srcStage, SubresourceState& to);
+        static SubresourceState stateAfterBarrier(ImageLayout layout, AccessFlags access, PipelineStageFlags stage);
+
+        TextureSubresourceRange resolveRange(TextureSubresourceRange range) const;
+        bool isWholeTexture(TextureSubresourceRange range) const;
+        bool hasUniformState() const;
+        void getSubresourceRuns(TextureSubresourceRange range, std::vector<SubresourceRun>& runs) const;
+        void setSubresourceState(TextureSubresourceRange range, const SubresourceState& state);
+
+        void createView(const TextureCreateInfo& createInfo, const VkImageCreateInfo& ici, bool forceSRGBView);
+        static void getMemoryRequirements(Core* core, const TextureCreateInfo& createInfo, VkMemoryRequirements& requirements);
 
         VkImageAspectFlags getAspectFlags() const;
         Core* core;
         VkImage image;
         VkImageView imageView;
         VmaAllocation allocation;
-        ImageLayout lastLayout;
-        AccessFlags lastAccess;
-        PipelineStageFlags lastPipelineStage;
+        // The state of the whole texture while every subresource shares one
+        SubresourceState uniformState;
+        // Per mip and layer state, indexed by mip * layers + layer. Empty while the state is uniform.
+        std::vector<SubresourceState> subresourceStates;
+        // What each part of the texture looked like when ownership was released, so the
+        // acquire can repeat the same layout transitions
+        std::vector<SubresourceRun> ownershipRuns;
+        // The last frame whose uploads included this texture, and whether they went through the
+        // transfer queue. All of a texture's copies in one frame go to the same queue.
+        uint64_t uploadFrame;
+        bool uploadOnTransferQueue;
 
         friend class CommandBuffer;
+        friend class Core;
     };
 
     struct TextureSubset
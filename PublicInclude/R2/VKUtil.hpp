@@ -23,6 +23,7 @@ namespace R2::VK
     enum class AccessFlags : uint64_t;
     enum class PipelineStageFlags : uint64_t;
     PipelineStageFlags getPipelineStage(AccessFlags access);
+    bool isWriteAccess(AccessFlags access);
 
     inline int mipScale(int val, int mip)
     {
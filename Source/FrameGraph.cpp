@@ -0,0 +1,834 @@
+#include <R2/FrameGraph.hpp>
+#include <R2/VK.hpp>
+#include <assert.h>
+#include <algorithm>
+#include <string>
+
+namespace R2
+{
+    enum class AttachmentType
+    {
+        None,
+        Color,
+        Depth
+    };
+
+    struct RenderGraph::Resource
+    {
+        std::string Name;
+        bool IsTexture;
+        bool Imported;
+        VK::TextureCreateInfo TextureInfo;
+        VK::BufferCreateInfo BufferInfo;
+        VK::Texture* Texture;
+        VK::Buffer* Buffer;
+
+        // Filled in by Compile. Lifetimes are in pass indices.
+        uint32_t FirstPass;
+        uint32_t LastPass;
+        VK::PipelineStageFlags UsedStages;
+        VK::AccessFlags UsedWriteAccess;
+        bool Aliased;
+        // Everything the other textures in the same memory are used at, and the writes they
+        // make that have to be made available before the memory is reused
+        VK::PipelineStageFlags AliasWaitStage;
+        VK::AccessFlags AliasWaitAccess;
+    };
+
+    struct RenderGraph::ResourceAccess
+    {
+        uint32_t Resource;
+        VK::ImageLayout Layout;
+        VK::AccessFlags Access;
+        VK::PipelineStageFlags Stage;
+        bool IsWrite;
+        // False when the access replaces everything that was there, like a cleared attachment
+        bool ReadsContents;
+
+        AttachmentType Attachment;
+        bool Clear;
+        VK::ClearValue ClearValue;
+
+        // Filled in by Compile
+        VK::LoadOp LoadOp;
+        VK::StoreOp StoreOp;
+        bool Discard;
+    };
+
+    struct RenderGraph::Pass
+    {
+        std::string Name;
+        ExecuteFunction Execute;
+        std::vector<ResourceAccess> Accesses;
+        uint32_t NumColorAttachments;
+        bool HasDepthAttachment;
+        bool HasSideEffects;
+        bool Culled;
+    };
+
+    struct RenderGraph::PooledTexture
+    {
+        VK::TextureCreateInfo Info;
+        VK::Texture* Texture;
+        bool InUse;
+    };
+
+    struct RenderGraph::PooledBuffer
+    {
+        VK::BufferCreateInfo Info;
+        VK::Buffer* Buffer;
+        bool InUse;
+    };
+
+    struct RenderGraph::AliasedTexture
+    {
+        VK::TextureCreateInfo Info;
+        uint32_t FirstPass;
+        uint32_t LastPass;
+        uint64_t Size;
+        uint64_t Alignment;
+        uint32_t MemoryTypeBits;
+        uint32_t Heap;
+        uint64_t Offset;
+        VK::Texture* Texture;
+    };
+
+    struct RenderGraph::AliasHeap
+    {
+        VmaAllocation Memory;
+        uint32_t MemoryTypeBits;
+        uint64_t Size;
+        uint64_t Alignment;
+    };
+
+    bool sameTextureCreateInfo(const VK::TextureCreateInfo& a, const VK::TextureCreateInfo& b)
+    {
+        return a.Width == b.Width && a.Height == b.Height && a.Depth == b.Depth &&
+            a.Layers == b.Layers && a.NumMips == b.NumMips && a.IsRenderTarget == b.IsRenderTarget &&
+            a.Format == b.Format && a.Dimension == b.Dimension && a.Samples == b.Samples &&
+            a.CanUseAsStorage == b.CanUseAsStorage && a.IsTransient == b.IsTransient &&
+            a.CanSample == b.CanSample && a.CanTransfer == b.CanTransfer &&
+            a.CanUseAsShadingRateAttachment == b.CanUseAsShadingRateAttachment;
+    }
+
+    bool sameBufferCreateInfo(const VK::BufferCreateInfo& a, const VK::BufferCreateInfo& b)
+    {
+        return a.Usage == b.Usage && a.Size == b.Size && a.Mappable == b.Mappable;
+    }
+
+    bool lifetimesOverlap(uint32_t firstA, uint32_t lastA, uint32_t firstB, uint32_t lastB)
+    {
+        return firstA <= lastB && firstB <= lastA;
+    }
+
+    uint64_t alignOffset(uint64_t offset, uint64_t alignment)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    RenderGraphBuilder::RenderGraphBuilder(RenderGraph* graph, uint32_t passIndex)
+        : graph(graph)
+        , passIndex(passIndex)
+    {
+    }
+
+    RenderGraphTexture RenderGraphBuilder::CreateTexture(const char* name, const VK::TextureCreateInfo& createInfo)
+    {
+        uint32_t index = graph->addResource(name, true);
+        graph->resources[index].TextureInfo = createInfo;
+
+        return RenderGraphTexture{ index };
+    }
+
+    RenderGraphBuffer RenderGraphBuilder::CreateBuffer(const char* name, const VK::BufferCreateInfo& createInfo)
+    {
+        uint32_t index = graph->addResource(name, false);
+        graph->resources[index].BufferInfo = createInfo;
+
+        return RenderGraphBuffer{ index };
+    }
+
+    void RenderGraphBuilder::ReadTexture(RenderGraphTexture tex, VK::ImageLayout layout, VK::AccessFlags access, VK::PipelineStageFlags stage)
+    {
+        assert(tex.IsValid() && graph->resources[tex.Index].IsTexture);
+
+        RenderGraph::ResourceAccess ra{};
+        ra.Resource = tex.Index;
+        ra.Layout = layout;
+        ra.Access = access;
+        ra.Stage = stage;
+        ra.IsWrite = false;
+        ra.ReadsContents = true;
+        ra.Attachment = AttachmentType::None;
+
+        graph->passes[passIndex].Accesses.push_back(ra);
+    }
+
+    void RenderGraphBuilder::WriteTexture(RenderGraphTexture tex, VK::ImageLayout layout, VK::AccessFlags access, VK::PipelineStageFlags stage)
+    {
+        assert(tex.IsValid() && graph->resources[tex.Index].IsTexture);
+
+        RenderGraph::ResourceAccess ra{};
+        ra.Resource = tex.Index;
+        ra.Layout = layout;
+        ra.Access = access;
+        ra.Stage = stage;
+        ra.IsWrite = true;
+        ra.ReadsContents = true;
+        ra.Attachment = AttachmentType::None;
+
+        graph->passes[passIndex].Accesses.push_back(ra);
+    }
+
+    void RenderGraphBuilder::ReadBuffer(RenderGraphBuffer buf, VK::AccessFlags access, VK::PipelineStageFlags stage)
+    {
+        assert(buf.IsValid() && !graph->resources[buf.Index].IsTexture);
+
+        RenderGraph::ResourceAccess ra{};
+        ra.Resource = buf.Index;
+        ra.Access = access;
+        ra.Stage = stage;
+        ra.IsWrite = false;
+        ra.ReadsContents = true;
+        ra.Attachment = AttachmentType::None;
+
+        graph->passes[passIndex].Accesses.push_back(ra);
+    }
+
+    void RenderGraphBuilder::WriteBuffer(RenderGraphBuffer buf, VK::AccessFlags access, VK::PipelineStageFlags stage)
+    {
+        assert(buf.IsValid() && !graph->resources[buf.Index].IsTexture);
+
+        RenderGraph::ResourceAccess ra{};
+        ra.Resource = buf.Index;
+        ra.Access = access;
+        ra.Stage = stage;
+        ra.IsWrite = true;
+        ra.ReadsContents = true;
+        ra.Attachment = AttachmentType::None;
+
+        graph->passes[passIndex].Accesses.push_back(ra);
+    }
+
+    void RenderGraphBuilder::ColorAttachment(RenderGraphTexture tex)
+    {
+        attachment(tex, false, false, nullptr);
+    }
+
+    void RenderGraphBuilder::ColorAttachment(RenderGraphTexture tex, VK::ClearValue clearValue)
+    {
+        attachment(tex, false, true, &clearValue);
+    }
+
+    void RenderGraphBuilder::DepthAttachment(RenderGraphTexture tex)
+    {
+        attachment(tex, true, false, nullptr);
+    }
+
+    void RenderGraphBuilder::DepthAttachment(RenderGraphTexture tex, VK::ClearValue clearValue)
+    {
+        attachment(tex, true, true, &clearValue);
+    }
+
+    void RenderGraphBuilder::SetSideEffects()
+    {
+        graph->passes[passIndex].HasSideEffects = true;
+    }
+
+    void RenderGraphBuilder::attachment(RenderGraphTexture tex, bool isDepth, bool clear, const VK::ClearValue* clearValue)
+    {
+        assert(tex.IsValid() && graph->resources[tex.Index].IsTexture);
+        RenderGraph::Pass& pass = graph->passes[passIndex];
+
+        // Same access as RenderPass::Begin, which is what actually acquires attachments
+        RenderGraph::ResourceAccess ra{};
+        ra.Resource = tex.Index;
+        ra.Layout = VK::ImageLayout::AttachmentOptimal;
+        ra.IsWrite = true;
+        ra.ReadsContents = !clear;
+        ra.Clear = clear;
+
+        if (clear)
+            ra.ClearValue = *clearValue;
+
+        if (isDepth)
+        {
+            assert(!pass.HasDepthAttachment);
+            pass.HasDepthAttachment = true;
+            ra.Attachment = AttachmentType::Depth;
+            ra.Access = VK::AccessFlags::DepthStencilAttachmentReadWrite;
+            ra.Stage = VK::PipelineStageFlags::LateFragmentTests;
+        }
+        else
+        {
+            assert(pass.NumColorAttachments < 4);
+            pass.NumColorAttachments++;
+            ra.Attachment = AttachmentType::Color;
+            ra.Access = VK::AccessFlags::ColorAttachmentReadWrite;
+            ra.Stage = VK::PipelineStageFlags::ColorAttachmentOutput;
+        }
+
+        pass.Accesses.push_back(ra);
+    }
+
+    RenderGraph::RenderGraph(VK::Core* core)
+        : core(core)
+        , numCulledPasses(0)
+        , compiled(false)
+    {
+    }
+
+    RenderGraph::~RenderGraph()
+    {
+        releaseAliasedTextures();
+
+        for (PooledTexture& pooled : texturePool)
+        {
+            core->DestroyTexture(pooled.Texture);
+        }
+
+        for (PooledBuffer& pooled : bufferPool)
+        {
+            core->DestroyBuffer(pooled.Buffer);
+        }
+    }
+
+    RenderGraphTexture RenderGraph::ImportTexture(const char* name, VK::Texture* texture)
+    {
+        uint32_t index = addResource(name, true);
+        resources[index].Imported = true;
+        resources[index].Texture = texture;
+
+        return RenderGraphTexture{ index };
+    }
+
+    RenderGraphBuffer RenderGraph::ImportBuffer(const char* name, VK::Buffer* buffer)
+    {
+        uint32_t index = addResource(name, false);
+        resources[index].Imported = true;
+        resources[index].Buffer = buffer;
+
+        return RenderGraphBuffer{ index };
+    }
+
+    void RenderGraph::AddPass(const char* name, const SetupFunction& setup, ExecuteFunction execute)
+    {
+        assert(!compiled);
+
+        Pass pass{};
+        pass.Name = name;
+        pass.Execute = std::move(execute);
+        passes.push_back(std::move(pass));
+
+        RenderGraphBuilder builder(this, (uint32_t)passes.size() - 1);
+        setup(builder);
+    }
+
+    void RenderGraph::Compile()
+    {
+        assert(!compiled);
+
+        cullPasses();
+        chooseAttachmentOps();
+        allocateTransients();
+
+        compiled = true;
+    }
+
+    void RenderGraph::Execute(VK::CommandBuffer cb)
+    {
+        assert(compiled);
+
+        for (Pass& pass : passes)
+        {
+            if (!pass.Culled)
+                executePass(cb, pass);
+        }
+    }
+
+    void RenderGraph::Reset()
+    {
+        resources.clear();
+        passes.clear();
+        numCulledPasses = 0;
+        compiled = false;
+    }
+
+    VK::Texture* RenderGraph::GetTexture(RenderGraphTexture tex)
+    {
+        assert(tex.IsValid() && tex.Index < resources.size() && resources[tex.Index].IsTexture);
+        return resources[tex.Index].Texture;
+    }
+
+    VK::Buffer* RenderGraph::GetBuffer(RenderGraphBuffer buf)
+    {
+        assert(buf.IsValid() && buf.Index < resources.size() && !resources[buf.Index].IsTexture);
+        return resources[buf.Index].Buffer;
+    }
+
+    uint32_t RenderGraph::GetNumPasses() const
+    {
+        return (uint32_t)passes.size();
+    }
+
+    uint32_t RenderGraph::GetNumCulledPasses() const
+    {
+        return numCulledPasses;
+    }
+
+    uint64_t RenderGraph::GetAliasedMemorySize() const
+    {
+        uint64_t size = 0;
+
+        for (const AliasHeap& heap : aliasHeaps)
+        {
+            size += heap.Size;
+        }
+
+        return size;
+    }
+
+    uint32_t RenderGraph::addResource(const char* name, bool isTexture)
+    {
+        assert(!compiled);
+
+        Resource resource{};
+        resource.Name = name;
+        resource.IsTexture = isTexture;
+        resource.Imported = false;
+        resource.Texture = nullptr;
+        resource.Buffer = nullptr;
+        resource.FirstPass = ~0u;
+        resource.LastPass = 0;
+        resource.UsedStages = VK::PipelineStageFlags::None;
+        resource.UsedWriteAccess = VK::AccessFlags::None;
+        resource.Aliased = false;
+        resource.AliasWaitStage = VK::PipelineStageFlags::None;
+        resource.AliasWaitAccess = VK::AccessFlags::None;
+        resources.push_back(resource);
+
+        return (uint32_t)resources.size() - 1;
+    }
+
+    void RenderGraph::cullPasses()
+    {
+        // Walk backwards keeping track of which resources have contents that a later pass
+        // still needs. A pass is only kept if it writes one of those. Imported resources are
+        // needed after the graph has run.
+        std::vector<bool> contentsNeeded(resources.size());
+
+        for (size_t i = 0; i < resources.size(); i++)
+        {
+            contentsNeeded[i] = resources[i].Imported;
+        }
+
+        numCulledPasses = 0;
+
+        for (size_t i = passes.size(); i-- > 0;)
+        {
+            Pass& pass = passes[i];
+            bool used = pass.HasSideEffects;
+
+            for (const ResourceAccess& access : pass.Accesses)
+            {
+                if (access.IsWrite && contentsNeeded[access.Resource])
+                    used = true;
+            }
+
+            pass.Culled = !used;
+
+            if (!used)
+            {
+                numCulledPasses++;
+                continue;
+            }
+
+            for (ResourceAccess& access : pass.Accesses)
+            {
+                access.StoreOp = contentsNeeded[access.Resource] ? VK::StoreOp::Store : VK::StoreOp::DontCare;
+            }
+
+            // Whatever this pass overwrites isn't needed before it, unless it reads it too
+            for (const ResourceAccess& access : pass.Accesses)
+            {
+                if (access.IsWrite && !access.ReadsContents)
+                    contentsNeeded[access.Resource] = false;
+            }
+
+            for (const ResourceAccess& access : pass.Accesses)
+            {
+                if (access.ReadsContents)
+                    contentsNeeded[access.Resource] = true;
+            }
+        }
+    }
+
+    void RenderGraph::chooseAttachmentOps()
+    {
+        std::vector<bool> hasContents(resources.size());
+        std::vector<bool> discarded(resources.size());
+
+        for (size_t i = 0; i < resources.size(); i++)
+        {
+            hasContents[i] = resources[i].Imported;
+        }
+
+        for (Pass& pass : passes)
+        {
+            if (pass.Culled)
+                continue;
+
+            for (ResourceAccess& access : pass.Accesses)
+            {
+                // Only attachments can make use of a partial write keeping nothing, so reading
+                // a transient before anything has written it is a mistake in the graph
+                assert(hasContents[access.Resource] || access.IsWrite);
+
+                if (access.Clear)
+                    access.LoadOp = VK::LoadOp::Clear;
+                else if (hasContents[access.Resource])
+                    access.LoadOp = VK::LoadOp::Load;
+                else
+                    access.LoadOp = VK::LoadOp::DontCare;
+
+                // Nothing earlier survives a clear, and a transient starts out with nothing,
+                // so the layout transition doesn't have to keep the old contents
+                access.Discard = resources[access.Resource].IsTexture &&
+                    (access.Clear || !hasContents[access.Resource]) &&
+                    !discarded[access.Resource];
+                discarded[access.Resource] = access.Discard;
+            }
+
+            for (const ResourceAccess& access : pass.Accesses)
+            {
+                if (access.IsWrite)
+                    hasContents[access.Resource] = true;
+
+                discarded[access.Resource] = false;
+            }
+        }
+    }
+
+    void RenderGraph::allocateTransients()
+    {
+        std::vector<bool> used(resources.size());
+
+        for (uint32_t i = 0; i < passes.size(); i++)
+        {
+            if (passes[i].Culled)
+                continue;
+
+            for (const ResourceAccess& access : passes[i].Accesses)
+            {
+                Resource& resource = resources[access.Resource];
+                used[access.Resource] = true;
+                resource.FirstPass = std::min(resource.FirstPass, i);
+                resource.LastPass = std::max(resource.LastPass, i);
+                resource.UsedStages |= access.Stage;
+
+                if (access.IsWrite)
+                    resource.UsedWriteAccess = resource.UsedWriteAccess | access.Access;
+            }
+        }
+
+        // Lazily allocated textures don't take up real memory, so only the rest are worth sharing
+        std::vector<uint32_t> aliasable;
+
+        for (uint32_t i = 0; i < resources.size(); i++)
+        {
+            const Resource& resource = resources[i];
+
+            if (used[i] && !resource.Imported && resource.IsTexture && !resource.TextureInfo.IsTransient)
+                aliasable.push_back(i);
+        }
+
+        placeAliasedTextures(aliasable);
+
+        for (PooledTexture& pooled : texturePool)
+        {
+            pooled.InUse = false;
+        }
+
+        for (PooledBuffer& pooled : bufferPool)
+        {
+            pooled.InUse = false;
+        }
+
+        for (size_t i = 0; i < resources.size(); i++)
+        {
+            Resource& resource = resources[i];
+
+            if (resource.Imported || resource.Aliased || !used[i])
+                continue;
+
+            if (resource.IsTexture)
+            {
+                for (PooledTexture& pooled : texturePool)
+                {
+                    if (!pooled.InUse && sameTextureCreateInfo(pooled.Info, resource.TextureInfo))
+                    {
+                        pooled.InUse = true;
+                        resource.Texture = pooled.Texture;
+                        break;
+                    }
+                }
+
+                if (resource.Texture == nullptr)
+                {
+                    resource.Texture = core->CreateTexture(resource.TextureInfo);
+                    resource.Texture->SetDebugName(resource.Name.c_str());
+                    texturePool.push_back({ resource.TextureInfo, resource.Texture, true });
+                }
+            }
+            else
+            {
+                for (PooledBuffer& pooled : bufferPool)
+                {
+                    if (!pooled.InUse && sameBufferCreateInfo(pooled.Info, resource.BufferInfo))
+                    {
+                        pooled.InUse = true;
+                        resource.Buffer = pooled.Buffer;
+                        break;
+                    }
+                }
+
+                if (resource.Buffer == nullptr)
+                {
+                    resource.Buffer = core->CreateBuffer(resource.BufferInfo);
+                    resource.Buffer->SetDebugName(resource.Name.c_str());
+                    bufferPool.push_back({ resource.BufferInfo, resource.Buffer, true });
+                }
+            }
+        }
+
+        // Anything this graph didn't need is freed, rather than held onto in case it comes back
+        for (size_t i = texturePool.size(); i-- > 0;)
+        {
+            if (texturePool[i].InUse)
+                continue;
+
+            core->DestroyTexture(texturePool[i].Texture);
+            texturePool.erase(texturePool.begin() + i);
+        }
+
+        for (size_t i = bufferPool.size(); i-- > 0;)
+        {
+            if (bufferPool[i].InUse)
+                continue;
+
+            core->DestroyBuffer(bufferPool[i].Buffer);
+            bufferPool.erase(bufferPool.begin() + i);
+        }
+    }
+
+    void RenderGraph::placeAliasedTextures(const std::vector<uint32_t>& aliasable)
+    {
+        bool layoutChanged = aliasable.size() != aliasedTextures.size();
+
+        for (size_t i = 0; i < aliasable.size() && !layoutChanged; i++)
+        {
+            const Resource& resource = resources[aliasable[i]];
+            const AliasedTexture& aliased = aliasedTextures[i];
+
+            layoutChanged = !sameTextureCreateInfo(resource.TextureInfo, aliased.Info) ||
+                resource.FirstPass != aliased.FirstPass || resource.LastPass != aliased.LastPass;
+        }
+
+        if (layoutChanged)
+        {
+            releaseAliasedTextures();
+
+            for (uint32_t resourceIndex : aliasable)
+            {
+                const Resource& resource = resources[resourceIndex];
+
+                AliasedTexture aliased{};
+                aliased.Info = resource.TextureInfo;
+                aliased.FirstPass = resource.FirstPass;
+                aliased.LastPass = resource.LastPass;
+                core->GetTextureMemoryRequirements(resource.TextureInfo, aliased.Size, aliased.Alignment, aliased.MemoryTypeBits);
+                aliasedTextures.push_back(aliased);
+            }
+
+            // Placing the biggest textures first leaves the smaller ones to fill in around them
+            std::vector<uint32_t> order(aliasedTextures.size());
+            for (uint32_t i = 0; i < order.size(); i++)
+            {
+                order[i] = i;
+            }
+
+            std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+            {
+                return aliasedTextures[a].Size > aliasedTextures[b].Size;
+            });
+
+            std::vector<bool> placed(aliasedTextures.size());
+
+            for (uint32_t index : order)
+            {
+                AliasedTexture& aliased = aliasedTextures[index];
+
+                aliased.Heap = (uint32_t)aliasHeaps.size();
+                for (uint32_t h = 0; h < aliasHeaps.size(); h++)
+                {
+                    if (aliasHeaps[h].MemoryTypeBits == aliased.MemoryTypeBits)
+                        aliased.Heap = h;
+                }
+
+                if (aliased.Heap == aliasHeaps.size())
+                    aliasHeaps.push_back({ nullptr, aliased.MemoryTypeBits, 0, 1 });
+
+                // Move past every texture in the way that's alive at the same time, until nothing is.
+                // The offset only ever goes up, so this always finishes.
+                uint64_t offset = 0;
+                bool moved = true;
+
+                while (moved)
+                {
+                    moved = false;
+
+                    for (uint32_t other = 0; other < aliasedTextures.size(); other++)
+                    {
+                        const AliasedTexture& o = aliasedTextures[other];
+
+                        if (!placed[other] || o.Heap != aliased.Heap ||
+                            !lifetimesOverlap(aliased.FirstPass, aliased.LastPass, o.FirstPass, o.LastPass))
+                            continue;
+
+                        if (offset < o.Offset + o.Size && o.Offset < offset + aliased.Size)
+                        {
+                            offset = alignOffset(o.Offset + o.Size, aliased.Alignment);
+                            moved = true;
+                        }
+                    }
+                }
+
+                aliased.Offset = offset;
+                placed[index] = true;
+
+                AliasHeap& heap = aliasHeaps[aliased.Heap];
+                heap.Size = std::max(heap.Size, offset + aliased.Size);
+                heap.Alignment = std::max(heap.Alignment, aliased.Alignment);
+            }
+
+            for (AliasHeap& heap : aliasHeaps)
+            {
+                heap.Memory = core->AllocateTextureMemory(heap.Size, heap.Alignment, heap.MemoryTypeBits);
+            }
+
+            for (uint32_t i = 0; i < aliasedTextures.size(); i++)
+            {
+                AliasedTexture& aliased = aliasedTextures[i];
+                aliased.Texture = core->CreateAliasedTexture(aliased.Info, aliasHeaps[aliased.Heap].Memory, aliased.Offset);
+                aliased.Texture->SetDebugName(resources[aliasable[i]].Name.c_str());
+            }
+        }
+
+        for (uint32_t i = 0; i < aliasable.size(); i++)
+        {
+            Resource& resource = resources[aliasable[i]];
+            resource.Texture = aliasedTextures[i].Texture;
+            resource.Aliased = true;
+        }
+
+        // A texture's first use has to wait for whatever else was in its memory, including
+        // textures from later in the previous frame, so wait for every stage they're used at
+        // and make their writes available
+        for (uint32_t i = 0; i < aliasable.size(); i++)
+        {
+            const AliasedTexture& aliased = aliasedTextures[i];
+            VK::PipelineStageFlags waitStage = VK::PipelineStageFlags::None;
+            VK::AccessFlags waitAccess = VK::AccessFlags::None;
+
+            for (uint32_t other = 0; other < aliasable.size(); other++)
+            {
+                const AliasedTexture& o = aliasedTextures[other];
+
+                if (other == i || o.Heap != aliased.Heap)
+                    continue;
+
+                if (aliased.Offset < o.Offset + o.Size && o.Offset < aliased.Offset + aliased.Size)
+                {
+                    waitStage |= resources[aliasable[other]].UsedStages;
+                    waitAccess = waitAccess | resources[aliasable[other]].UsedWriteAccess;
+                }
+            }
+
+            resources[aliasable[i]].AliasWaitStage = waitStage;
+            resources[aliasable[i]].AliasWaitAccess = waitAccess;
+        }
+    }
+
+    void RenderGraph::releaseAliasedTextures()
+    {
+        for (AliasedTexture& aliased : aliasedTextures)
+        {
+            core->DestroyTexture(aliased.Texture);
+        }
+
+        for (AliasHeap& heap : aliasHeaps)
+        {
+            core->FreeTextureMemory(heap.Memory);
+        }
+
+        aliasedTextures.clear();
+        aliasHeaps.clear();
+    }
+
+    void RenderGraph::executePass(VK::CommandBuffer cb, Pass& pass)
+    {
+        VK::RenderPass renderPass;
+        bool hasAttachments = false;
+
+        // Barriers are queued on the command buffer, so the whole pass's barriers are recorded
+        // together before its first command. Texture and Buffer skip the ones that aren't needed.
+        for (const ResourceAccess& access : pass.Accesses)
+        {
+            Resource& resource = resources[access.Resource];
+
+            if (!resource.IsTexture)
+            {
+                resource.Buffer->Acquire(cb, access.Access, access.Stage);
+                continue;
+            }
+
+            if (access.Discard)
+                resource.Texture->Discard(resource.AliasWaitStage, resource.AliasWaitAccess);
+
+            if (access.Attachment == AttachmentType::None)
+            {
+                resource.Texture->Acquire(cb, access.Layout, access.Access, access.Stage);
+                continue;
+            }
+
+            if (!hasAttachments)
+            {
+                renderPass.RenderArea(resource.Texture->GetWidth(), resource.Texture->GetHeight());
+                hasAttachments = true;
+            }
+
+            if (access.Attachment == AttachmentType::Color)
+            {
+                renderPass.ColorAttachment(resource.Texture, access.LoadOp, access.StoreOp);
+
+                if (access.Clear)
+                    renderPass.ColorAttachmentClearValue(access.ClearValue);
+            }
+            else
+            {
+                renderPass.DepthAttachment(resource.Texture, access.LoadOp, access.StoreOp);
+
+                if (access.Clear)
+                    renderPass.DepthAttachmentClearValue(access.ClearValue);
+            }
+        }
+
+        if (hasAttachments)
+            renderPass.Begin(cb);
+
+        pass.Execute(cb, *this);
+
+        if (hasAttachments)
+            renderPass.End(cb);
+    }
+}
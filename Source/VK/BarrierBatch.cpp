@@ -0,0 +1,197 @@
+#include <BarrierBatch.hpp>
+#include <VKSyncLegacyHelpers.hpp>
+
+namespace R2::VK
+{
+    bool sameSubresourceRange(const VkImageSubresourceRange& a, const VkImageSubresourceRange& b)
+    {
+        return a.aspectMask == b.aspectMask &&
+            a.baseMipLevel == b.baseMipLevel && a.levelCount == b.levelCount &&
+            a.baseArrayLayer == b.baseArrayLayer && a.layerCount == b.layerCount;
+    }
+
+    bool subresourceRangesOverlap(const VkImageSubresourceRange& a, const VkImageSubresourceRange& b)
+    {
+        return (a.aspectMask & b.aspectMask) != 0 &&
+            a.baseMipLevel < b.baseMipLevel + b.levelCount && b.baseMipLevel < a.baseMipLevel + a.levelCount &&
+            a.baseArrayLayer < b.baseArrayLayer + b.layerCount && b.baseArrayLayer < a.baseArrayLayer + a.layerCount;
+    }
+
+    uint64_t bufferRangeEnd(VkDeviceSize offset, VkDeviceSize size)
+    {
+        return size == VK_WHOLE_SIZE ? ~0ull : offset + size;
+    }
+
+    bool isOwnershipTransfer(uint32_t srcFamily, uint32_t dstFamily)
+    {
+        return srcFamily != dstFamily;
+    }
+
+    // Folds a later barrier on the same resource into a pending one. No commands can have
+    // run in between, so the pending barrier's source scope still covers everything and the
+    // later barrier's destination scope replaces the intermediate one.
+    template <typename T>
+    void mergeBarrier(T& pending, const T& barrier)
+    {
+        if (barrier.srcStageMask != pending.dstStageMask || barrier.srcAccessMask != pending.dstAccessMask)
+        {
+            pending.srcStageMask |= barrier.srcStageMask;
+            pending.srcAccessMask |= barrier.srcAccessMask;
+        }
+
+        pending.dstStageMask = barrier.dstStageMask;
+        pending.dstAccessMask = barrier.dstAccessMask;
+    }
+
+    BarrierBatch::BarrierBatch(VkCommandBuffer cb)
+        : cb(cb)
+    {
+    }
+
+    bool BarrierBatch::Add(const VkImageMemoryBarrier2& barrier)
+    {
+        bool transfersOwnership = isOwnershipTransfer(barrier.srcQueueFamilyIndex, barrier.dstQueueFamilyIndex);
+
+        for (VkImageMemoryBarrier2& pending : imageBarriers)
+        {
+            if (pending.image != barrier.image || !subresourceRangesOverlap(pending.subresourceRange, barrier.subresourceRange))
+                continue;
+
+            if (!transfersOwnership &&
+                !isOwnershipTransfer(pending.srcQueueFamilyIndex, pending.dstQueueFamilyIndex) &&
+                sameSubresourceRange(pending.subresourceRange, barrier.subresourceRange))
+            {
+                mergeBarrier(pending, barrier);
+                pending.newLayout = barrier.newLayout;
+                return false;
+            }
+
+            // Barriers in one dependency aren't ordered against each other, so a partial
+            // overlap has to wait for the pending barriers to be recorded first
+            Flush();
+            break;
+        }
+
+        imageBarriers.push_back(barrier);
+        return true;
+    }
+
+    bool BarrierBatch::Add(const VkBufferMemoryBarrier2& barrier)
+    {
+        bool transfersOwnership = isOwnershipTransfer(barrier.srcQueueFamilyIndex, barrier.dstQueueFamilyIndex);
+        uint64_t end = bufferRangeEnd(barrier.offset, barrier.size);
+
+        for (VkBufferMemoryBarrier2& pending : bufferBarriers)
+        {
+            if (pending.buffer != barrier.buffer ||
+                pending.offset >= end || barrier.offset >= bufferRangeEnd(pending.offset, pending.size))
+                continue;
+
+            if (!transfersOwnership &&
+                !isOwnershipTransfer(pending.srcQueueFamilyIndex, pending.dstQueueFamilyIndex) &&
+                pending.offset == barrier.offset && pending.size == barrier.size)
+            {
+                mergeBarrier(pending, barrier);
+                return false;
+            }
+
+            Flush();
+            break;
+        }
+
+        bufferBarriers.push_back(barrier);
+        return true;
+    }
+
+    void BarrierBatch::Flush()
+    {
+        if (IsEmpty())
+            return;
+
+        Write(cb, imageBarriers.data(), (uint32_t)imageBarriers.size(),
+              bufferBarriers.data(), (uint32_t)bufferBarriers.size());
+
+        imageBarriers.clear();
+        bufferBarriers.clear();
+    }
+
+    bool BarrierBatch::IsEmpty() const
+    {
+        return imageBarriers.empty() && bufferBarriers.empty();
+    }
+
+    void BarrierBatch::Write(VkCommandBuffer cb, const VkImageMemoryBarrier2* imageBarriers, uint32_t numImageBarriers,
+                             const VkBufferMemoryBarrier2* bufferBarriers, uint32_t numBufferBarriers)
+    {
+        if (numImageBarriers == 0 && numBufferBarriers == 0)
+            return;
+
+        if (vkCmdPipelineBarrier2 != NULL)
+        {
+            VkDependencyInfo depInfo{ VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+            depInfo.imageMemoryBarrierCount = numImageBarriers;
+            depInfo.pImageMemoryBarriers = imageBarriers;
+            depInfo.bufferMemoryBarrierCount = numBufferBarriers;
+            depInfo.pBufferMemoryBarriers = bufferBarriers;
+            depInfo.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+            vkCmdPipelineBarrier2(cb, &depInfo);
+            return;
+        }
+
+        // Legacy barriers share one pair of stage masks, so use the union of every barrier's stages
+        std::vector<VkImageMemoryBarrier> oldImageBarriers(numImageBarriers);
+        std::vector<VkBufferMemoryBarrier> oldBufferBarriers(numBufferBarriers);
+        VkPipelineStageFlags srcStages = 0;
+        VkPipelineStageFlags dstStages = 0;
+
+        for (uint32_t i = 0; i < numImageBarriers; i++)
+        {
+            const VkImageMemoryBarrier2& imb2 = imageBarriers[i];
+            VkImageMemoryBarrier& imb = oldImageBarriers[i];
+            imb = VkImageMemoryBarrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+            imb.oldLayout = imb2.oldLayout;
+            imb.newLayout = imb2.newLayout;
+            imb.subresourceRange = imb2.subresourceRange;
+            imb.image = imb2.image;
+            imb.srcQueueFamilyIndex = imb2.srcQueueFamilyIndex;
+            imb.dstQueueFamilyIndex = imb2.dstQueueFamilyIndex;
+            imb.srcAccessMask = getOldAccessFlags((AccessFlags)imb2.srcAccessMask);
+            imb.dstAccessMask = getOldAccessFlags((AccessFlags)imb2.dstAccessMask);
+
+            srcStages |= getOldPipelineStageFlags((PipelineStageFlags)imb2.srcStageMask);
+            dstStages |= getOldPipelineStageFlags((PipelineStageFlags)imb2.dstStageMask);
+        }
+
+        for (uint32_t i = 0; i < numBufferBarriers; i++)
+        {
+            const VkBufferMemoryBarrier2& bmb2 = bufferBarriers[i];
+            VkBufferMemoryBarrier& bmb = oldBufferBarriers[i];
+            bmb = VkBufferMemoryBarrier{ VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+            bmb.buffer = bmb2.buffer;
+            bmb.offset = bmb2.offset;
+            bmb.size = bmb2.size;
+            bmb.srcQueueFamilyIndex = bmb2.srcQueueFamilyIndex;
+            bmb.dstQueueFamilyIndex = bmb2.dstQueueFamilyIndex;
+            bmb.srcAccessMask = getOldAccessFlags((AccessFlags)bmb2.srcAccessMask);
+            bmb.dstAccessMask = getOldAccessFlags((AccessFlags)bmb2.dstAccessMask);
+
+            srcStages |= getOldPipelineStageFlags((PipelineStageFlags)bmb2.srcStageMask);
+            dstStages |= getOldPipelineStageFlags((PipelineStageFlags)bmb2.dstStageMask);
+        }
+
+        // Legacy barriers can't have an empty stage mask
+        if (srcStages == 0) srcStages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        if (dstStages == 0) dstStages = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+
+        vkCmdPipelineBarrier(
+            cb,
+            srcStages,
+            dstStages,
+            VK_DEPENDENCY_BY_REGION_BIT,
+            0, nullptr,
+            numBufferBarriers, oldBufferBarriers.data(),
+            numImageBarriers, oldImageBarriers.data()
+        );
+    }
+}
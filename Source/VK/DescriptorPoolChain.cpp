@@ -0,0 +1,283 @@
+#include <DescriptorPoolChain.hpp>
+#include <R2/VKCore.hpp>
+#include <R2/VKDescriptorSet.hpp>
+#include <algorithm>
+#include <assert.h>
+
+namespace R2::VK
+{
+    // Pools stop doubling once they reach this many times the first pool's size
+    const uint32_t MAX_POOL_GROWTH = 16;
+
+    uint32_t getDescriptorTypeIndex(DescriptorType type)
+    {
+        if (type == DescriptorType::AccelerationStructure)
+            return 11;
+
+        return (uint32_t)type;
+    }
+
+    VkDescriptorType getDescriptorTypeFromIndex(uint32_t index)
+    {
+        if (index == 11)
+            return VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+
+        return (VkDescriptorType)index;
+    }
+
+    DescriptorPoolChain::DescriptorPoolChain(const Handles* handles, VkDescriptorPoolCreateFlags flags,
+                                             const VkDescriptorPoolSize* initialSizes, uint32_t numInitialSizes,
+                                             uint32_t initialMaxSets)
+        : handles(handles)
+        , flags(flags)
+        , trackSets((flags & VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT) != 0)
+        , initialMaxSets(initialMaxSets)
+        , currentPool(0)
+        , liveTypeCounts{}
+        , liveSets(0)
+    {
+        createPool(initialSizes, numInitialSizes, initialMaxSets);
+    }
+
+    DescriptorPoolChain::~DescriptorPoolChain()
+    {
+        // Destroying the pools frees whatever is still allocated or waiting to be freed
+        for (Pool& pool : pools)
+        {
+            vkDestroyDescriptorPool(handles->Device, pool.Handle, handles->AllocCallbacks);
+        }
+    }
+
+    VkDescriptorSet DescriptorPoolChain::Allocate(DescriptorSetLayout* layout, uint32_t variableDescriptorCount)
+    {
+        std::unique_lock lock{ mutex };
+
+        bool hasVariableCount = false;
+        uint32_t numDescriptors = 0;
+        uint32_t typeCounts[NUM_DESCRIPTOR_TYPES] = {};
+
+        for (const DescriptorSetLayout::DescriptorCount& dc : layout->descriptorCounts)
+        {
+            uint32_t count = dc.Variable ? variableDescriptorCount : dc.Count;
+            hasVariableCount |= dc.Variable;
+            numDescriptors += count;
+
+            // Inline uniform blocks aren't counted, since their pool sizes are in bytes
+            uint32_t typeIndex = getDescriptorTypeIndex(dc.Type);
+            if (typeIndex < NUM_DESCRIPTOR_TYPES)
+                typeCounts[typeIndex] += count;
+        }
+
+        VkDescriptorSetVariableDescriptorCountAllocateInfo variableCountInfo{
+            VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO
+        };
+        variableCountInfo.descriptorSetCount = 1;
+        variableCountInfo.pDescriptorCounts = &variableDescriptorCount;
+
+        VkDescriptorSetAllocateInfo dsai{VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO};
+        dsai.descriptorSetCount = 1;
+        VkDescriptorSetLayout vdsl = layout->GetNativeHandle();
+        dsai.pSetLayouts = &vdsl;
+        dsai.pNext = hasVariableCount ? &variableCountInfo : nullptr;
+
+        VkDescriptorSet ds = VK_NULL_HANDLE;
+        bool allocated = false;
+
+        // Start from the pool that worked last time, but try the rest too since frees can
+        // leave space in older pools
+        for (size_t i = 0; i < pools.size(); i++)
+        {
+            uint32_t poolIndex = (uint32_t)((currentPool + i) % pools.size());
+            Pool& candidate = pools[poolIndex];
+
+            if (candidate.NumSets == candidate.MaxSets)
+                continue;
+
+            dsai.descriptorPool = candidate.Handle;
+            VkResult result = vkAllocateDescriptorSets(handles->Device, &dsai, &ds);
+
+            if (result == VK_SUCCESS)
+            {
+                currentPool = poolIndex;
+                allocated = true;
+                break;
+            }
+
+            if (result != VK_ERROR_OUT_OF_POOL_MEMORY && result != VK_ERROR_FRAGMENTED_POOL)
+            {
+                VKCHECK(result);
+            }
+        }
+
+        // Counted before a new pool is sized, so the mix includes this set
+        for (uint32_t i = 0; i < NUM_DESCRIPTOR_TYPES; i++)
+        {
+            liveTypeCounts[i] += typeCounts[i];
+        }
+        liveSets++;
+
+        if (!allocated)
+        {
+            createGrowthPool(typeCounts);
+            currentPool = (uint32_t)pools.size() - 1;
+
+            // The new pool is at least as big as this set, so this only fails for real errors
+            dsai.descriptorPool = pools.back().Handle;
+            VKCHECK(vkAllocateDescriptorSets(handles->Device, &dsai, &ds));
+        }
+
+        Pool& pool = pools[currentPool];
+        pool.NumSets++;
+        pool.NumDescriptors += numDescriptors;
+
+        if (trackSets)
+            recordAllocation(ds, currentPool, typeCounts);
+
+        return ds;
+    }
+
+    void DescriptorPoolChain::Free(VkDescriptorSet set, uint64_t frameNumber)
+    {
+        assert(trackSets);
+        std::unique_lock lock{ mutex };
+        pendingFrees.push_back({ set, frameNumber });
+    }
+
+    void DescriptorPoolChain::Reclaim(uint64_t completedFrameNumber)
+    {
+        std::unique_lock lock{ mutex };
+
+        while (!pendingFrees.empty() && pendingFrees.front().FrameNumber <= completedFrameNumber)
+        {
+            VkDescriptorSet set = pendingFrees.front().Set;
+            pendingFrees.pop_front();
+
+            auto it = setRecords.find(set);
+            assert(it != setRecords.end());
+
+            const SetRecord& record = it->second;
+            Pool& pool = pools[record.PoolIndex];
+            VKCHECK(vkFreeDescriptorSets(handles->Device, pool.Handle, 1, &set));
+
+            uint32_t numDescriptors = 0;
+            for (uint32_t i = 0; i < NUM_DESCRIPTOR_TYPES; i++)
+            {
+                liveTypeCounts[i] -= record.TypeCounts[i];
+                numDescriptors += record.TypeCounts[i];
+            }
+            liveSets--;
+
+            pool.NumSets--;
+            pool.NumDescriptors -= std::min(numDescriptors, pool.NumDescriptors);
+
+            setRecords.erase(it);
+        }
+    }
+
+    void DescriptorPoolChain::Reset()
+    {
+        std::unique_lock lock{ mutex };
+
+        for (Pool& pool : pools)
+        {
+            VKCHECK(vkResetDescriptorPool(handles->Device, pool.Handle, 0));
+            pool.NumSets = 0;
+            pool.NumDescriptors = 0;
+        }
+
+        for (uint32_t i = 0; i < NUM_DESCRIPTOR_TYPES; i++)
+        {
+            liveTypeCounts[i] = 0;
+        }
+        liveSets = 0;
+        setRecords.clear();
+        pendingFrees.clear();
+        currentPool = 0;
+    }
+
+    VkDescriptorPool DescriptorPoolChain::GetFirstPool() const
+    {
+        return pools[0].Handle;
+    }
+
+    void DescriptorPoolChain::GetStats(std::vector<DescriptorPoolStats>& stats)
+    {
+        std::unique_lock lock{ mutex };
+
+        for (const Pool& pool : pools)
+        {
+            DescriptorPoolStats poolStats{};
+            poolStats.MaxSets = pool.MaxSets;
+            poolStats.AllocatedSets = pool.NumSets;
+            poolStats.MaxDescriptors = pool.MaxDescriptors;
+            poolStats.AllocatedDescriptors = pool.NumDescriptors;
+            stats.push_back(poolStats);
+        }
+    }
+
+    void DescriptorPoolChain::recordAllocation(VkDescriptorSet set, uint32_t poolIndex, const uint32_t* typeCounts)
+    {
+        SetRecord& record = setRecords[set];
+        record.PoolIndex = poolIndex;
+
+        for (uint32_t i = 0; i < NUM_DESCRIPTOR_TYPES; i++)
+        {
+            record.TypeCounts[i] = typeCounts[i];
+        }
+    }
+
+    void DescriptorPoolChain::createPool(const VkDescriptorPoolSize* sizes, uint32_t numSizes, uint32_t maxSets)
+    {
+        VkDescriptorPoolCreateInfo dpci{VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO};
+        dpci.maxSets = maxSets;
+        dpci.pPoolSizes = sizes;
+        dpci.poolSizeCount = numSizes;
+        dpci.flags = flags;
+
+        Pool pool{};
+        VKCHECK(vkCreateDescriptorPool(handles->Device, &dpci, handles->AllocCallbacks, &pool.Handle));
+        pool.MaxSets = maxSets;
+
+        for (uint32_t i = 0; i < numSizes; i++)
+        {
+            pool.MaxDescriptors += sizes[i].descriptorCount;
+        }
+
+        pools.push_back(pool);
+    }
+
+    void DescriptorPoolChain::createGrowthPool(const uint32_t* requestCounts)
+    {
+        uint32_t maxSets = std::min(pools.back().MaxSets * 2, initialMaxSets * MAX_POOL_GROWTH);
+        maxSets = std::max(maxSets, pools.back().MaxSets);
+
+        // Give each type the share of the new pool that it has of the live sets, with some
+        // headroom so a slightly different mix still fits. The set that didn't fit anywhere
+        // has to fit in the new pool however unusual it is.
+        VkDescriptorPoolSize sizes[NUM_DESCRIPTOR_TYPES];
+        uint32_t numSizes = 0;
+
+        for (uint32_t i = 0; i < NUM_DESCRIPTOR_TYPES; i++)
+        {
+            if (liveTypeCounts[i] == 0 && requestCounts[i] == 0)
+                continue;
+
+            uint64_t perSet = (liveTypeCounts[i] + liveSets - 1) / liveSets;
+            uint64_t count = perSet * maxSets + perSet * maxSets / 4;
+            count = std::max(count, (uint64_t)requestCounts[i]);
+
+            sizes[numSizes].type = getDescriptorTypeFromIndex(i);
+            sizes[numSizes].descriptorCount = (uint32_t)std::min(count, (uint64_t)UINT32_MAX);
+            numSizes++;
+        }
+
+        // Only empty layouts are live, and a pool needs at least one size
+        if (numSizes == 0)
+        {
+            sizes[0] = { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, maxSets };
+            numSizes = 1;
+        }
+
+        createPool(sizes, numSizes, maxSets);
+    }
+}
@@ -0,0 +1,96 @@
+#include <DescriptorSetCache.hpp>
+#include <R2/VKDescriptorSet.hpp>
+#include <algorithm>
+
+namespace R2::VK
+{
+    DescriptorSetCache::~DescriptorSetCache()
+    {
+        for (auto& [key, entry] : entries)
+        {
+            delete entry.Set;
+        }
+    }
+
+    DescriptorSet* DescriptorSetCache::Find(const std::string& key)
+    {
+        std::unique_lock lock{ mutex };
+
+        auto it = entries.find(key);
+        if (it == entries.end())
+            return nullptr;
+
+        return it->second.Set;
+    }
+
+    DescriptorSet* DescriptorSetCache::Add(const std::string& key, DescriptorSet* set,
+                                           const std::vector<const void*>& resources)
+    {
+        std::unique_lock lock{ mutex };
+
+        auto it = entries.find(key);
+        if (it != entries.end())
+        {
+            delete set;
+            return it->second.Set;
+        }
+
+        Entry& entry = entries[key];
+        entry.Set = set;
+        entry.Resources = resources;
+
+        // The same resource can be written to more than one binding
+        std::sort(entry.Resources.begin(), entry.Resources.end());
+        entry.Resources.erase(std::unique(entry.Resources.begin(), entry.Resources.end()), entry.Resources.end());
+
+        for (const void* resource : entry.Resources)
+        {
+            keysByResource[resource].push_back(key);
+        }
+
+        return set;
+    }
+
+    void DescriptorSetCache::Invalidate(const void* resource)
+    {
+        std::unique_lock lock{ mutex };
+
+        auto resourceIt = keysByResource.find(resource);
+        if (resourceIt == keysByResource.end())
+            return;
+
+        std::vector<std::string> keys = std::move(resourceIt->second);
+        keysByResource.erase(resourceIt);
+
+        for (const std::string& key : keys)
+        {
+            auto entryIt = entries.find(key);
+            if (entryIt == entries.end())
+                continue;
+
+            // Drop the entry from the other resources it references
+            for (const void* other : entryIt->second.Resources)
+            {
+                auto otherIt = keysByResource.find(other);
+                if (otherIt == keysByResource.end())
+                    continue;
+
+                std::vector<std::string>& otherKeys = otherIt->second;
+                otherKeys.erase(std::remove(otherKeys.begin(), otherKeys.end(), key), otherKeys.end());
+
+                if (otherKeys.empty())
+                    keysByResource.erase(otherIt);
+            }
+
+            // The set is freed through the deletion queue, so frames still in flight can use it
+            delete entryIt->second.Set;
+            entries.erase(entryIt);
+        }
+    }
+
+    uint32_t DescriptorSetCache::GetNumSets()
+    {
+        std::unique_lock lock{ mutex };
+        return (uint32_t)entries.size();
+    }
+}
@@ -0,0 +1,97 @@
+#include <StagingRing.hpp>
+#include <assert.h>
+
+namespace R2::VK
+{
+    StagingRing::StagingRing(uint64_t size)
+        : size(size)
+        , head(0)
+        , tail(0)
+        , used(0)
+        , frameBytes(0)
+    {
+    }
+
+    bool StagingRing::Allocate(uint64_t allocSize, uint64_t alignment, uint64_t& offset)
+    {
+        assert(alignment > 0);
+
+        if (used == 0)
+        {
+            head = 0;
+            tail = 0;
+        }
+
+        uint64_t alignedHead = (head + alignment - 1) / alignment * alignment;
+        uint64_t consumed;
+
+        if (head < tail || (head == tail && used > 0))
+        {
+            // The free space is the single gap between head and tail
+            if (alignedHead + allocSize > tail)
+                return false;
+
+            offset = alignedHead;
+            consumed = alignedHead + allocSize - head;
+        }
+        else if (alignedHead + allocSize <= size)
+        {
+            offset = alignedHead;
+            consumed = alignedHead + allocSize - head;
+        }
+        else
+        {
+            // Skip the end of the buffer and start again from 0. The skipped bytes belong
+            // to this frame so they're freed along with it.
+            if (allocSize > tail)
+                return false;
+
+            offset = 0;
+            consumed = size - head + allocSize;
+        }
+
+        head = offset + allocSize;
+        used += consumed;
+        frameBytes += consumed;
+        return true;
+    }
+
+    void StagingRing::Shrink(uint64_t allocationEnd, uint64_t unusedBytes)
+    {
+        if (head != allocationEnd || unusedBytes > frameBytes)
+            return;
+
+        head -= unusedBytes;
+        used -= unusedBytes;
+        frameBytes -= unusedBytes;
+    }
+
+    void StagingRing::EndFrame(uint64_t frameNumber)
+    {
+        if (frameBytes == 0)
+            return;
+
+        frames.push_back({ frameNumber, head, frameBytes });
+        frameBytes = 0;
+    }
+
+    void StagingRing::Reclaim(uint64_t completedFrameNumber)
+    {
+        while (!frames.empty() && frames.front().FrameNumber <= completedFrameNumber)
+        {
+            tail = frames.front().End;
+            used -= frames.front().Bytes;
+            frames.pop_front();
+        }
+    }
+
+    uint64_t StagingRing::GetSize() const
+    {
+        return size;
+    }
+
+    uint64_t StagingRing::GetUsed() const
+    {
+        return used;
+    }
+}
@@ -7,6 +7,7 @@
 #include <VKSyncLegacyHelpers.hpp>
 #include <volk.h>
 #include <vk_mem_alloc.h>
+#include <assert.h>
 
 namespace R2::VK
 {
@@ -39,11 +40,12 @@ namespace R2::VK
 
     Buffer::Buffer(Core* renderer, const BufferCreateInfo& createInfo)
         : renderer(renderer)
-        , lastAccess(AccessFlags::HostWrite)
-        , lastPipelineStage(PipelineStageFlags::Host)
+        , contentsInitialized(false)
+        , transferUploadFrame(0)
     {
         size = createInfo.Size;
         usage = createInfo.Usage;
+        resetState(AccessFlags::HostWrite, PipelineStageFlags::Host, AccessFlags::None, PipelineStageFlags::None);
 
         VkBufferCreateInfo bci{ VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
         bci.size = createInfo.Size;
@@ -120,98 +122,216 @@ namespace R2::VK
 
     void Buffer::Acquire(CommandBuffer cb, AccessFlags access)
     {
-        if (vkCmdPipelineBarrier2 != NULL)
+        Acquire(cb, access, getPipelineStage(access));
+    }
+
+    void Buffer::Acquire(CommandBuffer cb, AccessFlags access, PipelineStageFlags stage)
+    {
+        Acquire(cb, 0, size, access, stage);
+    }
+
+    void Buffer::Acquire(CommandBuffer cb, uint64_t offset, uint64_t accessSize, AccessFlags access, PipelineStageFlags stage)
+    {
+        assert(offset < size);
+        uint64_t end = accessSize > size - offset ? size : offset + accessSize;
+        bool isWrite = isWriteAccess(access);
+
+        contentsInitialized = true;
+
+        uint32_t emitted = 0;
+        uint32_t elided = 0;
+        uint32_t merged = 0;
+        VkBufferMemoryBarrier2 pending{ VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2 };
+        bool hasPending = false;
+
+        rangeScratch.clear();
+
+        for (const RangeState& range : ranges)
+        {
+            if (range.End <= offset || range.Start >= end)
+            {
+                rangeScratch.push_back(range);
+                continue;
+            }
+
+            if (range.Start < offset)
+            {
+                RangeState before = range;
+                before.End = offset;
+                rangeScratch.push_back(before);
+            }
+
+            RangeState overlap = range;
+            overlap.Start = range.Start > offset ? range.Start : offset;
+            overlap.End = range.End < end ? range.End : end;
+
+            AccessFlags srcAccess = range.WriteAccess;
+            PipelineStageFlags srcStage;
+            bool needsBarrier;
+
+            if (isWrite)
+            {
+                // Writes wait for every earlier access to these bytes
+                srcStage = range.WriteStage | range.ReadStage;
+                needsBarrier = srcStage != PipelineStageFlags::None || srcAccess != AccessFlags::None;
+
+                overlap.WriteAccess = access;
+                overlap.WriteStage = stage;
+                overlap.ReadAccess = AccessFlags::None;
+                overlap.ReadStage = PipelineStageFlags::None;
+            }
+            else
+            {
+                // Reads only wait for the last write, and only once per stage
+                srcStage = range.WriteStage;
+                bool alreadyWaited = hasAccessBit(range.ReadAccess, access) && hasStageBit(range.ReadStage, stage);
+                bool nothingToWaitFor = srcAccess == AccessFlags::None && srcStage == PipelineStageFlags::None;
+                needsBarrier = !alreadyWaited && !nothingToWaitFor;
+
+                overlap.ReadAccess = range.ReadAccess | access;
+                overlap.ReadStage = range.ReadStage | stage;
+            }
+
+            if (!needsBarrier)
+            {
+                elided++;
+            }
+            else if (hasPending && pending.offset + pending.size == overlap.Start &&
+                     pending.srcAccessMask == (VkAccessFlags2)srcAccess &&
+                     pending.srcStageMask == (VkPipelineStageFlags2)srcStage)
+            {
+                // Neighbouring ranges waiting on the same thing share a barrier
+                pending.size += overlap.End - overlap.Start;
+            }
+            else
+            {
+                if (hasPending)
+                {
+                    if (cb.addBarrier(pending))
+                        emitted++;
+                    else
+                        merged++;
+                }
+
+                pending.buffer = buffer;
+                pending.offset = overlap.Start;
+                pending.size = overlap.End - overlap.Start;
+                pending.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                pending.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+                pending.srcAccessMask = (VkAccessFlags2)srcAccess;
+                pending.srcStageMask = (VkPipelineStageFlags2)srcStage;
+                pending.dstAccessMask = (VkAccessFlags2)access;
+                pending.dstStageMask = (VkPipelineStageFlags2)stage;
+                hasPending = true;
+            }
+
+            rangeScratch.push_back(overlap);
+
+            if (range.End > end)
+            {
+                RangeState after = range;
+                after.Start = end;
+                rangeScratch.push_back(after);
+            }
+        }
+
+        if (hasPending)
         {
-            VkBufferMemoryBarrier2 bmb { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2 };
-            bmb.buffer = buffer;
-            bmb.offset = 0;
-            bmb.size = VK_WHOLE_SIZE;
-            bmb.srcAccessMask = (VkAccessFlags2)lastAccess;
-            bmb.srcStageMask = (VkPipelineStageFlags2)lastPipelineStage;
-            bmb.dstAccessMask = (VkAccessFlags2)access;
-            bmb.dstStageMask = (VkPipelineStageFlags2)getPipelineStage(access);
-
-            VkDependencyInfo di { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
-            di.pBufferMemoryBarriers = &bmb;
-            di.bufferMemoryBarrierCount = 1;
-            vkCmdPipelineBarrier2(cb.GetNativeHandle(), &di);
-            lastAccess = access;
-            lastPipelineStage = getPipelineStage(access);
-
-            vkCmdPipelineBarrier2(cb.GetNativeHandle(), &di);
+            if (cb.addBarrier(pending))
+                emitted++;
+            else
+                merged++;
         }
-        else
+
+        ranges.clear();
+        for (const RangeState& range : rangeScratch)
         {
-            VkBufferMemoryBarrier bmb{ VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
-            bmb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            bmb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            bmb.srcAccessMask = getOldAccessFlags(lastAccess);
-            bmb.dstAccessMask = getOldAccessFlags(access);
-            bmb.size = VK_WHOLE_SIZE;
-            bmb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            bmb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            bmb.buffer = buffer;
-
-            vkCmdPipelineBarrier(
-                    cb.GetNativeHandle(),
-                    getOldPipelineStageFlags(lastPipelineStage),
-                    getOldPipelineStageFlags(lastPipelineStage),
-                    VK_DEPENDENCY_BY_REGION_BIT,
-                    0, nullptr,
-                    1, &bmb,
-                    0, nullptr
-            );
+            if (!ranges.empty() && sameState(ranges.back(), range))
+                ranges.back().End = range.End;
+            else
+                ranges.push_back(range);
         }
+
+        renderer->countBarriers(emitted, elided, merged);
     }
 
-    void Buffer::Acquire(CommandBuffer cb, AccessFlags access, PipelineStageFlags stage)
+    void Buffer::ReleaseOwnership(CommandBuffer cb, QueueType srcQueue, QueueType dstQueue)
     {
-        if (vkCmdPipelineBarrier2 != NULL)
+        uint32_t srcFamily = renderer->getQueueFamilyIndex(srcQueue);
+        uint32_t dstFamily = renderer->getQueueFamilyIndex(dstQueue);
+
+        if (srcFamily == dstFamily)
+            return;
+
+        // The ownership transfer covers the whole buffer, so it waits on everything
+        AccessFlags srcAccess = AccessFlags::None;
+        PipelineStageFlags srcStage = PipelineStageFlags::None;
+        for (const RangeState& range : ranges)
         {
-            VkBufferMemoryBarrier2 bmb { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2 };
-            bmb.buffer = buffer;
-            bmb.offset = 0;
-            bmb.size = VK_WHOLE_SIZE;
-            bmb.srcAccessMask = (VkAccessFlags2)lastAccess;
-            bmb.srcStageMask = (VkPipelineStageFlags2)lastPipelineStage;
-            bmb.dstAccessMask = (VkAccessFlags2)access;
-            bmb.dstStageMask = (VkPipelineStageFlags2)stage;
-
-            VkDependencyInfo di { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
-            di.pBufferMemoryBarriers = &bmb;
-            di.bufferMemoryBarrierCount = 1;
-            vkCmdPipelineBarrier2(cb.GetNativeHandle(), &di);
-            lastAccess = access;
-            lastPipelineStage = stage;
-
-            vkCmdPipelineBarrier2(cb.GetNativeHandle(), &di);
+            srcAccess = srcAccess | range.WriteAccess;
+            srcStage |= range.WriteStage | range.ReadStage;
         }
-        else
+
+        writeOwnershipBarrier(cb, srcFamily, dstFamily,
+            srcAccess, srcStage, AccessFlags::None, PipelineStageFlags::None);
+
+        resetState(AccessFlags::None, PipelineStageFlags::None, AccessFlags::None, PipelineStageFlags::None);
+    }
+
+    void Buffer::AcquireOwnership(CommandBuffer cb, QueueType srcQueue, QueueType dstQueue, AccessFlags access, PipelineStageFlags stage)
+    {
+        uint32_t srcFamily = renderer->getQueueFamilyIndex(srcQueue);
+        uint32_t dstFamily = renderer->getQueueFamilyIndex(dstQueue);
+
+        if (srcFamily == dstFamily)
         {
-            VkBufferMemoryBarrier bmb{ VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
-            bmb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            bmb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            bmb.srcAccessMask = getOldAccessFlags(lastAccess);
-            bmb.dstAccessMask = getOldAccessFlags(access);
-            bmb.size = VK_WHOLE_SIZE;
-            bmb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            bmb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            bmb.buffer = buffer;
-
-            vkCmdPipelineBarrier(
-                    cb.GetNativeHandle(),
-                    getOldPipelineStageFlags(lastPipelineStage),
-                    getOldPipelineStageFlags(stage),
-                    VK_DEPENDENCY_BY_REGION_BIT,
-                    0, nullptr,
-                    1, &bmb,
-                    0, nullptr
-            );
+            Acquire(cb, access, stage);
+            return;
         }
+
+        writeOwnershipBarrier(cb, srcFamily, dstFamily,
+            AccessFlags::None, PipelineStageFlags::None, access, stage);
+
+        // Later reads at other stages chain off the acquire's second scope
+        if (isWriteAccess(access))
+            resetState(access, stage, AccessFlags::None, PipelineStageFlags::None);
+        else
+            resetState(AccessFlags::None, stage, access, stage);
+    }
+
+    void Buffer::writeOwnershipBarrier(CommandBuffer cb, uint32_t srcFamily, uint32_t dstFamily,
+        AccessFlags srcAccess, PipelineStageFlags srcStage, AccessFlags dstAccess, PipelineStageFlags dstStage)
+    {
+        VkBufferMemoryBarrier2 bmb { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2 };
+        bmb.buffer = buffer;
+        bmb.offset = 0;
+        bmb.size = VK_WHOLE_SIZE;
+        bmb.srcQueueFamilyIndex = srcFamily;
+        bmb.dstQueueFamilyIndex = dstFamily;
+        bmb.srcAccessMask = (VkAccessFlags2)srcAccess;
+        bmb.srcStageMask = (VkPipelineStageFlags2)srcStage;
+        bmb.dstAccessMask = (VkAccessFlags2)dstAccess;
+        bmb.dstStageMask = (VkPipelineStageFlags2)dstStage;
+
+        cb.addBarrier(bmb);
+    }
+
+    void Buffer::resetState(AccessFlags writeAccess, PipelineStageFlags writeStage, AccessFlags readAccess, PipelineStageFlags readStage)
+    {
+        ranges.clear();
+        ranges.push_back({ 0, size, writeAccess, writeStage, readAccess, readStage });
+    }
+
+    bool Buffer::sameState(const RangeState& a, const RangeState& b)
+    {
+        return a.WriteAccess == b.WriteAccess && a.WriteStage == b.WriteStage &&
+            a.ReadAccess == b.ReadAccess && a.ReadStage == b.ReadStage;
     }
 
     Buffer::~Buffer()
     {
+        renderer->invalidateCachedDescriptors(this);
+
         DeletionQueue* dq = renderer->getCurrentDq();
         DQ_QueueObjectDeletion(dq, buffer, VK_OBJECT_TYPE_BUFFER);
         DQ_QueueMemoryFree(dq, allocation);
@@ -6,12 +6,25 @@
 #include <R2/VKTexture.hpp>
 #include <R2/VKPipeline.hpp>
 #include <VKSyncLegacyHelpers.hpp>
+#include <BarrierBatch.hpp>
 #include <RenderPassCache.hpp>
+#include <malloc.h>
+#ifdef __linux__
+#include <alloca.h>
+#endif
 
 namespace R2::VK
 {
     CommandBuffer::CommandBuffer(VkCommandBuffer cb)
         : cb(cb)
+        , barrierBatch(nullptr)
+    {
+
+    }
+
+    CommandBuffer::CommandBuffer(VkCommandBuffer cb, BarrierBatch* barrierBatch)
+        : cb(cb)
+        , barrierBatch(barrierBatch)
     {
 
     }
@@ -68,16 +81,19 @@ namespace R2::VK
 
     void CommandBuffer::DrawIndexed(uint32_t indexCount, uint32_t instanceCount, uint32_t firstIndex, int32_t vertexOffset, uint32_t firstInstance)
     {
+        FlushBarriers();
         vkCmdDrawIndexed(cb, indexCount, instanceCount, firstIndex, vertexOffset, firstInstance);
     }
 
     void CommandBuffer::DrawIndexedIndirect(Buffer* buffer, uint64_t offset, uint32_t drawCount, uint32_t stride)
     {
+        FlushBarriers();
         vkCmdDrawIndexedIndirect(cb, buffer->GetNativeHandle(), offset, drawCount, stride);
     }
 
     void CommandBuffer::Draw(uint32_t vertexCount, uint32_t instanceCount, uint32_t firstVertex, uint32_t firstInstance)
     {
+        FlushBarriers();
         vkCmdDraw(cb, vertexCount, instanceCount, firstVertex, firstInstance);
     }
 
@@ -95,6 +111,7 @@ namespace R2::VK
 
     void CommandBuffer::Dispatch(uint32_t groupCountX, uint32_t groupCountY, uint32_t groupCountZ)
     {
+        FlushBarriers();
         vkCmdDispatch(cb, groupCountX, groupCountY, groupCountZ);
     }
 
@@ -131,40 +148,24 @@ namespace R2::VK
 
     void CommandBuffer::TextureBarrier(Texture* tex, PipelineStageFlags srcStage, PipelineStageFlags dstStage, AccessFlags srcAccess, AccessFlags dstAccess)
     {
-        if (vkCmdPipelineBarrier2 != NULL)
+        std::vector<Texture::SubresourceRun> runs;
+        tex->getSubresourceRuns(TextureSubresourceRange::All(), runs);
+
+        for (const Texture::SubresourceRun& run : runs)
         {
             VkImageMemoryBarrier2 imageBarrier { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
-            imageBarrier.image = tex->GetNativeHandle();
-            imageBarrier.oldLayout = imageBarrier.newLayout = (VkImageLayout)tex->lastLayout;
-            tex->lastAccess = dstAccess;
-            imageBarrier.srcStageMask = (VkPipelineStageFlags2)srcStage;
-            imageBarrier.dstStageMask = (VkPipelineStageFlags2)dstStage;
-            imageBarrier.srcAccessMask = (VkAccessFlags2)srcAccess;
-            imageBarrier.dstAccessMask = (VkAccessFlags2)dstAccess;
-            imageBarrier.subresourceRange = VkImageSubresourceRange { tex->getAspectFlags(), 0, (uint32_t)tex->GetNumMips(), 0, (uint32_t)tex->GetLayerCount() };
-
-            VkDependencyInfo di { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
-            di.imageMemoryBarrierCount = 1;
-            di.pImageMemoryBarriers = &imageBarrier;
-            di.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-            vkCmdPipelineBarrier2(cb, &di);
-        }
-        else
-        {
-            VkImageMemoryBarrier imageBarrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
-            imageBarrier.image = tex->GetNativeHandle();
-            imageBarrier.oldLayout = imageBarrier.newLayout = (VkImageLayout)tex->lastLayout;
-            tex->lastAccess = dstAccess;
-            imageBarrier.srcAccessMask = getOldAccessFlags(srcAccess);
-            imageBarrier.dstAccessMask = getOldAccessFlags(dstAccess);
-            imageBarrier.subresourceRange = VkImageSubresourceRange { tex->getAspectFlags(), 0, (uint32_t)tex->GetNumMips(), 0, (uint32_t)tex->GetLayerCount() };
-            imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-            vkCmdPipelineBarrier(cb, getOldPipelineStageFlags(srcStage), getOldPipelineStageFlags(dstStage), 0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+            tex->fillBarrier(imageBarrier, run.Range, run.State.Layout, run.State.Layout, srcAccess, srcStage, dstAccess, dstStage);
+            addBarrier(imageBarrier);
+
+            tex->setSubresourceState(run.Range, Texture::stateAfterBarrier(run.State.Layout, dstAccess, dstStage));
         }
     }
 
+    TextureSubresourceRange convertRange(SubtextureRange range)
+    {
+        return TextureSubresourceRange { range.MipLevel, 1, range.LayerStart, range.LayerCount };
+    }
+
     VkOffset3D convertOffset(Offset3D offset)
     {
         return VkOffset3D { offset.X, offset.Y, offset.Z };
@@ -177,8 +178,11 @@ namespace R2::VK
 
     void CommandBuffer::TextureBlit(Texture* source, Texture* destination, R2::VK::TextureBlit blitInfo)
     {
-        source->Acquire(*this, ImageLayout::TransferSrcOptimal, AccessFlags::TransferRead, PipelineStageFlags::Transfer);
-        destination->Acquire(*this, ImageLayout::TransferDstOptimal, AccessFlags::TransferWrite, PipelineStageFlags::Transfer);
+        // Only the mips and layers being blitted change layout, so a mip chain can be
+        // generated from the same texture one level at a time
+        source->Acquire(*this, convertRange(blitInfo.Source), ImageLayout::TransferSrcOptimal, AccessFlags::TransferRead, PipelineStageFlags::Transfer);
+        destination->Acquire(*this, convertRange(blitInfo.Destination), ImageLayout::TransferDstOptimal, AccessFlags::TransferWrite, PipelineStageFlags::Transfer);
+        FlushBarriers();
 
         VkImageBlit imageBlit{};
         imageBlit.srcSubresource.aspectMask = source->getAspectFlags();
@@ -209,8 +213,9 @@ namespace R2::VK
 
     void CommandBuffer::TextureCopy(Texture* source, Texture* destination, R2::VK::TextureCopy copyInfo)
     {
-        source->Acquire(*this, ImageLayout::TransferSrcOptimal, AccessFlags::TransferRead, PipelineStageFlags::Transfer);
-        destination->Acquire(*this, ImageLayout::TransferDstOptimal, AccessFlags::TransferWrite, PipelineStageFlags::Transfer);
+        source->Acquire(*this, convertRange(copyInfo.Source), ImageLayout::TransferSrcOptimal, AccessFlags::TransferRead, PipelineStageFlags::Transfer);
+        destination->Acquire(*this, convertRange(copyInfo.Destination), ImageLayout::TransferDstOptimal, AccessFlags::TransferWrite, PipelineStageFlags::Transfer);
+        FlushBarriers();
 
         VkImageCopy imageCopy{};
         imageCopy.srcSubresource.aspectMask = source->getAspectFlags();
@@ -239,7 +244,8 @@ namespace R2::VK
 
     void CommandBuffer::TextureCopyToBuffer(Texture* source, Buffer* destination)
     {
-        source->Acquire(cb, ImageLayout::TransferSrcOptimal, AccessFlags::TransferRead, PipelineStageFlags::Transfer);
+        source->Acquire(*this, TextureSubresourceRange{ 0, 1, 0, 1 }, ImageLayout::TransferSrcOptimal, AccessFlags::TransferRead, PipelineStageFlags::Transfer);
+        FlushBarriers();
         VkBufferImageCopy bic{};
         bic.imageSubresource.layerCount = 1;
         bic.imageSubresource.aspectMask = source->getAspectFlags();
@@ -256,7 +262,8 @@ namespace R2::VK
 
     void CommandBuffer::TextureCopyToBuffer(Texture* source, Buffer* destination, TextureToBufferCopy tbc)
     {
-        source->Acquire(cb, ImageLayout::TransferSrcOptimal, AccessFlags::TransferRead, PipelineStageFlags::Transfer);
+        source->Acquire(*this, convertRange(tbc.textureRange), ImageLayout::TransferSrcOptimal, AccessFlags::TransferRead, PipelineStageFlags::Transfer);
+        FlushBarriers();
         VkBufferImageCopy bic{};
         bic.imageSubresource.baseArrayLayer = tbc.textureRange.LayerStart;
         bic.imageSubresource.layerCount = tbc.textureRange.LayerCount;
@@ -274,24 +281,53 @@ namespace R2::VK
         );
     }
 
+    void CommandBuffer::FlushBarriers()
+    {
+        if (barrierBatch)
+            barrierBatch->Flush();
+    }
+
     VkCommandBuffer CommandBuffer::GetNativeHandle()
     {
+        // Anything recorded through the native handle has to come after the queued barriers
+        FlushBarriers();
         return cb;
     }
 
+    bool CommandBuffer::addBarrier(const VkImageMemoryBarrier2& barrier)
+    {
+        if (barrierBatch)
+            return barrierBatch->Add(barrier);
+
+        BarrierBatch::Write(cb, &barrier, 1, nullptr, 0);
+        return true;
+    }
+
+    bool CommandBuffer::addBarrier(const VkBufferMemoryBarrier2& barrier)
+    {
+        if (barrierBatch)
+            return barrierBatch->Add(barrier);
+
+        BarrierBatch::Write(cb, nullptr, 0, &barrier, 1);
+        return true;
+    }
+
     void CommandBuffer::UpdateBuffer(Buffer *buffer, uint64_t offset, uint64_t size, void *data)
     {
+        FlushBarriers();
         vkCmdUpdateBuffer(cb, buffer->GetNativeHandle(), offset, size, data);
     }
 
     void CommandBuffer::FillBuffer(Buffer *buffer, uint64_t offset, uint64_t size, uint32_t data)
     {
+        FlushBarriers();
         vkCmdFillBuffer(cb, buffer->GetNativeHandle(), offset, size, data);
     }
 
     void CommandBuffer::CopyBufferToTexture(Buffer* buffer, Texture* texture, BufferTextureCopy btc)
     {
-        texture->Acquire(*this, ImageLayout::TransferDstOptimal, AccessFlags::TransferWrite, PipelineStageFlags::Transfer);
+        texture->Acquire(*this, convertRange(btc.textureRange), ImageLayout::TransferDstOptimal, AccessFlags::TransferWrite, PipelineStageFlags::Transfer);
+        FlushBarriers();
         VkBufferImageCopy bic{};
         bic.bufferOffset = btc.bufferOffset;
         bic.imageSubresource = VkImageSubresourceLayers
@@ -317,13 +353,51 @@ namespace R2::VK
         vkCmdSetFragmentShadingRateKHR(cb, &fragSize, combinerOps);
     }
 
+    void CommandBuffer::SetCullMode(CullMode mode)
+    {
+        vkCmdSetCullMode(cb, static_cast<VkCullModeFlags>(mode));
+    }
+
+    void CommandBuffer::SetPrimitiveTopology(Topology topology)
+    {
+        vkCmdSetPrimitiveTopology(cb, static_cast<VkPrimitiveTopology>(topology));
+    }
+
+    void CommandBuffer::SetDepthTest(bool enable)
+    {
+        vkCmdSetDepthTestEnable(cb, enable);
+    }
+
+    void CommandBuffer::SetDepthWrite(bool enable)
+    {
+        vkCmdSetDepthWriteEnable(cb, enable);
+    }
+
+    void CommandBuffer::SetDepthCompareOp(CompareOp op)
+    {
+        vkCmdSetDepthCompareOp(cb, static_cast<VkCompareOp>(op));
+    }
+
+    void CommandBuffer::SetDepthBias(bool enable, float constantBias, float slopeBias)
+    {
+        vkCmdSetDepthBiasEnable(cb, enable);
+        vkCmdSetDepthBias(cb, constantBias, 0.0f, slopeBias);
+    }
+
+    void CommandBuffer::SetPolygonMode(PolygonMode mode)
+    {
+        vkCmdSetPolygonModeEXT(cb, static_cast<VkPolygonMode>(mode));
+    }
+
     void CommandBuffer::SetEvent(Event *evt)
     {
+        FlushBarriers();
         vkCmdSetEvent(cb, evt->GetNativeHandle(), VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
     }
 
     void CommandBuffer::ResetEvent(R2::VK::Event *evt)
     {
+        FlushBarriers();
         vkCmdResetEvent(cb, evt->GetNativeHandle(), VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
     }
 
@@ -338,4 +412,18 @@ namespace R2::VK
             vkCmdEndRenderPass(cb);
         }
     }
+
+    void CommandBuffer::ExecuteCommands(const CommandBuffer* commandBuffers, uint32_t count)
+    {
+        FlushBarriers();
+        VkCommandBuffer* nativeCommandBuffers =
+            static_cast<VkCommandBuffer*>(alloca(sizeof(VkCommandBuffer) * count));
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            nativeCommandBuffers[i] = commandBuffers[i].cb;
+        }
+
+        vkCmdExecuteCommands(cb, count, nativeCommandBuffers);
+    }
 }
@@ -1,3 +1,4 @@
+#include <R2/R2.hpp>
 #include <R2/VKCore.hpp>
 #include <R2/VKTexture.hpp>
 #include <R2/VKBuffer.hpp>
@@ -6,10 +7,21 @@
 #include <R2/VKDeletionQueue.hpp>
 #include <R2/VKCommandBuffer.hpp>
 #include <R2/VKDescriptorSet.hpp>
+#include <R2/VKRenderPass.hpp>
+#include <R2/VKPipeline.hpp>
+#include <R2/VKEnums.hpp>
 #include <volk.h>
 #include <RenderPassCache.hpp>
+#include <DescriptorPoolChain.hpp>
+#include <DescriptorSetCache.hpp>
+#include <StagingRing.hpp>
+#include <BarrierBatch.hpp>
+#include <VKSyncLegacyHelpers.hpp>
 #include <vk_mem_alloc.h>
 #include <string.h>
+#include <algorithm>
+#include <thread>
+#include <assert.h>
 
 size_t operator""_KB(unsigned long long sz)
 {
@@ -25,8 +37,16 @@ extern R2::VK::IDebugOutputReceiver* vmaDebugOutputRecv;
 
 namespace R2::VK
 {
-    const uint32_t NUM_FRAMES_IN_FLIGHT = 2;
-    const size_t STAGING_BUFFER_SIZE = 64_MB;
+    // Staging offsets are kept aligned to 16 bytes, which covers every texel block size
+    const uint64_t STAGING_ALIGNMENT = 16;
+    // Set on tokens for uploads that were deferred, which count up instead of naming a frame
+    const UploadToken DEFERRED_UPLOAD_TOKEN = 1ull << 63;
+
+    uint64_t alignStaging(uint64_t size)
+    {
+        return (size + STAGING_ALIGNMENT - 1) & ~(STAGING_ALIGNMENT - 1);
+    }
+
     IDebugOutputReceiver* g_dbgOutRecv;
     RenderPassCache* g_renderPassCache;
     
@@ -47,20 +67,48 @@ namespace R2::VK
 
     Core::Core(IDebugOutputReceiver* dbgOutRecv, bool enableValidation, const char** instanceExts,
                const char** deviceExts)
-        : inFrame(false)
+        : Core(CoreCreateInfo{
+            .DebugOutputReceiver = dbgOutRecv,
+            .EnableValidation = enableValidation,
+            .InstanceExtensions = instanceExts,
+            .DeviceExtensions = deviceExts
+        })
+    {
+    }
+
+    Core::Core(const CoreCreateInfo& createInfo)
+        : numFramesInFlight(createInfo.NumFramesInFlight)
+        , headless(createInfo.Headless)
+        , numRecordingThreads(createInfo.NumRecordingThreads)
         , frameIndex(0)
+        , frameNumber(0)
+        , inFrame(false)
+        , barriersEmitted(0)
+        , barriersElided(0)
+        , barriersMerged(0)
+        , lastBarrierStats{ 0, 0, 0 }
+        , stagingCursor(0)
+        , stagingWindowOpen(false)
+        , stagingWriters(0)
+        , hasDeferredUploads(false)
     {
-        this->dbgOutRecv = dbgOutRecv;
+        if (numFramesInFlight == 0 || numFramesInFlight > MAX_FRAMES_IN_FLIGHT)
+        {
+            throw RenderInitException("NumFramesInFlight must be between 1 and MAX_FRAMES_IN_FLIGHT");
+        }
+
+        this->dbgOutRecv = createInfo.DebugOutputReceiver;
         vmaDebugOutputRecv = dbgOutRecv;
         g_dbgOutRecv = dbgOutRecv;
 
         setAllocCallbacks();
-        createInstance(enableValidation, instanceExts);
+        createInstance(createInfo.EnableValidation, createInfo.InstanceExtensions);
         findQueueFamilies();
-        createDevice(deviceExts);
+        createDevice(createInfo.DeviceExtensions);
         createCommandPool();
         createAllocator();
         createDescriptorPool();
+        createPipelineCache(createInfo.PipelineCacheData, createInfo.PipelineCacheDataSize);
 
         VkPhysicalDeviceProperties deviceProps{};
         vkGetPhysicalDeviceProperties(handles.PhysicalDevice, &deviceProps);
@@ -70,7 +118,28 @@ namespace R2::VK
 
         Utils::SetupImmediateCommandBuffer(GetHandles());
 
-        for (uint32_t i = 0; i < NUM_FRAMES_IN_FLIGHT; i++)
+        VkSemaphoreTypeCreateInfo timelineCreateInfo{VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO};
+        timelineCreateInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        timelineCreateInfo.initialValue = 0;
+
+        VkSemaphoreCreateInfo timelineSci{VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+        timelineSci.pNext = &timelineCreateInfo;
+        VKCHECK(vkCreateSemaphore(handles.Device, &timelineSci, handles.AllocCallbacks, &frameTimeline));
+        VKCHECK(vkCreateSemaphore(handles.Device, &timelineSci, handles.AllocCallbacks, &asyncComputeTimeline));
+
+        VkCommandPoolCreateInfo asyncCpci{VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+        asyncCpci.queueFamilyIndex = getQueueFamilyIndex(QueueType::AsyncCompute);
+        asyncCpci.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        VKCHECK(vkCreateCommandPool(handles.Device, &asyncCpci, handles.AllocCallbacks, &asyncComputeCommandPool));
+
+        VKCHECK(vkCreateSemaphore(handles.Device, &timelineSci, handles.AllocCallbacks, &transferTimeline));
+
+        VkCommandPoolCreateInfo transferCpci{VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+        transferCpci.queueFamilyIndex = getQueueFamilyIndex(QueueType::Transfer);
+        transferCpci.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        VKCHECK(vkCreateCommandPool(handles.Device, &transferCpci, handles.AllocCallbacks, &transferCommandPool));
+
+        for (uint32_t i = 0; i < numFramesInFlight; i++)
         {
             VkCommandBufferAllocateInfo cbai{VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
             cbai.commandBufferCount = 1;
@@ -80,26 +149,66 @@ namespace R2::VK
             VKCHECK(vkAllocateCommandBuffers(handles.Device, &cbai, &perFrameResources[i].CommandBuffer));
             VKCHECK(vkAllocateCommandBuffers(handles.Device, &cbai, &perFrameResources[i].UploadCommandBuffer));
 
-            VkSemaphoreCreateInfo sci{VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
-            VKCHECK(vkCreateSemaphore(handles.Device, &sci, handles.AllocCallbacks, &perFrameResources[i].Completion));
-            VKCHECK(
-                vkCreateSemaphore(handles.Device, &sci, handles.AllocCallbacks, &perFrameResources[i].UploadSemaphore));
+            cbai.commandPool = asyncComputeCommandPool;
+            VKCHECK(vkAllocateCommandBuffers(handles.Device, &cbai, &perFrameResources[i].AsyncComputeCommandBuffer));
+
+            cbai.commandPool = transferCommandPool;
+            VKCHECK(vkAllocateCommandBuffers(handles.Device, &cbai, &perFrameResources[i].TransferCommandBuffer));
+            perFrameResources[i].Barriers = new BarrierBatch(perFrameResources[i].CommandBuffer);
+            perFrameResources[i].AsyncComputeBarriers = new BarrierBatch(perFrameResources[i].AsyncComputeCommandBuffer);
+            perFrameResources[i].AsyncComputeRecording = false;
+            perFrameResources[i].AsyncComputeSubmitted = false;
+            perFrameResources[i].AsyncComputeWaitStage = PipelineStageFlags::AllCommands;
 
-            VkFenceCreateInfo fci{VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
-            fci.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-            VKCHECK(vkCreateFence(handles.Device, &fci, handles.AllocCallbacks, &perFrameResources[i].Fence));
+            // Nothing waits on the completion semaphore without a swapchain
+            perFrameResources[i].Completion = VK_NULL_HANDLE;
+            if (!headless)
+            {
+                VkSemaphoreCreateInfo sci{VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+                VKCHECK(vkCreateSemaphore(handles.Device, &sci, handles.AllocCallbacks, &perFrameResources[i].Completion));
+            }
+            perFrameResources[i].FrameNumber = 0;
 
             perFrameResources[i].DeletionQueue = new DeletionQueue(GetHandles());
+            perFrameResources[i].TransientDescriptorPools = createTransientDescriptorPools();
+            perFrameResources[i].NumTransientDescriptorSetsUsed = 0;
+
+            perFrameResources[i].ThreadPools.resize(numRecordingThreads);
+            for (ThreadCommandPool& threadPool : perFrameResources[i].ThreadPools)
+            {
+                VkCommandPoolCreateInfo cpci{VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+                cpci.queueFamilyIndex = handles.Queues.GraphicsFamilyIndex;
+                cpci.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+                VKCHECK(vkCreateCommandPool(handles.Device, &cpci, handles.AllocCallbacks, &threadPool.Pool));
+
+                threadPool.NumPrimariesUsed = 0;
+                threadPool.NumSecondariesUsed = 0;
+                threadPool.NumSubmitted = 0;
+            }
+        }
 
-            BufferCreateInfo stagingCreateInfo{};
-            // 8MB staging buffer
-            stagingCreateInfo.Size = STAGING_BUFFER_SIZE;
-            stagingCreateInfo.Usage = BufferUsage::Storage;
-            stagingCreateInfo.Mappable = true;
-            perFrameResources[i].StagingBuffer = CreateBuffer(stagingCreateInfo);
+        // Streamed textures are staged at least a block row at a time, so a chunk has to fit the
+        // widest row the device allows in the biggest format, 32 bytes a texel
+        uint32_t maxRowWidth = std::max(deviceProps.limits.maxImageDimension1D, deviceProps.limits.maxImageDimension2D);
+        uint64_t stagingSize = std::max(createInfo.StagingBufferSize, (uint64_t)maxRowWidth * 32 * 4);
 
-            perFrameResources[i].StagingMapped = (char*)perFrameResources[i].StagingBuffer->Map();
+        if (stagingSize != createInfo.StagingBufferSize && dbgOutRecv)
+        {
+            dbgOutRecv->DebugMessage("StagingBufferSize is too small to stream the widest textures, increasing it");
         }
+
+        BufferCreateInfo stagingCreateInfo{};
+        stagingCreateInfo.Size = stagingSize;
+        stagingCreateInfo.Usage = BufferUsage::Storage;
+        stagingCreateInfo.Mappable = true;
+        stagingBuffer = CreateBuffer(stagingCreateInfo);
+        stagingMapped = (char*)stagingBuffer->Map();
+        stagingRing = new StagingRing(stagingSize);
+        uploadChunkSize = stagingSize / 4;
+        stagingWindowSize = stagingSize / 16;
+        stagingWindowEnd = 0;
+        uploadSubmitFrame = 1;
+        nextUploadToken = 1;
     }
 
     const GraphicsDeviceInfo& Core::GetDeviceInfo() const
@@ -122,6 +231,45 @@ namespace R2::VK
         delete static_cast<Texture*>(t);
     }
 
+    void Core::GetTextureMemoryRequirements(const TextureCreateInfo& createInfo, uint64_t& size, uint64_t& alignment,
+                                            uint32_t& memoryTypeBits)
+    {
+        VkMemoryRequirements requirements;
+        Texture::getMemoryRequirements(this, createInfo, requirements);
+
+        size = requirements.size;
+        alignment = requirements.alignment;
+        memoryTypeBits = requirements.memoryTypeBits;
+    }
+
+    VmaAllocation Core::AllocateTextureMemory(uint64_t size, uint64_t alignment, uint32_t memoryTypeBits)
+    {
+        VkMemoryRequirements requirements{};
+        requirements.size = size;
+        requirements.alignment = alignment;
+        requirements.memoryTypeBits = memoryTypeBits;
+
+        // Without a resource to look at VMA can't pick the memory type itself
+        VmaAllocationCreateInfo vaci{};
+        vaci.usage = VMA_MEMORY_USAGE_UNKNOWN;
+        vaci.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
+        VmaAllocation memory;
+        VKCHECK(vmaAllocateMemory(handles.Allocator, &requirements, &vaci, &memory, nullptr));
+
+        return memory;
+    }
+
+    void Core::FreeTextureMemory(VmaAllocation memory)
+    {
+        DQ_QueueMemoryFree(getCurrentDq(), memory);
+    }
+
+    Texture* Core::CreateAliasedTexture(const TextureCreateInfo& createInfo, VmaAllocation memory, uint64_t offset)
+    {
+        return new Texture(this, createInfo, memory, offset);
+    }
+
     Buffer* Core::CreateBuffer(const BufferCreateInfo& createInfo)
     {
         return new Buffer(this, createInfo);
@@ -142,6 +290,11 @@ namespace R2::VK
 
     Swapchain* Core::CreateSwapchain(const SwapchainCreateInfo& createInfo)
     {
+        if (headless)
+        {
+            throw RenderInitException("Can't create a swapchain on a headless Core");
+        }
+
         return new Swapchain(this, createInfo);
     }
 
@@ -152,69 +305,102 @@ namespace R2::VK
 
     DescriptorSet* Core::CreateDescriptorSet(DescriptorSetLayout* dsl)
     {
-        VkDescriptorSet ds;
-        VkDescriptorSetAllocateInfo dsai{VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO};
-        dsai.descriptorSetCount = 1;
-        VkDescriptorSetLayout vdsl = dsl->GetNativeHandle();
-        dsai.pSetLayouts = &vdsl;
-        dsai.descriptorPool = handles.DescriptorPool;
-
-        VKCHECK(vkAllocateDescriptorSets(handles.Device, &dsai, &ds));
-        return new DescriptorSet(this, ds);
+        return CreateDescriptorSet(dsl, 0);
     }
 
     DescriptorSet* Core::CreateDescriptorSet(DescriptorSetLayout* dsl, uint32_t maxVariableDescriptors)
     {
-        VkDescriptorSet ds;
-        VkDescriptorSetVariableDescriptorCountAllocateInfo variableCountInfo{
-            VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO
-        };
-        variableCountInfo.descriptorSetCount = 1;
-        variableCountInfo.pDescriptorCounts = &maxVariableDescriptors;
+        VkDescriptorSet ds = descriptorPools->Allocate(dsl, maxVariableDescriptors);
+
+        DescriptorSet* set = new DescriptorSet(this, ds);
+        set->pooled = true;
+        set->setLayout = dsl;
+        return set;
+    }
+
+    DescriptorSet* Core::CreateTransientDescriptorSet(DescriptorSetLayout* dsl)
+    {
+        PerFrameResources& frameResources = perFrameResources[frameIndex];
+        std::unique_lock lock{ frameResources.TransientDescriptorMutex };
+
+        VkDescriptorSet ds = frameResources.TransientDescriptorPools->Allocate(dsl, 0);
+
+        if (frameResources.NumTransientDescriptorSetsUsed == frameResources.TransientDescriptorSets.size())
+        {
+            DescriptorSet* set = new DescriptorSet(this, ds);
+            set->transient = true;
+            frameResources.TransientDescriptorSets.push_back(set);
+        }
 
-        VkDescriptorSetAllocateInfo dsai{VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO};
-        dsai.descriptorSetCount = 1;
-        VkDescriptorSetLayout vdsl = dsl->GetNativeHandle();
-        dsai.pSetLayouts = &vdsl;
-        dsai.descriptorPool = handles.DescriptorPool;
-        dsai.pNext = &variableCountInfo;
+        DescriptorSet* set = frameResources.TransientDescriptorSets[frameResources.NumTransientDescriptorSetsUsed++];
+        set->set = ds;
+        set->setLayout = dsl;
 
-        VKCHECK(vkAllocateDescriptorSets(handles.Device, &dsai, &ds));
-        return new DescriptorSet(this, ds);
+        return set;
     }
 
     // Gets the index of the last frame. Loops back round on frame 0
-    int getPreviousFrameIndex(int current)
+    int getPreviousFrameIndex(int current, int numFrames)
     {
         int v = current - 1;
 
         if (v == -1)
         {
-            v += NUM_FRAMES_IN_FLIGHT;
+            v += numFrames;
         }
 
         return v;
     }
 
-    int getNextFrameIndex(int current)
+    int getNextFrameIndex(int current, int numFrames)
     {
-        return (current + 1) % NUM_FRAMES_IN_FLIGHT;
+        return (current + 1) % numFrames;
     }
 
     void Core::BeginFrame()
     {
         inFrame = true;
         frameIndex++;
+        frameNumber++;
 
-        if (frameIndex >= NUM_FRAMES_IN_FLIGHT)
+        if (frameIndex >= numFramesInFlight)
         {
             frameIndex = 0;
         }
 
         PerFrameResources& frameResources = perFrameResources[frameIndex];
 
-        VKCHECK(vkWaitForFences(handles.Device, 1, &frameResources.Fence, VK_TRUE, UINT64_MAX));
-        VKCHECK(vkResetFences(handles.Device, 1, &frameResources.Fence));
+        // Wait for the last frame that used this slot to finish on the GPU
+        WaitForFrame(frameResources.FrameNumber);
+
+        // Worker command buffers are recycled by resetting their whole pool at once
+        for (ThreadCommandPool& threadPool : frameResources.ThreadPools)
+        {
+            VKCHECK(vkResetCommandPool(handles.Device, threadPool.Pool, 0));
+            threadPool.NumPrimariesUsed = 0;
+            threadPool.NumSecondariesUsed = 0;
+            threadPool.NumSubmitted = 0;
+        }
+        frameResources.ThreadSubmissions.clear();
+        frameResources.AsyncComputeRecording = false;
+        frameResources.AsyncComputeSubmitted = false;
+
+        // Hand back staging space from every frame the GPU has finished, then use it for
+        // anything that was waiting on it
+        {
+            std::unique_lock uploadLock{uploadMutex};
+            uint64_t completedFrame = GetCompletedFrameNumber();
+            stagingRing->Reclaim(completedFrame);
+            std::erase_if(stagedUploadFrames,
+                [completedFrame](const auto& staged) { return staged.second <= completedFrame; });
+            stageDeferredUploads();
+        }
+
+        descriptorPools->Reclaim(GetCompletedFrameNumber());
+
+        // Transient descriptor sets all go back at once
+        frameResources.TransientDescriptorPools->Reset();
+        frameResources.NumTransientDescriptorSetsUsed = 0;
 
         // Prepare the command buffer for recording
         VKCHECK(vkResetCommandBuffer(frameResources.CommandBuffer, 0));
@@ -230,12 +416,12 @@ namespace R2::VK
 
     CommandBuffer Core::GetFrameCommandBuffer()
     {
-        return CommandBuffer(perFrameResources[frameIndex].CommandBuffer);
+        return CommandBuffer(perFrameResources[frameIndex].CommandBuffer, perFrameResources[frameIndex].Barriers);
     }
 
     CommandBuffer Core::GetFrameCommandBuffer(int index)
     {
-        return CommandBuffer(perFrameResources[index].CommandBuffer);
+        return CommandBuffer(perFrameResources[index].CommandBuffer, perFrameResources[index].Barriers);
     }
 
     VkSemaphore Core::GetFrameCompletionSemaphore()
@@ -243,333 +429,1461 @@ namespace R2::VK
         return perFrameResources[frameIndex].Completion;
     }
 
-    void Core::QueueBufferUpload(Buffer* buffer, const void* data, uint64_t dataSize, uint64_t dataOffset)
+    UploadToken Core::QueueBufferUpload(Buffer* buffer, const void* data, uint64_t dataSize, uint64_t dataOffset)
     {
-        PerFrameResources& frameResources = perFrameResources[frameIndex];
-        std::unique_lock buLock{frameResources.BufferUploadMutex};
+        uint64_t stagingOffset;
 
-        if (dataSize >= STAGING_BUFFER_SIZE)
+        if (dataSize <= uploadChunkSize)
         {
-            this->dbgOutRecv->DebugMessage("Queued buffer too big to go in staging buffer! THIS IS A STALL");
-            VkBufferCreateInfo bci{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-            bci.size = dataSize;
-            bci.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+            if (!hasDeferredUploads.load() && reserveStaging(dataSize, stagingOffset))
+            {
+                return publishBufferUpload(buffer, data, dataSize, dataOffset, stagingOffset);
+            }
 
-            VmaAllocationCreateInfo vaci{};
-            vaci.usage = VMA_MEMORY_USAGE_AUTO;
-            vaci.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
-            VkBuffer tempBuffer;
-            VmaAllocation tempAlloc;
-            VmaAllocationInfo tempAllocInfo{};
-            VKCHECK(vmaCreateBuffer(handles.Allocator, &bci, &vaci, &tempBuffer, &tempAlloc, &tempAllocInfo));
+            // Nothing can go ahead of an upload to the same buffer that's already waiting, or it
+            // could be overwritten. Uploads to anything else don't have to wait for it.
+            std::unique_lock uploadLock{uploadMutex};
+            if (!hasDeferredUploadsTo(buffer) && reserveStagingLocked(dataSize, stagingOffset))
+            {
+                uploadLock.unlock();
+                return publishBufferUpload(buffer, data, dataSize, dataOffset, stagingOffset);
+            }
+        }
 
-            memcpy(tempAllocInfo.pMappedData, data, dataSize);
+        return deferUpload(buffer, nullptr, data, dataSize, dataOffset, 0);
+    }
 
-            std::unique_lock queueLock{queueMutex};
-            VKCHECK(vkResetCommandBuffer(frameResources.UploadCommandBuffer, 0));
+    bool Core::TryQueueBufferUpload(Buffer* buffer, const void* data, uint64_t dataSize, uint64_t dataOffset)
+    {
+        if (dataSize > uploadChunkSize)
+            return false;
 
-            // Record upload command buffer
-            VkCommandBufferBeginInfo cbbi{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
-            cbbi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-            VKCHECK(vkBeginCommandBuffer(frameResources.UploadCommandBuffer, &cbbi));
+        uint64_t stagingOffset;
+        if (!hasDeferredUploads.load() && reserveStaging(dataSize, stagingOffset))
+        {
+            publishBufferUpload(buffer, data, dataSize, dataOffset, stagingOffset);
+            return true;
+        }
 
-            VkBufferCopy bc{};
-            bc.size = dataSize;
-            bc.dstOffset = dataOffset;
-            vkCmdCopyBuffer(frameResources.UploadCommandBuffer, tempBuffer, buffer->GetNativeHandle(), 1, &bc);
+        std::unique_lock uploadLock{uploadMutex};
+        if (!hasDeferredUploadsTo(buffer) && reserveStagingLocked(dataSize, stagingOffset))
+        {
+            uploadLock.unlock();
+            publishBufferUpload(buffer, data, dataSize, dataOffset, stagingOffset);
+            return true;
+        }
 
-            VKCHECK(vkEndCommandBuffer(frameResources.UploadCommandBuffer));
+        return false;
+    }
 
-            VkSubmitInfo uploadSubmitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+    void Core::QueueBufferToTextureCopy(Buffer* buffer, Texture* texture, uint64_t bufferOffset)
+    {
+        std::unique_lock listLock{uploadListMutex};
+        bufferToTextureCopies.push_back({ buffer, texture, bufferOffset, texture->GetNumMips() });
+    }
 
-            uploadSubmitInfo.commandBufferCount = 1;
-            uploadSubmitInfo.pCommandBuffers = &frameResources.UploadCommandBuffer;
 
-            VKCHECK(vkQueueSubmit(handles.Queues.Graphics, 1, &uploadSubmitInfo, VK_NULL_HANDLE));
-            WaitIdle();
+    UploadToken Core::QueueTextureUpload(Texture* texture, void* data, uint64_t dataSize, int numMips)
+    {
+        int mipsToUpload = numMips == -1 ? texture->GetNumMips() : numMips;
+        uint64_t stagingOffset;
 
-            vmaDestroyBuffer(handles.Allocator, tempBuffer, tempAlloc);
+        if (dataSize <= uploadChunkSize)
+        {
+            if (!hasDeferredUploads.load() && reserveStaging(dataSize, stagingOffset))
+            {
+                return publishTextureCopy({ stagingBuffer, texture, stagingOffset, mipsToUpload }, data, dataSize);
+            }
 
-            return;
+            std::unique_lock uploadLock{uploadMutex};
+            if (!hasDeferredUploadsTo(texture) && reserveStagingLocked(dataSize, stagingOffset))
+            {
+                uploadLock.unlock();
+                return publishTextureCopy({ stagingBuffer, texture, stagingOffset, mipsToUpload }, data, dataSize);
+            }
         }
 
-        if (dataSize + frameResources.StagingOffset >= STAGING_BUFFER_SIZE)
-        {
-            std::unique_lock queueLock{queueMutex};
-            this->dbgOutRecv->DebugMessage("Flushing staged uploads!!! THIS IS A STALL");
-            VkCommandBuffer cb = Utils::AcquireImmediateCommandBuffer();
-            writeFrameUploadCommands(frameIndex, cb);
+        return deferUpload(nullptr, texture, data, dataSize, 0, mipsToUpload);
+    }
+
+    bool Core::TryQueueTextureUpload(Texture* texture, const void* data, uint64_t dataSize, int numMips)
+    {
+        if (dataSize > uploadChunkSize)
+            return false;
+
+        int mipsToUpload = numMips == -1 ? texture->GetNumMips() : numMips;
+        uint64_t stagingOffset;
 
-            Utils::ExecuteImmediateCommandBuffer();
-            WaitIdle();
+        if (!hasDeferredUploads.load() && reserveStaging(dataSize, stagingOffset))
+        {
+            publishTextureCopy({ stagingBuffer, texture, stagingOffset, mipsToUpload }, data, dataSize);
+            return true;
         }
 
-        memcpy(frameResources.StagingMapped + frameResources.StagingOffset, data, dataSize);
+        std::unique_lock uploadLock{uploadMutex};
+        if (!hasDeferredUploadsTo(texture) && reserveStagingLocked(dataSize, stagingOffset))
+        {
+            uploadLock.unlock();
+            publishTextureCopy({ stagingBuffer, texture, stagingOffset, mipsToUpload }, data, dataSize);
+            return true;
+        }
 
-        frameResources.BufferUploads.push_back({ buffer, frameResources.StagingOffset, dataSize, dataOffset });
-        frameResources.StagingOffset += dataSize;
+        return false;
     }
 
-    void Core::QueueBufferToTextureCopy(Buffer* buffer, Texture* texture, uint64_t bufferOffset)
+    bool Core::IsUploadComplete(UploadToken token)
     {
-        PerFrameResources& frameResources = perFrameResources[frameIndex];
-        std::unique_lock buLock{frameResources.BufferUploadMutex};
-        frameResources.BufferToTextureCopies.push_back({ buffer, texture, bufferOffset, texture->GetNumMips() });
-    }
+        if ((token & DEFERRED_UPLOAD_TOKEN) == 0)
+            return IsFrameComplete(token);
+
+        std::unique_lock uploadLock{uploadMutex};
+
+        auto staged = stagedUploadFrames.find(token);
+        if (staged != stagedUploadFrames.end())
+            return IsFrameComplete(staged->second);
 
+        // Staged uploads are forgotten once their frame finishes
+        return !isDeferredUploadPending(token);
+    }
 
-    void Core::QueueTextureUpload(Texture* texture, void* data, uint64_t dataSize, int numMips)
+    bool Core::WaitForUpload(UploadToken token)
     {
-        PerFrameResources& frameResources = perFrameResources[frameIndex];
-        std::unique_lock buLock{frameResources.BufferUploadMutex};
-        int mipsToUpload = numMips == -1 ? texture->GetNumMips() : numMips;
+        uint64_t waitFrame = 0;
 
-        if (dataSize >= STAGING_BUFFER_SIZE)
+        if ((token & DEFERRED_UPLOAD_TOKEN) == 0)
+        {
+            // Waiting for a frame that hasn't been submitted would deadlock if this thread is the
+            // one that has to call EndFrame
+            std::unique_lock listLock{uploadListMutex};
+            assert(token < uploadSubmitFrame);
+            if (token >= uploadSubmitFrame)
+                return false;
+
+            waitFrame = token;
+        }
+        else
         {
-            this->dbgOutRecv->DebugMessage("Queued texture too big to go in staging buffer! THIS IS A STALL");
+            std::unique_lock uploadLock{uploadMutex};
 
-            VkBufferCreateInfo bci{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-            bci.size = dataSize;
-            bci.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+            auto staged = stagedUploadFrames.find(token);
+            if (staged == stagedUploadFrames.end())
+                return !isDeferredUploadPending(token);
 
-            VmaAllocationCreateInfo vaci{};
-            vaci.usage = VMA_MEMORY_USAGE_AUTO;
-            vaci.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
-            VkBuffer tempBuffer;
-            VmaAllocation tempAlloc;
-            VmaAllocationInfo tempAllocInfo{};
-            VKCHECK(vmaCreateBuffer(handles.Allocator, &bci, &vaci, &tempBuffer, &tempAlloc, &tempAllocInfo));
+            std::unique_lock listLock{uploadListMutex};
+            if (staged->second >= uploadSubmitFrame)
+                return false;
+
+            waitFrame = staged->second;
+        }
 
-            memcpy(tempAllocInfo.pMappedData, data, dataSize);
-            std::unique_lock queueLock{queueMutex};
+        WaitForFrame(waitFrame);
+        return true;
+    }
 
-            VKCHECK(vkResetCommandBuffer(frameResources.UploadCommandBuffer, 0));
+    bool Core::hasDeferredUploadsTo(const void* destination) const
+    {
+        return deferredDestinations.find(destination) != deferredDestinations.end();
+    }
 
-            // Record upload command buffer
-            VkCommandBufferBeginInfo cbbi{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
-            cbbi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-            VKCHECK(vkBeginCommandBuffer(frameResources.UploadCommandBuffer, &cbbi));
+    bool Core::isDeferredUploadPending(UploadToken token) const
+    {
+        return std::any_of(deferredUploads.begin(), deferredUploads.end(),
+            [token](const DeferredUpload& upload) { return upload.Token == token; });
+    }
 
-            texture->Acquire(frameResources.UploadCommandBuffer, ImageLayout::TransferDstOptimal,
-                             AccessFlags::TransferWrite, PipelineStageFlags::Transfer);
+    bool Core::reserveStaging(uint64_t size, uint64_t& offset)
+    {
+        // Writers register before looking at the window, so closeStagingWindow can tell when
+        // everyone who got space out of it has finished copying
+        stagingWriters.fetch_add(1);
 
-            uint64_t offset = 0;
-            for (int i = 0; i < mipsToUpload; i++)
+        if (stagingWindowOpen.load())
+        {
+            uint64_t cursor = stagingCursor.fetch_add(alignStaging(size));
+            if (cursor + size <= stagingWindowEnd)
             {
-                int currWidth = mipScale(texture->GetWidth(), i);
-                int currHeight = mipScale(texture->GetWidth(), i);
-                VkBufferImageCopy vbic{};
-                vbic.imageSubresource.layerCount = texture->GetLayerCount();
-                vbic.imageSubresource.mipLevel = i;
-                vbic.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-                vbic.imageExtent.width = currWidth;
-                vbic.imageExtent.height = currHeight;
-                vbic.imageExtent.depth = 1;
-                vbic.bufferOffset = offset;
-
-                vkCmdCopyBufferToImage(frameResources.UploadCommandBuffer, tempBuffer,
-                                       texture->GetNativeHandle(),
-                                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &vbic);
-
-                offset += CalculateTextureByteSize(texture->GetFormat(), currWidth, currHeight, texture->GetLayerCount());
+                offset = cursor;
+                return true;
             }
+        }
+
+        stagingWriters.fetch_sub(1);
+        return false;
+    }
 
-            texture->Acquire(frameResources.UploadCommandBuffer, ImageLayout::ReadOnlyOptimal, AccessFlags::MemoryRead,
-                             PipelineStageFlags::FragmentShader | PipelineStageFlags::ComputeShader);
+    bool Core::reserveStagingLocked(uint64_t size, uint64_t& offset)
+    {
+        // Another thread may have opened a new window while this one waited for the lock
+        if (reserveStaging(size, offset))
+            return true;
 
-            VKCHECK(vkEndCommandBuffer(frameResources.UploadCommandBuffer));
+        closeStagingWindow();
 
-            VkSubmitInfo uploadSubmitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+        uint64_t alignedSize = alignStaging(size);
+        uint64_t windowSize = std::max(alignedSize, stagingWindowSize);
+        uint64_t windowStart;
 
-            uploadSubmitInfo.commandBufferCount = 1;
-            uploadSubmitInfo.pCommandBuffers = &frameResources.UploadCommandBuffer;
+        if (!stagingRing->Allocate(windowSize, STAGING_ALIGNMENT, windowStart))
+        {
+            // The GPU may have finished more frames since the last BeginFrame
+            stagingRing->Reclaim(GetCompletedFrameNumber());
 
-            VKCHECK(vkQueueSubmit(handles.Queues.Graphics, 1, &uploadSubmitInfo, VK_NULL_HANDLE));
-            WaitIdle();
+            if (!stagingRing->Allocate(windowSize, STAGING_ALIGNMENT, windowStart))
+            {
+                windowSize = alignedSize;
+                if (!stagingRing->Allocate(windowSize, STAGING_ALIGNMENT, windowStart))
+                    return false;
+            }
+        }
 
-            vmaDestroyBuffer(handles.Allocator, tempBuffer, tempAlloc);
+        // Take this upload's space before other threads can see the window
+        stagingWriters.fetch_add(1);
+        offset = windowStart;
+        stagingCursor.store(windowStart + alignedSize);
+        stagingWindowEnd = windowStart + windowSize;
+        stagingWindowOpen.store(true);
+        return true;
+    }
 
+    void Core::closeStagingWindow()
+    {
+        if (!stagingWindowOpen.load())
             return;
-        }
 
-        uint64_t uploadedOffset = frameResources.StagingOffset;
-        uint64_t requiredPadding = 16 - (uploadedOffset % 16);
+        stagingWindowOpen.store(false);
 
-        if (dataSize + uploadedOffset + requiredPadding >= STAGING_BUFFER_SIZE)
+        while (stagingWriters.load() != 0)
         {
-            std::unique_lock queueLock{queueMutex};
-            this->dbgOutRecv->DebugMessage("Flushing staged uploads!!! THIS IS A STALL");
-            VkCommandBuffer cb = Utils::AcquireImmediateCommandBuffer();
-            writeFrameUploadCommands(frameIndex, cb);
-            Utils::ExecuteImmediateCommandBuffer();
-
-            WaitIdle();
-            uploadedOffset = 0;
-            requiredPadding = 0;
+            std::this_thread::yield();
         }
 
-        memcpy(frameResources.StagingMapped + uploadedOffset + requiredPadding, data, dataSize);
-
-        frameResources.BufferToTextureCopies.push_back({ frameResources.StagingBuffer, texture,
-                                                          uploadedOffset + requiredPadding, mipsToUpload });
-        frameResources.StagingOffset += dataSize + requiredPadding;
+        uint64_t cursor = std::min(stagingCursor.load(), stagingWindowEnd);
+        stagingRing->Shrink(stagingWindowEnd, stagingWindowEnd - cursor);
     }
 
-    uint32_t Core::GetFrameIndex() const
+    UploadToken Core::publishBufferUpload(Buffer* buffer, const void* data, uint64_t dataSize, uint64_t dataOffset,
+                                          uint64_t stagingOffset)
     {
-        return frameIndex;
+        memcpy(stagingMapped + stagingOffset, data, dataSize);
+
+        uint64_t submitFrame;
+        {
+            std::unique_lock listLock{uploadListMutex};
+
+            // Buffers with nothing worth keeping can be filled on the transfer queue without
+            // waiting for this frame's graphics work. Partial uploads need the rest of the contents
+            // to stay valid, so only whole-buffer uploads start that, and later uploads in the
+            // frame follow them. The transfer submission still waits for earlier frames.
+            bool wholeBuffer = dataOffset == 0 && dataSize == buffer->GetSize();
+            bool useTransferQueue = hasTransferQueue() &&
+                ((!buffer->contentsInitialized && wholeBuffer) || buffer->transferUploadFrame == uploadSubmitFrame);
+
+            BufferUpload upload{ buffer, stagingOffset, dataSize, dataOffset };
+            if (useTransferQueue)
+            {
+                buffer->transferUploadFrame = uploadSubmitFrame;
+                transferBufferUploads.push_back(upload);
+            }
+            else
+            {
+                bufferUploads.push_back(upload);
+            }
+
+            buffer->contentsInitialized = true;
+            submitFrame = uploadSubmitFrame;
+        }
+
+        stagingWriters.fetch_sub(1);
+        return submitFrame;
     }
 
-    uint32_t Core::GetNextFrameIndex() const
+    UploadToken Core::publishTextureCopy(const BufferToTextureCopy& copy, const void* data, uint64_t dataSize)
     {
-        return getNextFrameIndex(frameIndex);
+        memcpy(stagingMapped + copy.BufferOffset, data, dataSize);
+
+        uint64_t submitFrame;
+        {
+            std::unique_lock listLock{uploadListMutex};
+
+            // A texture that has never been used has no contents or pending reads to wait for
+            Texture* texture = copy.Texture;
+            if (texture->uploadFrame != uploadSubmitFrame)
+            {
+                texture->uploadFrame = uploadSubmitFrame;
+                texture->uploadOnTransferQueue = hasTransferQueue() && texture->hasUniformState() &&
+                    texture->uniformState.Layout == ImageLayout::Undefined;
+            }
+
+            // A chunk the transfer queue can't copy sends the whole texture's uploads this frame
+            // to the graphics queue instead, so they stay in order
+            if (texture->uploadOnTransferQueue && !fitsTransferGranularity(copy))
+            {
+                auto moved = std::stable_partition(transferTextureCopies.begin(), transferTextureCopies.end(),
+                    [texture](const BufferToTextureCopy& bttc) { return bttc.Texture != texture; });
+                bufferToTextureCopies.insert(bufferToTextureCopies.end(), moved, transferTextureCopies.end());
+                transferTextureCopies.erase(moved, transferTextureCopies.end());
+                texture->uploadOnTransferQueue = false;
+            }
+
+            if (texture->uploadOnTransferQueue)
+            {
+                transferTextureCopies.push_back(copy);
+            }
+            else
+            {
+                bufferToTextureCopies.push_back(copy);
+            }
+
+            submitFrame = uploadSubmitFrame;
+        }
+
+        stagingWriters.fetch_sub(1);
+        return submitFrame;
     }
 
-    uint32_t Core::GetPreviousFrameIndex() const
+    UploadToken Core::deferUpload(Buffer* buffer, Texture* texture, const void* data, uint64_t dataSize,
+                                  uint64_t dataOffset, int numMips)
     {
-        return getPreviousFrameIndex(frameIndex);
+        // The copy can be hundreds of megabytes, so it's made before taking the lock that
+        // BeginFrame needs
+        DeferredUpload upload{};
+        upload.Buffer = buffer;
+        upload.Texture = texture;
+        upload.Data.assign((const char*)data, (const char*)data + dataSize);
+        upload.DataOffset = dataOffset;
+        upload.NumMips = numMips;
+
+        std::unique_lock uploadLock{uploadMutex};
+        if (deferredUploads.empty() && dataSize <= uploadChunkSize && dbgOutRecv)
+        {
+            dbgOutRecv->DebugMessage("Staging buffer full, deferring uploads until the GPU frees space");
+        }
+
+        UploadToken token = DEFERRED_UPLOAD_TOKEN | nextUploadToken++;
+        upload.Token = token;
+        deferredUploads.push_back(std::move(upload));
+        deferredDestinations[buffer ? (const void*)buffer : texture]++;
+        hasDeferredUploads.store(true);
+
+        return token;
     }
 
-    uint32_t Core::GetNumFramesInFlight() const
+    // Returns how much staging space the chunk took, or 0 if none could be staged
+    uint64_t Core::stageNextChunk(DeferredUpload& upload, uint64_t maxChunkSize)
     {
-        return NUM_FRAMES_IN_FLIGHT;
+        uint64_t remaining = upload.Data.size() - upload.Progress;
+        uint64_t stagingOffset;
+
+        if (upload.Texture == nullptr)
+        {
+            uint64_t chunkSize = std::min(remaining, maxChunkSize);
+            if (chunkSize == 0 || !reserveStagingLocked(chunkSize, stagingOffset))
+                return 0;
+
+            upload.SubmitFrame = publishBufferUpload(upload.Buffer, upload.Data.data() + upload.Progress, chunkSize,
+                                                     upload.DataOffset + upload.Progress, stagingOffset);
+            upload.Progress += chunkSize;
+            return chunkSize;
+        }
+
+        if (upload.Progress == 0 && remaining <= maxChunkSize)
+        {
+            if (!reserveStagingLocked(remaining, stagingOffset))
+                return 0;
+
+            upload.SubmitFrame = publishTextureCopy({ stagingBuffer, upload.Texture, stagingOffset, upload.NumMips },
+                                                    upload.Data.data(), remaining);
+            upload.Progress = remaining;
+            return remaining;
+        }
+
+        return stageTextureChunk(upload, maxChunkSize);
     }
 
-    void Core::EndFrame()
+    uint64_t Core::stageTextureChunk(DeferredUpload& upload, uint64_t maxChunkSize)
     {
-        std::unique_lock queueLock{queueMutex};
-        PerFrameResources& frameResources = perFrameResources[frameIndex];
-        VKCHECK(vkEndCommandBuffer(frameResources.CommandBuffer));
-
-        std::unique_lock uploadLock{frameResources.BufferUploadMutex};
+        Texture* texture = upload.Texture;
+        TextureBlockInfo blockInfo = GetTextureBlockInfo(texture->GetFormat());
+
+        uint32_t width = mipScale((uint32_t)texture->GetWidth(), upload.NextMip);
+        uint32_t height = mipScale((uint32_t)texture->GetHeight(), upload.NextMip);
+        uint32_t numLayers = texture->GetLayerCount();
+        uint32_t numRows = (height + blockInfo.BlockHeight - 1) / blockInfo.BlockHeight;
+        uint64_t rowSize = CalculateTextureByteSize(texture->GetFormat(), width, blockInfo.BlockHeight, 1);
+        uint64_t layerSize = rowSize * numRows;
+
+        // Take the biggest piece that fits in a chunk: the whole mip, a run of layers, or a
+        // run of block rows within one layer
+        BufferToTextureCopy copy{};
+        copy.Texture = texture;
+        copy.IsRegion = true;
+        copy.MipLevel = upload.NextMip;
+        copy.LayerStart = upload.NextLayer;
+        copy.RowStart = upload.NextRow;
+
+        if (upload.NextRow == 0 && layerSize <= maxChunkSize)
+        {
+            copy.LayerCount = std::min((uint32_t)(maxChunkSize / layerSize), numLayers - upload.NextLayer);
+            copy.RowCount = numRows;
+        }
+        else
+        {
+            // What's left of this frame's streaming budget may not fit a whole row. A full chunk
+            // always does, since the constructor sizes the ring for the widest row.
+            if (rowSize > maxChunkSize)
+                return 0;
 
-        VkCommandBufferBeginInfo cbbi{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
-        cbbi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-        VKCHECK(vkBeginCommandBuffer(frameResources.UploadCommandBuffer, &cbbi));
+            copy.LayerCount = 1;
+            copy.RowCount = std::min((uint32_t)(maxChunkSize / rowSize), numRows - upload.NextRow);
+        }
 
-        writeFrameUploadCommands(frameIndex, frameResources.UploadCommandBuffer);
+        uint64_t chunkSize = rowSize * copy.RowCount * copy.LayerCount;
+        assert(upload.Progress + chunkSize <= upload.Data.size());
 
-        VKCHECK(vkEndCommandBuffer(frameResources.UploadCommandBuffer));
+        uint64_t stagingOffset;
+        if (!reserveStagingLocked(chunkSize, stagingOffset))
+            return 0;
 
-        // Submit upload command buffer...
-        VkSubmitInfo uploadSubmitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+        copy.Buffer = stagingBuffer;
+        copy.BufferOffset = stagingOffset;
+        upload.SubmitFrame = publishTextureCopy(copy, upload.Data.data() + upload.Progress, chunkSize);
 
-        uploadSubmitInfo.commandBufferCount = 1;
-        uploadSubmitInfo.pCommandBuffers = &frameResources.UploadCommandBuffer;
-        uploadSubmitInfo.pSignalSemaphores = &frameResources.UploadSemaphore;
-        uploadSubmitInfo.signalSemaphoreCount = 1;
+        upload.Progress += chunkSize;
+        upload.NextRow += copy.RowCount;
 
-        VKCHECK(vkQueueSubmit(handles.Queues.Graphics, 1, &uploadSubmitInfo, VK_NULL_HANDLE));
+        if (upload.NextRow == numRows)
+        {
+            upload.NextRow = 0;
+            upload.NextLayer += copy.LayerCount;
+        }
 
-        // Then submit main command buffer, waiting on the upload command buffer.
-        VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        VkSubmitInfo submitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+        if (upload.NextLayer == numLayers)
+        {
+            upload.NextLayer = 0;
+            upload.NextMip++;
+        }
 
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &frameResources.CommandBuffer;
-        submitInfo.pWaitSemaphores = &frameResources.UploadSemaphore;
-        submitInfo.waitSemaphoreCount = 1;
-        submitInfo.pWaitDstStageMask = &waitStage;
-#ifndef __ANDROID__
-        submitInfo.pSignalSemaphores = &frameResources.Completion;
-        submitInfo.signalSemaphoreCount = 1;
-#endif
+        // Anything past the last mip isn't part of the texture
+        if (upload.NextMip == (uint32_t)upload.NumMips)
+        {
+            upload.Progress = upload.Data.size();
+        }
 
-        VKCHECK(vkQueueSubmit(handles.Queues.Graphics, 1, &submitInfo, frameResources.Fence));
-        inFrame = false;
+        return chunkSize;
     }
 
-    void Core::WaitIdle()
+    void Core::stageDeferredUploads()
     {
-        VKCHECK(vkDeviceWaitIdle(handles.Device));
-    }
+        // Deferred uploads go in the order they were queued. Once one can't be finished, later
+        // ones to the same resource wait behind it, but uploads to anything else carry on.
+        // Streamed uploads carry on from where they got to last frame, sharing one chunk's worth
+        // of staging space a frame so they don't crowd out everything else.
+        uint64_t streamBudget = uploadChunkSize;
+        std::vector<const void*> blocked;
+
+        auto it = deferredUploads.begin();
+        while (it != deferredUploads.end())
+        {
+            DeferredUpload& upload = *it;
+            const void* destination = upload.Buffer ? (const void*)upload.Buffer : upload.Texture;
+            bool streamed = upload.Data.size() > uploadChunkSize;
+            bool stalled = std::find(blocked.begin(), blocked.end(), destination) != blocked.end();
 
-    Core::~Core()
-    {
-        WaitIdle();
+            while (!stalled && upload.Progress < upload.Data.size())
+            {
+                uint64_t staged = stageNextChunk(upload, streamed ? streamBudget : uploadChunkSize);
+                stalled = staged == 0;
 
-        for (uint32_t i = 0; i < NUM_FRAMES_IN_FLIGHT; i++)
-        {
-            frameIndex = i;
-            vkFreeCommandBuffers(handles.Device, handles.CommandPool, 1, &perFrameResources[i].CommandBuffer);
-            vkFreeCommandBuffers(handles.Device, handles.CommandPool, 1, &perFrameResources[i].UploadCommandBuffer);
+                if (streamed)
+                    streamBudget -= std::min(staged, streamBudget);
+            }
 
-            vkDestroySemaphore(handles.Device, perFrameResources[i].Completion, handles.AllocCallbacks);
-            vkDestroyFence(handles.Device, perFrameResources[i].Fence, handles.AllocCallbacks);
-            perFrameResources[i].StagingBuffer->Unmap();
-            delete perFrameResources[i].StagingBuffer;
-            vkDestroySemaphore(handles.Device, perFrameResources[i].UploadSemaphore, handles.AllocCallbacks);
+            if (stalled)
+            {
+                blocked.push_back(destination);
+                ++it;
+                continue;
+            }
 
-            perFrameResources[i].DeletionQueue->Cleanup();
-            delete perFrameResources[i].DeletionQueue;
-        }
+            stagedUploadFrames[upload.Token] = upload.SubmitFrame;
 
-        if (messenger)
-        {
-            vkDestroyDebugUtilsMessengerEXT(handles.Instance, messenger, handles.AllocCallbacks);
+            auto waiting = deferredDestinations.find(destination);
+            if (--waiting->second == 0)
+                deferredDestinations.erase(waiting);
+
+            it = deferredUploads.erase(it);
         }
 
-        vmaDestroyAllocator(handles.Allocator);
-        vkDestroyCommandPool(handles.Device, handles.CommandPool, handles.AllocCallbacks);
-        vkDestroyDevice(handles.Device, handles.AllocCallbacks);
-        vkDestroyInstance(handles.Instance, handles.AllocCallbacks);
+        hasDeferredUploads.store(!deferredUploads.empty());
     }
 
-    const Handles* Core::GetHandles() const
+    uint32_t Core::GetFrameIndex() const
     {
-        return &handles;
+        return frameIndex;
     }
 
-    IDebugOutputReceiver* Core::GetDebugOutputReceiver()
+    uint32_t Core::GetNextFrameIndex() const
     {
-        return dbgOutRecv;
+        return getNextFrameIndex(frameIndex, numFramesInFlight);
+    }
+
+    uint32_t Core::GetPreviousFrameIndex() const
+    {
+        return getPreviousFrameIndex(frameIndex, numFramesInFlight);
     }
 
-    void Core::writeFrameUploadCommands(uint32_t index, VkCommandBuffer cb)
+    uint32_t Core::GetNumFramesInFlight() const
     {
-        PerFrameResources& frameResources = perFrameResources[index];
+        return numFramesInFlight;
+    }
 
-        // Handle pending buffer uploads
-        for (BufferUpload& bu : frameResources.BufferUploads)
+    void Core::EndFrame()
+    {
+        PerFrameResources& frameResources = perFrameResources[frameIndex];
+        if (frameResources.AsyncComputeRecording)
         {
-            frameResources.StagingBuffer->CopyTo(cb,
-                                                 bu.Buffer, bu.DataSize, bu.StagingOffset, bu.DataOffset);
+            SubmitAsyncCompute(PipelineStageFlags::AllCommands);
         }
 
-        for (BufferToTextureCopy& bttc : frameResources.BufferToTextureCopies)
+        std::unique_lock queueLock{queueMutex};
+        frameResources.Barriers->Flush();
+        VKCHECK(vkEndCommandBuffer(frameResources.CommandBuffer));
+
+        // Wait for threads still copying into the staging window, so everything that took
+        // ring space this frame is in the lists below
+        std::unique_lock uploadLock{uploadMutex};
+        closeStagingWindow();
+        std::unique_lock listLock{uploadListMutex};
+
+        std::vector<VkCommandBuffer> submitCommandBuffers;
+        submitCommandBuffers.reserve(frameResources.ThreadSubmissions.size() + 2);
+
+        bool hasGraphicsUploads = !bufferUploads.empty() || !bufferToTextureCopies.empty();
+        bool hasTransferUploads = !transferBufferUploads.empty() || !transferTextureCopies.empty();
+        PipelineStageFlags transferConsumerStages = PipelineStageFlags::None;
+
+        if (hasGraphicsUploads || hasTransferUploads)
         {
-            bttc.Texture->Acquire(cb, ImageLayout::TransferDstOptimal, AccessFlags::TransferWrite,
-                                  PipelineStageFlags::Transfer);
+            VkCommandBufferBeginInfo cbbi{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+            cbbi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            VKCHECK(vkBeginCommandBuffer(frameResources.UploadCommandBuffer, &cbbi));
 
-            uint64_t offset = 0;
-            int w = bttc.Texture->GetWidth();
-            int h = bttc.Texture->GetHeight();
-            for (int i = 0; i < bttc.numMips; i++)
+            if (hasTransferUploads)
             {
-                VkBufferImageCopy vbic{};
-                vbic.imageSubresource.layerCount = bttc.Texture->GetLayerCount();
-                vbic.imageSubresource.mipLevel = i;
-                vbic.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-                vbic.imageExtent.width = mipScale(w, i);
-                vbic.imageExtent.height = mipScale(h, i);
-                vbic.imageExtent.depth = 1;
-                vbic.bufferOffset = bttc.BufferOffset + offset;
-
-                vkCmdCopyBufferToImage(cb, bttc.Buffer->GetNativeHandle(),
-                                       bttc.Texture->GetNativeHandle(),
-                                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &vbic);
-
-                offset += CalculateTextureByteSize(bttc.Texture->GetFormat(), mipScale(w, i), mipScale(h, i), bttc.Texture->GetLayerCount());
+                // The copies and ownership releases go to the transfer queue, and the matching
+                // acquires go at the start of the graphics upload command buffer.
+                VKCHECK(vkBeginCommandBuffer(frameResources.TransferCommandBuffer, &cbbi));
+                transferConsumerStages = writeTransferUploadCommands(
+                    frameResources.TransferCommandBuffer, frameResources.UploadCommandBuffer);
+                VKCHECK(vkEndCommandBuffer(frameResources.TransferCommandBuffer));
+
+                // Buffers and discarded textures can look untouched while earlier frames, or this
+                // frame's async compute, still use their memory, so the copies wait for those
+                VkSemaphore transferWaitSemaphores[2] = { frameTimeline, asyncComputeTimeline };
+                uint64_t transferWaitValues[2] = { frameNumber - 1, frameNumber };
+                VkPipelineStageFlags transferWaitStages[2] = { VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT };
+                uint32_t numTransferWaits = frameResources.AsyncComputeSubmitted ? 2 : 1;
+
+                uint64_t transferSignalValue = frameNumber;
+                VkTimelineSemaphoreSubmitInfo transferTimelineInfo{VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO};
+                transferTimelineInfo.waitSemaphoreValueCount = numTransferWaits;
+                transferTimelineInfo.pWaitSemaphoreValues = transferWaitValues;
+                transferTimelineInfo.signalSemaphoreValueCount = 1;
+                transferTimelineInfo.pSignalSemaphoreValues = &transferSignalValue;
+
+                VkSubmitInfo transferSubmitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+                transferSubmitInfo.pNext = &transferTimelineInfo;
+                transferSubmitInfo.waitSemaphoreCount = numTransferWaits;
+                transferSubmitInfo.pWaitSemaphores = transferWaitSemaphores;
+                transferSubmitInfo.pWaitDstStageMask = transferWaitStages;
+                transferSubmitInfo.commandBufferCount = 1;
+                transferSubmitInfo.pCommandBuffers = &frameResources.TransferCommandBuffer;
+                transferSubmitInfo.signalSemaphoreCount = 1;
+                transferSubmitInfo.pSignalSemaphores = &transferTimeline;
+
+                VKCHECK(vkQueueSubmit(handles.Queues.Transfer, 1, &transferSubmitInfo, VK_NULL_HANDLE));
             }
 
-            bttc.Texture->Acquire(cb, ImageLayout::ReadOnlyOptimal, AccessFlags::MemoryRead,
-                                  PipelineStageFlags::FragmentShader | PipelineStageFlags::ComputeShader);
+            if (hasGraphicsUploads)
+            {
+                writeFrameUploadCommands(frameResources.UploadCommandBuffer);
+                writeUploadVisibilityBarrier(frameResources.UploadCommandBuffer);
+            }
+
+            VKCHECK(vkEndCommandBuffer(frameResources.UploadCommandBuffer));
+            submitCommandBuffers.push_back(frameResources.UploadCommandBuffer);
+        }
+
+        // Everything staged so far is used by this frame's submission
+        stagingRing->EndFrame(frameNumber);
+        uploadSubmitFrame = frameNumber + 1;
+
+        // Sort worker submissions so the order doesn't depend on which thread finished first
+        std::vector<ThreadSubmission>& threadSubmissions = frameResources.ThreadSubmissions;
+        std::sort(threadSubmissions.begin(), threadSubmissions.end(),
+            [](const ThreadSubmission& a, const ThreadSubmission& b)
+            {
+                if (a.Order != b.Order) return a.Order < b.Order;
+                if (a.ThreadIndex != b.ThreadIndex) return a.ThreadIndex < b.ThreadIndex;
+                return a.Sequence < b.Sequence;
+            });
+
+        size_t submissionIndex = 0;
+        while (submissionIndex < threadSubmissions.size() && threadSubmissions[submissionIndex].Order < 0)
+        {
+            submitCommandBuffers.push_back(threadSubmissions[submissionIndex++].CommandBuffer);
+        }
+
+        submitCommandBuffers.push_back(frameResources.CommandBuffer);
+
+        while (submissionIndex < threadSubmissions.size())
+        {
+            submitCommandBuffers.push_back(threadSubmissions[submissionIndex++].CommandBuffer);
+        }
+
+        // The uploads and the frame go in as one batch. The barrier at the end of the upload
+        // command buffer orders them, so the only semaphore left is the frame timeline.
+        VkSemaphore signalSemaphores[2] = { frameTimeline, frameResources.Completion };
+        uint64_t signalValues[2] = { frameNumber, 0 };
+
+        VkSemaphore waitSemaphores[2];
+        uint64_t waitValues[2];
+        VkPipelineStageFlags waitStages[2];
+        uint32_t numWaits = 0;
+
+        if (frameResources.AsyncComputeSubmitted)
+        {
+            waitSemaphores[numWaits] = asyncComputeTimeline;
+            waitValues[numWaits] = frameNumber;
+            waitStages[numWaits] = getOldPipelineStageFlags(frameResources.AsyncComputeWaitStage);
+            numWaits++;
+        }
+
+        if (hasTransferUploads)
+        {
+            // Only the stages that read the uploaded resources wait for the transfer queue.
+            // Graphics-path copies may touch the same resources, so they wait as well.
+            PipelineStageFlags transferWaitStage = transferConsumerStages;
+            if (hasGraphicsUploads)
+                transferWaitStage |= PipelineStageFlags::Transfer;
+
+            waitSemaphores[numWaits] = transferTimeline;
+            waitValues[numWaits] = frameNumber;
+            waitStages[numWaits] = getOldPipelineStageFlags(transferWaitStage);
+            numWaits++;
+        }
+
+        VkTimelineSemaphoreSubmitInfo timelineSubmitInfo{VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO};
+        timelineSubmitInfo.pSignalSemaphoreValues = signalValues;
+        timelineSubmitInfo.signalSemaphoreValueCount = 1;
+#ifndef __ANDROID__
+        if (!headless)
+        {
+            timelineSubmitInfo.signalSemaphoreValueCount = 2;
+        }
+#endif
+
+        VkSubmitInfo submitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+        submitInfo.pNext = &timelineSubmitInfo;
+        submitInfo.commandBufferCount = (uint32_t)submitCommandBuffers.size();
+        submitInfo.pCommandBuffers = submitCommandBuffers.data();
+        submitInfo.pSignalSemaphores = signalSemaphores;
+        submitInfo.signalSemaphoreCount = timelineSubmitInfo.signalSemaphoreValueCount;
+
+        timelineSubmitInfo.waitSemaphoreValueCount = numWaits;
+        timelineSubmitInfo.pWaitSemaphoreValues = waitValues;
+        submitInfo.waitSemaphoreCount = numWaits;
+        submitInfo.pWaitSemaphores = waitSemaphores;
+        submitInfo.pWaitDstStageMask = waitStages;
+
+        VKCHECK(vkQueueSubmit(handles.Queues.Graphics, 1, &submitInfo, VK_NULL_HANDLE));
+        frameResources.FrameNumber = frameNumber;
+        inFrame = false;
+
+        lastBarrierStats.Emitted = barriersEmitted.exchange(0, std::memory_order_relaxed);
+        lastBarrierStats.Elided = barriersElided.exchange(0, std::memory_order_relaxed);
+        lastBarrierStats.Merged = barriersMerged.exchange(0, std::memory_order_relaxed);
+    }
+
+    CommandBuffer Core::BeginThreadCommandBuffer(uint32_t threadIndex)
+    {
+        VkCommandBuffer cb = allocateThreadCommandBuffer(threadIndex, false);
+        ThreadCommandPool& threadPool = perFrameResources[frameIndex].ThreadPools[threadIndex];
+
+        VkCommandBufferBeginInfo cbbi{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+        cbbi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VKCHECK(vkBeginCommandBuffer(cb, &cbbi));
+
+        return CommandBuffer(cb, threadPool.PrimaryBarriers[threadPool.NumPrimariesUsed - 1]);
+    }
+
+    void Core::EndThreadCommandBuffer(uint32_t threadIndex, CommandBuffer cb, int32_t submitOrder)
+    {
+        cb.FlushBarriers();
+        VKCHECK(vkEndCommandBuffer(cb.GetNativeHandle()));
+
+        PerFrameResources& frameResources = perFrameResources[frameIndex];
+        ThreadCommandPool& threadPool = frameResources.ThreadPools[threadIndex];
+
+        ThreadSubmission submission{
+            .Order = submitOrder,
+            .ThreadIndex = threadIndex,
+            .Sequence = threadPool.NumSubmitted++,
+            .CommandBuffer = cb.GetNativeHandle()
+        };
+
+        std::unique_lock submissionLock{frameResources.ThreadSubmissionMutex};
+        frameResources.ThreadSubmissions.push_back(submission);
+    }
+
+    CommandBuffer Core::BeginThreadSecondaryCommandBuffer(uint32_t threadIndex, const RenderPass& renderPass)
+    {
+        VkCommandBuffer cb = allocateThreadCommandBuffer(threadIndex, true);
+        renderPass.beginSecondaryCommandBuffer(cb);
+
+        return CommandBuffer(cb);
+    }
+
+    void Core::EndThreadSecondaryCommandBuffer(CommandBuffer cb)
+    {
+        VKCHECK(vkEndCommandBuffer(cb.GetNativeHandle()));
+    }
+
+    uint32_t Core::GetNumRecordingThreads() const
+    {
+        return numRecordingThreads;
+    }
+
+    VkCommandBuffer Core::allocateThreadCommandBuffer(uint32_t threadIndex, bool secondary)
+    {
+        assert(inFrame && threadIndex < numRecordingThreads);
+        ThreadCommandPool& threadPool = perFrameResources[frameIndex].ThreadPools[threadIndex];
+
+        std::vector<VkCommandBuffer>& commandBuffers = secondary ? threadPool.Secondaries : threadPool.Primaries;
+        uint32_t& numUsed = secondary ? threadPool.NumSecondariesUsed : threadPool.NumPrimariesUsed;
+
+        if (numUsed == commandBuffers.size())
+        {
+            VkCommandBufferAllocateInfo cbai{VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+            cbai.commandBufferCount = 1;
+            cbai.commandPool = threadPool.Pool;
+            cbai.level = secondary ? VK_COMMAND_BUFFER_LEVEL_SECONDARY : VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+
+            VkCommandBuffer cb;
+            VKCHECK(vkAllocateCommandBuffers(handles.Device, &cbai, &cb));
+            commandBuffers.push_back(cb);
+
+            // Secondaries record inside a render pass, so only primaries batch their barriers
+            if (!secondary)
+                threadPool.PrimaryBarriers.push_back(new BarrierBatch(cb));
+        }
+
+        return commandBuffers[numUsed++];
+    }
+
+    bool Core::HasAsyncComputeQueue() const
+    {
+        return handles.Queues.AsyncComputeFamilyIndex != ~0u;
+    }
+
+    CommandBuffer Core::GetAsyncComputeCommandBuffer()
+    {
+        PerFrameResources& frameResources = perFrameResources[frameIndex];
+        assert(!frameResources.AsyncComputeSubmitted);
+
+        if (!frameResources.AsyncComputeRecording)
+        {
+            VkCommandBufferBeginInfo cbbi{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+            cbbi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            VKCHECK(vkBeginCommandBuffer(frameResources.AsyncComputeCommandBuffer, &cbbi));
+            frameResources.AsyncComputeRecording = true;
+        }
+
+        return CommandBuffer(frameResources.AsyncComputeCommandBuffer, frameResources.AsyncComputeBarriers);
+    }
+
+    void Core::SubmitAsyncCompute(PipelineStageFlags graphicsWaitStage)
+    {
+        PerFrameResources& frameResources = perFrameResources[frameIndex];
+        assert(frameResources.AsyncComputeRecording);
+
+        frameResources.AsyncComputeBarriers->Flush();
+        VKCHECK(vkEndCommandBuffer(frameResources.AsyncComputeCommandBuffer));
+
+        // Wait for the previous frame's graphics work, which may have produced our inputs
+        uint64_t waitValue = frameNumber - 1;
+        VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        uint64_t signalValue = frameNumber;
+
+        VkTimelineSemaphoreSubmitInfo timelineSubmitInfo{VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO};
+        timelineSubmitInfo.waitSemaphoreValueCount = 1;
+        timelineSubmitInfo.pWaitSemaphoreValues = &waitValue;
+        timelineSubmitInfo.signalSemaphoreValueCount = 1;
+        timelineSubmitInfo.pSignalSemaphoreValues = &signalValue;
+
+        VkSubmitInfo submitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+        submitInfo.pNext = &timelineSubmitInfo;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &frameResources.AsyncComputeCommandBuffer;
+        submitInfo.waitSemaphoreCount = 1;
+        submitInfo.pWaitSemaphores = &frameTimeline;
+        submitInfo.pWaitDstStageMask = &waitStage;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &asyncComputeTimeline;
+
+        std::unique_lock queueLock{queueMutex};
+        VKCHECK(vkQueueSubmit(getAsyncComputeQueue(), 1, &submitInfo, VK_NULL_HANDLE));
+
+        frameResources.AsyncComputeRecording = false;
+        frameResources.AsyncComputeSubmitted = true;
+        frameResources.AsyncComputeWaitStage = graphicsWaitStage;
+    }
+
+    uint32_t Core::getQueueFamilyIndex(QueueType queue) const
+    {
+        switch (queue)
+        {
+        case QueueType::AsyncCompute:
+            if (handles.Queues.AsyncComputeFamilyIndex != ~0u)
+                return handles.Queues.AsyncComputeFamilyIndex;
+            return handles.Queues.GraphicsFamilyIndex;
+        case QueueType::Transfer:
+            if (handles.Queues.TransferFamilyIndex != ~0u)
+                return handles.Queues.TransferFamilyIndex;
+            return handles.Queues.GraphicsFamilyIndex;
+        case QueueType::Graphics:
+        default:
+            return handles.Queues.GraphicsFamilyIndex;
+        }
+    }
+
+    bool Core::hasTransferQueue() const
+    {
+        return handles.Queues.TransferFamilyIndex != ~0u;
+    }
+
+    // Whether count texels or blocks from offset, in a dimension of the given size, can be
+    // copied on a queue with this granularity. Zero only allows the whole dimension.
+    bool meetsTransferGranularity(uint32_t offset, uint32_t count, uint32_t size, uint32_t granularity)
+    {
+        if (offset == 0 && count == size)
+            return true;
+
+        if (granularity == 0)
+            return false;
+
+        return offset % granularity == 0 && (count % granularity == 0 || offset + count == size);
+    }
+
+    bool Core::fitsTransferGranularity(const BufferToTextureCopy& copy) const
+    {
+        // Whole mips are always allowed
+        if (!copy.IsRegion)
+            return true;
+
+        // Chunks span the full width of a single slice, so only their rows can be out of line.
+        // For compressed formats the granularity is in blocks, like the rows.
+        Texture* texture = copy.Texture;
+        TextureBlockInfo blockInfo = GetTextureBlockInfo(texture->GetFormat());
+        uint32_t mipHeight = mipScale((uint32_t)texture->GetHeight(), copy.MipLevel);
+        uint32_t numRows = (mipHeight + blockInfo.BlockHeight - 1) / blockInfo.BlockHeight;
+        uint32_t rowCount = std::min(copy.RowCount, numRows - copy.RowStart);
+
+        return meetsTransferGranularity(copy.RowStart, rowCount, numRows, transferGranularity[1]);
+    }
+
+    VkQueue Core::getAsyncComputeQueue() const
+    {
+        if (handles.Queues.AsyncComputeFamilyIndex != ~0u)
+            return handles.Queues.AsyncCompute;
+        return handles.Queues.Graphics;
+    }
+
+    uint64_t Core::GetFrameNumber() const
+    {
+        return frameNumber;
+    }
+
+    BarrierStats Core::GetBarrierStats() const
+    {
+        return lastBarrierStats;
+    }
+
+    void Core::GetDescriptorPoolStats(std::vector<DescriptorPoolStats>& stats)
+    {
+        stats.clear();
+        descriptorPools->GetStats(stats);
+    }
+
+    uint32_t Core::GetNumCachedDescriptorSets()
+    {
+        return descriptorSetCache->GetNumSets();
+    }
+
+    void Core::invalidateCachedDescriptors(const void* resource)
+    {
+        // Core's own resources are destroyed after the cache
+        if (descriptorSetCache != nullptr)
+            descriptorSetCache->Invalidate(resource);
+    }
+
+    void Core::countBarriers(uint32_t emitted, uint32_t elided, uint32_t merged)
+    {
+        if (emitted)
+            barriersEmitted.fetch_add(emitted, std::memory_order_relaxed);
+
+        if (elided)
+            barriersElided.fetch_add(elided, std::memory_order_relaxed);
+
+        if (merged)
+            barriersMerged.fetch_add(merged, std::memory_order_relaxed);
+    }
+
+    uint64_t Core::GetCompletedFrameNumber()
+    {
+        uint64_t value;
+        VKCHECK(vkGetSemaphoreCounterValue(handles.Device, frameTimeline, &value));
+        return value;
+    }
+
+    bool Core::IsFrameComplete(uint64_t frameNumber)
+    {
+        return GetCompletedFrameNumber() >= frameNumber;
+    }
+
+    void Core::WaitForFrame(uint64_t frameNumber)
+    {
+        VkSemaphoreWaitInfo swi{VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO};
+        swi.semaphoreCount = 1;
+        swi.pSemaphores = &frameTimeline;
+        swi.pValues = &frameNumber;
+        VKCHECK(vkWaitSemaphores(handles.Device, &swi, UINT64_MAX));
+    }
+
+    VkSemaphore Core::GetFrameTimelineSemaphore()
+    {
+        return frameTimeline;
+    }
+
+    void Core::WaitIdle()
+    {
+        VKCHECK(vkDeviceWaitIdle(handles.Device));
+    }
+
+    bool Core::IsHeadless() const
+    {
+        return headless;
+    }
+
+    Core::~Core()
+    {
+        WaitIdle();
+
+        // Shared pipelines nobody released are destroyed along with the device
+        for (auto& [key, pipeline] : sharedPipelines)
+        {
+            delete pipeline;
+        }
+        sharedPipelines.clear();
+
+        for (auto& [hash, mod] : shaderModules)
+        {
+            delete mod;
         }
+        shaderModules.clear();
+
+        // Cached sets go through the deletion queues, so they have to go before those are emptied
+        delete descriptorSetCache;
+        descriptorSetCache = nullptr;
+
+        stagingBuffer->Unmap();
+        delete stagingBuffer;
+        delete stagingRing;
+
+        for (uint32_t i = 0; i < numFramesInFlight; i++)
+        {
+            frameIndex = i;
+            vkFreeCommandBuffers(handles.Device, handles.CommandPool, 1, &perFrameResources[i].CommandBuffer);
+            vkFreeCommandBuffers(handles.Device, handles.CommandPool, 1, &perFrameResources[i].UploadCommandBuffer);
+            vkFreeCommandBuffers(handles.Device, asyncComputeCommandPool, 1, &perFrameResources[i].AsyncComputeCommandBuffer);
+            vkFreeCommandBuffers(handles.Device, transferCommandPool, 1, &perFrameResources[i].TransferCommandBuffer);
+
+            vkDestroySemaphore(handles.Device, perFrameResources[i].Completion, handles.AllocCallbacks);
+
+            delete perFrameResources[i].Barriers;
+            delete perFrameResources[i].AsyncComputeBarriers;
+
+            perFrameResources[i].DeletionQueue->Cleanup();
+            delete perFrameResources[i].DeletionQueue;
+
+            for (DescriptorSet* set : perFrameResources[i].TransientDescriptorSets)
+            {
+                delete set;
+            }
+
+            delete perFrameResources[i].TransientDescriptorPools;
+
+            // Destroying the pools frees their command buffers too
+            for (ThreadCommandPool& threadPool : perFrameResources[i].ThreadPools)
+            {
+                vkDestroyCommandPool(handles.Device, threadPool.Pool, handles.AllocCallbacks);
+
+                for (BarrierBatch* barriers : threadPool.PrimaryBarriers)
+                {
+                    delete barriers;
+                }
+            }
+        }
+
+        delete descriptorPools;
+
+        vkDestroySemaphore(handles.Device, frameTimeline, handles.AllocCallbacks);
+        vkDestroySemaphore(handles.Device, asyncComputeTimeline, handles.AllocCallbacks);
+        vkDestroyCommandPool(handles.Device, asyncComputeCommandPool, handles.AllocCallbacks);
+        vkDestroySemaphore(handles.Device, transferTimeline, handles.AllocCallbacks);
+        vkDestroyCommandPool(handles.Device, transferCommandPool, handles.AllocCallbacks);
+
+        if (messenger)
+        {
+            vkDestroyDebugUtilsMessengerEXT(handles.Instance, messenger, handles.AllocCallbacks);
+        }
+
+        vkDestroyPipelineCache(handles.Device, handles.PipelineCache, handles.AllocCallbacks);
+        vmaDestroyAllocator(handles.Allocator);
+        vkDestroyCommandPool(handles.Device, handles.CommandPool, handles.AllocCallbacks);
+        vkDestroyDevice(handles.Device, handles.AllocCallbacks);
+        vkDestroyInstance(handles.Instance, handles.AllocCallbacks);
+    }
+
+    const Handles* Core::GetHandles() const
+    {
+        return &handles;
+    }
+
+    IDebugOutputReceiver* Core::GetDebugOutputReceiver()
+    {
+        return dbgOutRecv;
+    }
+
+    void Core::writeFrameUploadCommands(VkCommandBuffer cb)
+    {
+        writeBufferUploads(bufferUploads, cb);
+
+        std::vector<Texture*> textures = writeTextureCopies(bufferToTextureCopies, cb);
+        writeTextureTransitions(textures, cb, ImageLayout::ReadOnlyOptimal, AccessFlags::MemoryRead,
+                                PipelineStageFlags::FragmentShader | PipelineStageFlags::ComputeShader);
 
         // Reset the queue
-        frameResources.BufferUploads.clear();
-        frameResources.BufferToTextureCopies.clear();
-        frameResources.StagingOffset = 0;
+        bufferUploads.clear();
+        bufferToTextureCopies.clear();
+    }
+
+    bool hasUsage(BufferUsage usages, BufferUsage flag);
+
+    void getBufferUploadConsumer(BufferUsage usage, AccessFlags& access, PipelineStageFlags& stage)
+    {
+        const PipelineStageFlags shaderStages =
+            PipelineStageFlags::VertexShader | PipelineStageFlags::FragmentShader | PipelineStageFlags::ComputeShader;
+
+        access = AccessFlags::None;
+        stage = PipelineStageFlags::None;
+
+        if (hasUsage(usage, BufferUsage::Vertex))
+        {
+            access = access | AccessFlags::VertexAttributeRead;
+            stage |= PipelineStageFlags::VertexInput;
+        }
+
+        if (hasUsage(usage, BufferUsage::Index))
+        {
+            access = access | AccessFlags::IndexRead;
+            stage |= PipelineStageFlags::VertexInput;
+        }
+
+        if (hasUsage(usage, BufferUsage::Uniform))
+        {
+            access = access | AccessFlags::UniformRead;
+            stage |= shaderStages;
+        }
+
+        if (hasUsage(usage, BufferUsage::Storage))
+        {
+            access = access | AccessFlags::ShaderRead;
+            stage |= shaderStages;
+        }
+
+        if (hasUsage(usage, BufferUsage::Indirect))
+        {
+            access = access | AccessFlags::IndirectCommandRead;
+            stage |= PipelineStageFlags::DrawIndirect;
+        }
+
+        if (stage == PipelineStageFlags::None)
+        {
+            access = AccessFlags::MemoryRead;
+            stage = PipelineStageFlags::AllCommands;
+        }
+    }
+
+    PipelineStageFlags Core::writeTransferUploadCommands(VkCommandBuffer transferCb, VkCommandBuffer graphicsCb)
+    {
+        PipelineStageFlags consumerStages = PipelineStageFlags::None;
+
+        writeBufferUploads(transferBufferUploads, transferCb);
+        std::vector<Texture*> textures = writeTextureCopies(transferTextureCopies, transferCb);
+
+        // Hand each resource back to graphics once, however many uploads it had
+        std::vector<Buffer*> buffers;
+        for (BufferUpload& bu : transferBufferUploads)
+        {
+            buffers.push_back(bu.Buffer);
+        }
+        std::sort(buffers.begin(), buffers.end());
+        buffers.erase(std::unique(buffers.begin(), buffers.end()), buffers.end());
+
+        for (Buffer* buffer : buffers)
+        {
+            AccessFlags access;
+            PipelineStageFlags stage;
+            getBufferUploadConsumer(buffer->GetUsage(), access, stage);
+
+            buffer->resetState(AccessFlags::TransferWrite, PipelineStageFlags::Transfer,
+                               AccessFlags::None, PipelineStageFlags::None);
+            buffer->ReleaseOwnership(transferCb, QueueType::Transfer, QueueType::Graphics);
+            buffer->AcquireOwnership(graphicsCb, QueueType::Transfer, QueueType::Graphics, access, stage);
+            consumerStages |= stage;
+        }
+
+        for (Texture* texture : textures)
+        {
+            const PipelineStageFlags stage = PipelineStageFlags::FragmentShader | PipelineStageFlags::ComputeShader;
+            texture->ReleaseOwnership(transferCb, QueueType::Transfer, QueueType::Graphics, ImageLayout::ReadOnlyOptimal);
+            texture->AcquireOwnership(graphicsCb, QueueType::Transfer, QueueType::Graphics, AccessFlags::MemoryRead, stage);
+            consumerStages |= stage;
+        }
+
+        transferBufferUploads.clear();
+        transferTextureCopies.clear();
+
+        return consumerStages;
+    }
+
+    // Two transfer writes to the same memory need a barrier between them
+    void writeTransferWriteBarrier(VkCommandBuffer cb)
+    {
+        if (vkCmdPipelineBarrier2 != NULL)
+        {
+            VkMemoryBarrier2 mb{VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+            mb.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+            mb.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+            mb.dstStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+            mb.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+
+            VkDependencyInfo di{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+            di.memoryBarrierCount = 1;
+            di.pMemoryBarriers = &mb;
+            vkCmdPipelineBarrier2(cb, &di);
+        }
+        else
+        {
+            VkMemoryBarrier mb{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+            mb.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            mb.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+            vkCmdPipelineBarrier(
+                cb,
+                VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_TRANSFER_BIT,
+                0,
+                1, &mb,
+                0, nullptr,
+                0, nullptr
+            );
+        }
+    }
+
+    bool bufferCopiesOverlap(const VkBufferCopy& a, const VkBufferCopy& b)
+    {
+        return a.dstOffset < b.dstOffset + b.size && b.dstOffset < a.dstOffset + a.size;
+    }
+
+    void Core::writeBufferUploads(const std::vector<BufferUpload>& uploads, VkCommandBuffer cb)
+    {
+        // Group the uploads by destination so each buffer gets one copy command. The sort is
+        // stable, so uploads to the same buffer stay in the order they were queued.
+        std::vector<const BufferUpload*> sorted;
+        sorted.reserve(uploads.size());
+        for (const BufferUpload& bu : uploads)
+        {
+            sorted.push_back(&bu);
+        }
+
+        std::stable_sort(sorted.begin(), sorted.end(),
+            [](const BufferUpload* a, const BufferUpload* b) { return a->Buffer < b->Buffer; });
+
+        std::vector<VkBufferCopy> regions;
+        std::vector<VkBufferCopy> byOffset;
+        size_t groupStart = 0;
+
+        while (groupStart < sorted.size())
+        {
+            Buffer* destination = sorted[groupStart]->Buffer;
+            size_t groupEnd = groupStart;
+
+            regions.clear();
+            while (groupEnd < sorted.size() && sorted[groupEnd]->Buffer == destination)
+            {
+                const BufferUpload& bu = *sorted[groupEnd++];
+                regions.push_back(VkBufferCopy{ bu.StagingOffset, bu.DataOffset, bu.DataSize });
+            }
+
+            // The destination regions of a single copy can't overlap
+            byOffset = regions;
+            std::sort(byOffset.begin(), byOffset.end(),
+                [](const VkBufferCopy& a, const VkBufferCopy& b) { return a.dstOffset < b.dstOffset; });
+
+            bool overlapping = false;
+            for (size_t i = 1; i < byOffset.size(); i++)
+            {
+                overlapping |= bufferCopiesOverlap(byOffset[i - 1], byOffset[i]);
+            }
+
+            if (!overlapping)
+            {
+                vkCmdCopyBuffer(cb, stagingBuffer->GetNativeHandle(), destination->GetNativeHandle(),
+                                (uint32_t)regions.size(), regions.data());
+            }
+            else
+            {
+                // Rewrites of the same bytes go in a later copy so they land in queue order
+                size_t batchStart = 0;
+                for (size_t i = 0; i <= regions.size(); i++)
+                {
+                    bool flush = i == regions.size();
+                    for (size_t j = batchStart; j < i && !flush; j++)
+                    {
+                        flush = bufferCopiesOverlap(regions[j], regions[i]);
+                    }
+
+                    if (!flush)
+                        continue;
+
+                    vkCmdCopyBuffer(cb, stagingBuffer->GetNativeHandle(), destination->GetNativeHandle(),
+                                    (uint32_t)(i - batchStart), regions.data() + batchStart);
+
+                    if (i < regions.size())
+                    {
+                        writeTransferWriteBarrier(cb);
+                    }
+
+                    batchStart = i;
+                }
+            }
+
+            groupStart = groupEnd;
+        }
+    }
+
+    void Core::addTextureCopyRegions(const BufferToTextureCopy& bttc, std::vector<VkBufferImageCopy>& regions)
+    {
+        Texture* texture = bttc.Texture;
+
+        if (bttc.IsRegion)
+        {
+            TextureBlockInfo blockInfo = GetTextureBlockInfo(texture->GetFormat());
+            uint32_t mipHeight = mipScale((uint32_t)texture->GetHeight(), bttc.MipLevel);
+            uint32_t rowStart = bttc.RowStart * blockInfo.BlockHeight;
+
+            VkBufferImageCopy vbic{};
+            vbic.imageSubresource.baseArrayLayer = bttc.LayerStart;
+            vbic.imageSubresource.layerCount = bttc.LayerCount;
+            vbic.imageSubresource.mipLevel = bttc.MipLevel;
+            vbic.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            vbic.imageOffset.y = (int32_t)rowStart;
+            vbic.imageExtent.width = mipScale((uint32_t)texture->GetWidth(), bttc.MipLevel);
+            vbic.imageExtent.height = std::min(bttc.RowCount * blockInfo.BlockHeight, mipHeight - rowStart);
+            vbic.imageExtent.depth = 1;
+            vbic.bufferOffset = bttc.BufferOffset;
+            regions.push_back(vbic);
+            return;
+        }
+
+        uint64_t offset = 0;
+        int w = texture->GetWidth();
+        int h = texture->GetHeight();
+        for (int i = 0; i < bttc.numMips; i++)
+        {
+            VkBufferImageCopy vbic{};
+            vbic.imageSubresource.layerCount = texture->GetLayerCount();
+            vbic.imageSubresource.mipLevel = i;
+            vbic.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            vbic.imageExtent.width = mipScale(w, i);
+            vbic.imageExtent.height = mipScale(h, i);
+            vbic.imageExtent.depth = 1;
+            vbic.bufferOffset = bttc.BufferOffset + offset;
+            regions.push_back(vbic);
+
+            offset += CalculateTextureByteSize(texture->GetFormat(), mipScale(w, i), mipScale(h, i), texture->GetLayerCount());
+        }
+    }
+
+    bool Core::textureCopiesOverlap(const BufferToTextureCopy& a, const BufferToTextureCopy& b)
+    {
+        if (!a.IsRegion)
+            return !b.IsRegion || b.MipLevel < (uint32_t)a.numMips;
+
+        if (!b.IsRegion)
+            return a.MipLevel < (uint32_t)b.numMips;
+
+        return a.MipLevel == b.MipLevel &&
+            a.LayerStart < b.LayerStart + b.LayerCount && b.LayerStart < a.LayerStart + a.LayerCount &&
+            a.RowStart < b.RowStart + b.RowCount && b.RowStart < a.RowStart + a.RowCount;
+    }
+
+    std::vector<Texture*> Core::writeTextureCopies(const std::vector<BufferToTextureCopy>& copies, VkCommandBuffer cb)
+    {
+        std::vector<const BufferToTextureCopy*> sorted;
+        sorted.reserve(copies.size());
+        for (const BufferToTextureCopy& bttc : copies)
+        {
+            sorted.push_back(&bttc);
+        }
+
+        std::stable_sort(sorted.begin(), sorted.end(),
+            [](const BufferToTextureCopy* a, const BufferToTextureCopy* b) { return a->Texture < b->Texture; });
+
+        std::vector<Texture*> textures;
+        for (const BufferToTextureCopy* bttc : sorted)
+        {
+            if (textures.empty() || textures.back() != bttc->Texture)
+                textures.push_back(bttc->Texture);
+        }
+
+        // One dependency moves every texture into the transfer layout before any copies
+        writeTextureTransitions(textures, cb, ImageLayout::TransferDstOptimal, AccessFlags::TransferWrite,
+                                PipelineStageFlags::Transfer);
+
+        // Each texture then gets one copy carrying all of its regions. Copies only split when
+        // the source buffer changes, or when a later upload rewrites the same texels.
+        std::vector<VkBufferImageCopy> regions;
+        std::vector<const BufferToTextureCopy*> written;
+        size_t i = 0;
+
+        while (i < sorted.size())
+        {
+            Texture* texture = sorted[i]->Texture;
+            Buffer* source = sorted[i]->Buffer;
+            regions.clear();
+            written.clear();
+
+            for (; i < sorted.size() && sorted[i]->Texture == texture; i++)
+            {
+                const BufferToTextureCopy& bttc = *sorted[i];
+
+                bool overlapping = false;
+                for (const BufferToTextureCopy* prev : written)
+                {
+                    overlapping |= textureCopiesOverlap(*prev, bttc);
+                }
+
+                if ((overlapping || bttc.Buffer != source) && !regions.empty())
+                {
+                    vkCmdCopyBufferToImage(cb, source->GetNativeHandle(), texture->GetNativeHandle(),
+                                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, (uint32_t)regions.size(), regions.data());
+                    regions.clear();
+                }
+
+                if (overlapping)
+                {
+                    writeTransferWriteBarrier(cb);
+                    written.clear();
+                }
+
+                source = bttc.Buffer;
+                addTextureCopyRegions(bttc, regions);
+                written.push_back(&bttc);
+            }
+
+            if (!regions.empty())
+            {
+                vkCmdCopyBufferToImage(cb, source->GetNativeHandle(), texture->GetNativeHandle(),
+                                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, (uint32_t)regions.size(), regions.data());
+            }
+        }
+
+        return textures;
+    }
+
+    void Core::writeTextureTransitions(const std::vector<Texture*>& textures, VkCommandBuffer cb, ImageLayout layout,
+                                       AccessFlags access, PipelineStageFlags stage)
+    {
+        if (textures.empty())
+            return;
+
+        std::vector<VkImageMemoryBarrier2> barriers;
+        std::vector<Texture::SubresourceRun> runs;
+        uint32_t elided = 0;
+
+        for (Texture* t : textures)
+        {
+            runs.clear();
+            t->getSubresourceRuns(TextureSubresourceRange::All(), runs);
+
+            for (const Texture::SubresourceRun& run : runs)
+            {
+                AccessFlags srcAccess;
+                PipelineStageFlags srcStage;
+                Texture::SubresourceState newState;
+
+                if (Texture::planAccess(run.State, layout, access, stage, srcAccess, srcStage, newState))
+                {
+                    VkImageMemoryBarrier2& imb = barriers.emplace_back(VkImageMemoryBarrier2{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 });
+                    t->fillBarrier(imb, run.Range, run.State.Layout, layout, srcAccess, srcStage, access, stage);
+                }
+                else
+                {
+                    elided++;
+                }
+
+                t->setSubresourceState(run.Range, newState);
+            }
+        }
+
+        BarrierBatch::Write(cb, barriers.data(), (uint32_t)barriers.size(), nullptr, 0);
+        countBarriers((uint32_t)barriers.size(), elided, 0);
+    }
+
+    void Core::writeUploadVisibilityBarrier(VkCommandBuffer cb)
+    {
+        if (vkCmdPipelineBarrier2 != NULL)
+        {
+            VkMemoryBarrier2 mb{VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+            mb.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+            mb.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+            mb.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+            mb.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+            VkDependencyInfo di{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+            di.memoryBarrierCount = 1;
+            di.pMemoryBarriers = &mb;
+            vkCmdPipelineBarrier2(cb, &di);
+        }
+        else
+        {
+            VkMemoryBarrier mb{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+            mb.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            mb.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+            vkCmdPipelineBarrier(
+                cb,
+                VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                0,
+                1, &mb,
+                0, nullptr,
+                0, nullptr
+            );
+        }
     }
 
     DeletionQueue* Core::getCurrentDq()
@@ -1,6 +1,8 @@
 #include <R2/VKCore.hpp>
 #include <R2/R2.hpp>
 #include <RenderPassCache.hpp>
+#include <DescriptorPoolChain.hpp>
+#include <DescriptorSetCache.hpp>
 #include <volk.h>
 #ifdef __ANDROID__
 #include <vulkan/vulkan_android.h>
@@ -9,6 +11,7 @@
 #include <vector>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 namespace R2::VK
 {
@@ -54,13 +57,16 @@ namespace R2::VK
             extensions.push_back("VK_EXT_debug_utils");
         }
 
-        extensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+        if (!headless)
+        {
+            extensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
 #ifdef _WIN32
-        extensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
+            extensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
 #endif
 #ifdef __ANDROID__
-        extensions.push_back(VK_KHR_ANDROID_SURFACE_EXTENSION_NAME);
+            extensions.push_back(VK_KHR_ANDROID_SURFACE_EXTENSION_NAME);
 #endif
+        }
 
         if (instanceExts != nullptr)
         {
@@ -129,6 +135,8 @@ namespace R2::VK
         handles.Queues.AsyncComputeFamilyIndex = ~0u;
         handles.Queues.GraphicsFamilyIndex = ~0u;
         handles.Queues.PresentFamilyIndex = ~0u;
+        handles.Queues.TransferFamilyIndex = ~0u;
+        transferGranularity[0] = transferGranularity[1] = transferGranularity[2] = 0;
 
         for (uint32_t i = 0; i < numQueueFamilyProperties; i++)
         {
@@ -137,12 +145,21 @@ namespace R2::VK
             if ((props.queueFlags & graphicsFlags) == graphicsFlags)
             {
                 handles.Queues.GraphicsFamilyIndex = i;
-                handles.Queues.PresentFamilyIndex = i;
+                if (!headless)
+                    handles.Queues.PresentFamilyIndex = i;
             }
             else if ((props.queueFlags & asyncComputeFlags) == asyncComputeFlags)
             {
                 handles.Queues.AsyncComputeFamilyIndex = i;
             }
+            else if ((props.queueFlags & VK_QUEUE_TRANSFER_BIT) == VK_QUEUE_TRANSFER_BIT)
+            {
+                // Transfer-only families usually map to the DMA engines
+                handles.Queues.TransferFamilyIndex = i;
+                transferGranularity[0] = props.minImageTransferGranularity.width;
+                transferGranularity[1] = props.minImageTransferGranularity.height;
+                transferGranularity[2] = props.minImageTransferGranularity.depth;
+            }
         }
 
         if (handles.Queues.GraphicsFamilyIndex == ~0u)
@@ -181,6 +198,8 @@ namespace R2::VK
             return false;
         if (!features12.descriptorBindingVariableDescriptorCount)
             return false;
+        if (!features12.timelineSemaphore)
+            return false;
         if (!features13.synchronization2)
             return false;
         if (!features13.dynamicRendering)
@@ -228,6 +247,28 @@ namespace R2::VK
         supportedFeatures.VariableRateShading = checkExtensionSupport(handles.PhysicalDevice, VK_KHR_FRAGMENT_SHADING_RATE_EXTENSION_NAME);
         supportedFeatures.DynamicRendering = checkExtensionSupport(handles.PhysicalDevice, VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME);
 
+        // Extended dynamic state 1 and 2 are core in 1.3, but polygon mode needs the third extension
+        VkPhysicalDeviceProperties deviceProps;
+        vkGetPhysicalDeviceProperties(handles.PhysicalDevice, &deviceProps);
+        supportedFeatures.ExtendedDynamicState = deviceProps.apiVersion >= VK_API_VERSION_1_3;
+
+        VkPhysicalDeviceFeatures deviceFeatures;
+        vkGetPhysicalDeviceFeatures(handles.PhysicalDevice, &deviceFeatures);
+        supportedFeatures.NonSolidFill = deviceFeatures.fillModeNonSolid;
+
+        supportedFeatures.DynamicPolygonMode = false;
+        if (supportedFeatures.ExtendedDynamicState && supportedFeatures.NonSolidFill &&
+            checkExtensionSupport(handles.PhysicalDevice, VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME))
+        {
+            VkPhysicalDeviceFeatures2 features2{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2};
+            VkPhysicalDeviceExtendedDynamicState3FeaturesEXT eds3Features
+                {VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT};
+            features2.pNext = &eds3Features;
+            vkGetPhysicalDeviceFeatures2(handles.PhysicalDevice, &features2);
+
+            supportedFeatures.DynamicPolygonMode = eds3Features.extendedDynamicState3PolygonMode;
+        }
+
         if (!supportedFeatures.DynamicRendering)
         {
             g_renderPassCache = new RenderPassCache(this);
@@ -250,6 +291,7 @@ namespace R2::VK
         features.features.samplerAnisotropy = true;
         features.features.multiDrawIndirect = true;
         features.features.fragmentStoresAndAtomics = true;
+        features.features.fillModeNonSolid = supportedFeatures.NonSolidFill;
         features11.multiview = true;
         features11.shaderDrawParameters = true;
         features12.descriptorIndexing = true;
@@ -262,6 +304,7 @@ namespace R2::VK
         features12.shaderSampledImageArrayNonUniformIndexing = true;
         features12.runtimeDescriptorArray = true;
         features12.imagelessFramebuffer = true;
+        features12.timelineSemaphore = true;
 #ifndef __ANDROID__
         features13.synchronization2 = true;
         features13.dynamicRendering = true;
@@ -304,10 +347,22 @@ namespace R2::VK
             chainEnd = (ChainHeader*)&vrsFeatures;
         }
 
+        VkPhysicalDeviceExtendedDynamicState3FeaturesEXT eds3Features
+            {VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT};
+        if (supportedFeatures.DynamicPolygonMode)
+        {
+            chainEnd->pNext = &eds3Features;
+            eds3Features.extendedDynamicState3PolygonMode = VK_TRUE;
+            chainEnd = (ChainHeader*)&eds3Features;
+        }
+
         // Extensions
         // ==========
         std::vector<const char*> extensions;
-        extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+        if (!headless)
+        {
+            extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+        }
 
         if (supportedFeatures.RayTracing)
         {
@@ -321,6 +376,11 @@ namespace R2::VK
             extensions.push_back(VK_KHR_FRAGMENT_SHADING_RATE_EXTENSION_NAME);
         }
 
+        if (supportedFeatures.DynamicPolygonMode)
+        {
+            extensions.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME);
+        }
+
 #ifdef __ANDROID__
         extensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
         extensions.push_back(VK_KHR_IMAGELESS_FRAMEBUFFER_EXTENSION_NAME);
@@ -342,7 +402,8 @@ namespace R2::VK
 
         // Queues
         // ======
-        VkDeviceQueueCreateInfo queueCreateInfos[2]{};
+        VkDeviceQueueCreateInfo queueCreateInfos[3]{};
+        uint32_t numQueueCreateInfos = 1;
 
         const float one = 1.0f;
 
@@ -351,19 +412,27 @@ namespace R2::VK
         queueCreateInfos[0].pQueuePriorities = &one;
         queueCreateInfos[0].queueFamilyIndex = handles.Queues.GraphicsFamilyIndex;
 
-        // Create the async compute queue if we found it
+        // Create the async compute and transfer queues if we found them
         if (handles.Queues.AsyncComputeFamilyIndex != ~0u)
         {
-            queueCreateInfos[1] = VkDeviceQueueCreateInfo{VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO};
-            queueCreateInfos[1].queueCount = 1;
-            queueCreateInfos[1].pQueuePriorities = &one;
-            queueCreateInfos[1].queueFamilyIndex = handles.Queues.AsyncComputeFamilyIndex;
+            VkDeviceQueueCreateInfo& qci = queueCreateInfos[numQueueCreateInfos++];
+            qci = VkDeviceQueueCreateInfo{VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO};
+            qci.queueCount = 1;
+            qci.pQueuePriorities = &one;
+            qci.queueFamilyIndex = handles.Queues.AsyncComputeFamilyIndex;
         }
 
-        dci.pQueueCreateInfos = queueCreateInfos;
+        if (handles.Queues.TransferFamilyIndex != ~0u)
+        {
+            VkDeviceQueueCreateInfo& qci = queueCreateInfos[numQueueCreateInfos++];
+            qci = VkDeviceQueueCreateInfo{VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO};
+            qci.queueCount = 1;
+            qci.pQueuePriorities = &one;
+            qci.queueFamilyIndex = handles.Queues.TransferFamilyIndex;
+        }
 
-        // If there's no async compute queue, we're only creating the one graphics queue.
-        dci.queueCreateInfoCount = handles.Queues.AsyncComputeFamilyIndex == ~0u ? 1 : 2;
+        dci.pQueueCreateInfos = queueCreateInfos;
+        dci.queueCreateInfoCount = numQueueCreateInfos;
 
         // Device Creation
         // ===============
@@ -377,6 +446,11 @@ namespace R2::VK
         {
             vkGetDeviceQueue(handles.Device, handles.Queues.AsyncComputeFamilyIndex, 0, &handles.Queues.AsyncCompute);
         }
+
+        if (handles.Queues.TransferFamilyIndex != ~0u)
+        {
+            vkGetDeviceQueue(handles.Device, handles.Queues.TransferFamilyIndex, 0, &handles.Queues.Transfer);
+        }
     }
 
     void Core::createCommandPool()
@@ -431,8 +505,7 @@ namespace R2::VK
 
     void Core::createDescriptorPool()
     {
-        VkDescriptorPoolCreateInfo dpci{VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO};
-        dpci.maxSets = 1000;
+        // Only the first pool uses these sizes. Later ones follow what's actually allocated.
         VkDescriptorPoolSize poolSizes[] = {
             {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 5000},
             {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 500},
@@ -440,11 +513,145 @@ namespace R2::VK
             {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 500}
         };
 
-        dpci.pPoolSizes = poolSizes;
-        dpci.poolSizeCount = sizeof(poolSizes) / sizeof(VkDescriptorPoolSize);
-        dpci.flags =
+        VkDescriptorPoolCreateFlags flags =
             VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
 
-        VKCHECK(vkCreateDescriptorPool(handles.Device, &dpci, handles.AllocCallbacks, &handles.DescriptorPool));
+        descriptorPools = new DescriptorPoolChain(&handles, flags, poolSizes,
+                                                  sizeof(poolSizes) / sizeof(VkDescriptorPoolSize), 1000);
+        handles.DescriptorPool = descriptorPools->GetFirstPool();
+        descriptorSetCache = new DescriptorSetCache();
+    }
+
+    DescriptorPoolChain* Core::createTransientDescriptorPools()
+    {
+        VkDescriptorPoolSize poolSizes[] = {
+            {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1024},
+            {VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 256},
+            {VK_DESCRIPTOR_TYPE_SAMPLER, 64},
+            {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 128},
+            {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 256},
+            {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 256}
+        };
+
+        // Sets are never freed individually, so there's no FREE_DESCRIPTOR_SET_BIT
+        return new DescriptorPoolChain(&handles, 0, poolSizes, sizeof(poolSizes) / sizeof(VkDescriptorPoolSize), 256);
+    }
+
+    // Goes in front of the data from vkGetPipelineCacheData. Vulkan's own header doesn't have the
+    // driver version, and has nothing to catch a truncated or damaged file.
+    struct PipelineCacheFileHeader
+    {
+        uint32_t Magic;
+        uint32_t Version;
+        uint32_t VendorID;
+        uint32_t DeviceID;
+        uint32_t DriverVersion;
+        uint8_t PipelineCacheUUID[VK_UUID_SIZE];
+        uint64_t DataSize;
+        uint64_t DataHash;
+    };
+
+    const uint32_t PIPELINE_CACHE_MAGIC = 0x43503252; // "R2PC"
+    const uint32_t PIPELINE_CACHE_VERSION = 1;
+
+    uint64_t hashPipelineCacheData(const uint8_t* data, size_t size)
+    {
+        // FNV-1a
+        uint64_t hash = 14695981039346656037ull;
+
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= data[i];
+            hash *= 1099511628211ull;
+        }
+
+        return hash;
+    }
+
+    bool isPipelineCacheDataValid(const VkPhysicalDeviceProperties& props, const void* data, size_t dataSize)
+    {
+        if (dataSize < sizeof(PipelineCacheFileHeader))
+            return false;
+
+        PipelineCacheFileHeader header;
+        memcpy(&header, data, sizeof(header));
+
+        if (header.Magic != PIPELINE_CACHE_MAGIC || header.Version != PIPELINE_CACHE_VERSION ||
+            header.VendorID != props.vendorID || header.DeviceID != props.deviceID ||
+            header.DriverVersion != props.driverVersion ||
+            memcmp(header.PipelineCacheUUID, props.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+            return false;
+
+        if (header.DataSize != dataSize - sizeof(header) || header.DataSize < sizeof(VkPipelineCacheHeaderVersionOne))
+            return false;
+
+        const uint8_t* cacheData = static_cast<const uint8_t*>(data) + sizeof(header);
+
+        // The driver checks its own header too, but some drivers have crashed on bad data
+        VkPipelineCacheHeaderVersionOne vkHeader;
+        memcpy(&vkHeader, cacheData, sizeof(vkHeader));
+
+        if (vkHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+            vkHeader.vendorID != props.vendorID || vkHeader.deviceID != props.deviceID ||
+            memcmp(vkHeader.pipelineCacheUUID, props.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+            return false;
+
+        return hashPipelineCacheData(cacheData, header.DataSize) == header.DataHash;
+    }
+
+    void Core::createPipelineCache(const void* data, size_t dataSize)
+    {
+        VkPhysicalDeviceProperties props{};
+        vkGetPhysicalDeviceProperties(handles.PhysicalDevice, &props);
+
+        VkPipelineCacheCreateInfo pcci{ VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+
+        if (data != nullptr && dataSize > 0)
+        {
+            if (isPipelineCacheDataValid(props, data, dataSize))
+            {
+                pcci.initialDataSize = dataSize - sizeof(PipelineCacheFileHeader);
+                pcci.pInitialData = static_cast<const uint8_t*>(data) + sizeof(PipelineCacheFileHeader);
+            }
+            else if (dbgOutRecv)
+            {
+                dbgOutRecv->DebugMessage("Pipeline cache data doesn't match this device and driver, starting with an empty cache");
+            }
+        }
+
+        VKCHECK(vkCreatePipelineCache(handles.Device, &pcci, handles.AllocCallbacks, &handles.PipelineCache));
+    }
+
+    void Core::SerializePipelineCache(std::vector<uint8_t>& data)
+    {
+        VkPhysicalDeviceProperties props{};
+        vkGetPhysicalDeviceProperties(handles.PhysicalDevice, &props);
+
+        // Pipelines built on other threads can grow the cache between the two calls
+        size_t cacheSize;
+        VkResult res;
+
+        do
+        {
+            VKCHECK(vkGetPipelineCacheData(handles.Device, handles.PipelineCache, &cacheSize, nullptr));
+            data.resize(sizeof(PipelineCacheFileHeader) + cacheSize);
+            res = vkGetPipelineCacheData(handles.Device, handles.PipelineCache, &cacheSize,
+                                         data.data() + sizeof(PipelineCacheFileHeader));
+        } while (res == VK_INCOMPLETE);
+
+        VKCHECK(res);
+        data.resize(sizeof(PipelineCacheFileHeader) + cacheSize);
+
+        PipelineCacheFileHeader header{};
+        header.Magic = PIPELINE_CACHE_MAGIC;
+        header.Version = PIPELINE_CACHE_VERSION;
+        header.VendorID = props.vendorID;
+        header.DeviceID = props.deviceID;
+        header.DriverVersion = props.driverVersion;
+        memcpy(header.PipelineCacheUUID, props.pipelineCacheUUID, VK_UUID_SIZE);
+        header.DataSize = cacheSize;
+        header.DataHash = hashPipelineCacheData(data.data() + sizeof(header), cacheSize);
+
+        memcpy(data.data(), &header, sizeof(header));
     }
 }
@@ -5,14 +5,61 @@
 #include <R2/VKSampler.hpp>
 #include <R2/VKDeletionQueue.hpp>
 #include <volk.h>
+#include <DescriptorPoolChain.hpp>
+#include <DescriptorSetCache.hpp>
+#include <assert.h>
 
 namespace R2::VK
 {
     int allocatedDescriptorSets = 0;
 
+    // Layouts with more descriptors than this are always updated with vkUpdateDescriptorSets,
+    // so template payloads can live on the stack
+    const uint32_t MAX_TEMPLATE_DESCRIPTORS = 32;
+
+    // One element of an update template payload. Both infos are the same size, so every
+    // entry can use the same stride.
+    union TemplateDescriptor
+    {
+        VkDescriptorImageInfo Image;
+        VkDescriptorBufferInfo Buffer;
+    };
+
+    bool isImageDescriptor(DescriptorType type)
+    {
+        switch (type)
+        {
+        case DescriptorType::Sampler:
+        case DescriptorType::CombinedImageSampler:
+        case DescriptorType::SampledImage:
+        case DescriptorType::StorageImage:
+        case DescriptorType::InputAttachment:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    bool isBufferDescriptor(DescriptorType type)
+    {
+        switch (type)
+        {
+        case DescriptorType::UniformBuffer:
+        case DescriptorType::StorageBuffer:
+        case DescriptorType::UniformBufferDynamic:
+        case DescriptorType::StorageBufferDynamic:
+            return true;
+        default:
+            return false;
+        }
+    }
+
     DescriptorSet::DescriptorSet(Core* core, VkDescriptorSet set)
         : core(core)
         , set(set)
+        , setLayout(nullptr)
+        , pooled(false)
+        , transient(false)
     {
         allocatedDescriptorSets++;
     }
@@ -24,14 +71,23 @@ namespace R2::VK
 
     DescriptorSet::~DescriptorSet()
     {
-        DeletionQueue* dq = core->perFrameResources[core->frameIndex].DeletionQueue;
-        DQ_QueueDescriptorSetFree(dq, core->GetHandles()->DescriptorPool, set);
+        if (pooled)
+        {
+            core->descriptorPools->Free(set, core->GetFrameNumber());
+        }
+        else if (!transient)
+        {
+            DeletionQueue* dq = core->perFrameResources[core->frameIndex].DeletionQueue;
+            DQ_QueueDescriptorSetFree(dq, core->GetHandles()->DescriptorPool, set);
+        }
         allocatedDescriptorSets--;
     }
 
     DescriptorSetLayout::DescriptorSetLayout(Core* core, VkDescriptorSetLayout layout)
         : core(core)
         , layout(layout)
+        , updateTemplate(VK_NULL_HANDLE)
+        , numTemplateDescriptors(0)
     {
     }
 
@@ -42,10 +98,38 @@ namespace R2::VK
 
     DescriptorSetLayout::~DescriptorSetLayout()
     {
+        core->invalidateCachedDescriptors(this);
+
         const Handles* handles = core->GetHandles();
+        if (updateTemplate != VK_NULL_HANDLE)
+        {
+            vkDestroyDescriptorUpdateTemplate(handles->Device, updateTemplate, handles->AllocCallbacks);
+        }
         vkDestroyDescriptorSetLayout(handles->Device, layout, handles->AllocCallbacks);
     }
 
+    bool DescriptorSetLayout::getTemplateIndex(uint32_t binding, uint32_t arrayElement, DescriptorType type,
+                                               uint32_t& index) const
+    {
+        uint32_t firstIndex = 0;
+
+        for (const DescriptorCount& dc : descriptorCounts)
+        {
+            if (dc.Binding == binding)
+            {
+                if (dc.Type != type || arrayElement >= dc.Count)
+                    return false;
+
+                index = firstIndex + arrayElement;
+                return true;
+            }
+
+            firstIndex += dc.Count;
+        }
+
+        return false;
+    }
+
     DescriptorSetLayoutBuilder::DescriptorSetLayoutBuilder(Core* core)
         : core(core)
     {
@@ -144,22 +228,79 @@ namespace R2::VK
         VkDescriptorSetLayout dsl;
         VKCHECK(vkCreateDescriptorSetLayout(handles->Device, &dslci, handles->AllocCallbacks, &dsl));
 
-        return new DescriptorSetLayout(core, dsl);
+        DescriptorSetLayout* layout = new DescriptorSetLayout(core, dsl);
+        layout->descriptorCounts.reserve(bindings.size());
+
+        bool canUseTemplate = true;
+        uint32_t numDescriptors = 0;
+
+        for (DescriptorBinding& db : bindings)
+        {
+            layout->descriptorCounts.push_back({ db.Binding, db.Type, db.Count, db.VariableDescriptorCount });
+
+            numDescriptors += db.Count;
+            canUseTemplate &= !db.VariableDescriptorCount && (isImageDescriptor(db.Type) || isBufferDescriptor(db.Type));
+        }
+
+        if (canUseTemplate && numDescriptors > 0 && numDescriptors <= MAX_TEMPLATE_DESCRIPTORS)
+        {
+            std::vector<VkDescriptorUpdateTemplateEntry> entries;
+            entries.reserve(bindings.size());
+            uint32_t firstIndex = 0;
+
+            for (DescriptorBinding& db : bindings)
+            {
+                VkDescriptorUpdateTemplateEntry entry{};
+                entry.dstBinding = db.Binding;
+                entry.dstArrayElement = 0;
+                entry.descriptorCount = db.Count;
+                entry.descriptorType = static_cast<VkDescriptorType>(db.Type);
+                entry.offset = firstIndex * sizeof(TemplateDescriptor);
+                entry.stride = sizeof(TemplateDescriptor);
+                entries.push_back(entry);
+
+                firstIndex += db.Count;
+            }
+
+            VkDescriptorUpdateTemplateCreateInfo dutci{VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO};
+            dutci.descriptorUpdateEntryCount = (uint32_t)entries.size();
+            dutci.pDescriptorUpdateEntries = entries.data();
+            dutci.templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET;
+            dutci.descriptorSetLayout = dsl;
+
+            VKCHECK(vkCreateDescriptorUpdateTemplate(handles->Device, &dutci, handles->AllocCallbacks,
+                                                     &layout->updateTemplate));
+            layout->numTemplateDescriptors = numDescriptors;
+        }
+
+        return layout;
     }
 
     DescriptorSetUpdater::DescriptorSetUpdater(Core* core, DescriptorSet* ds)
-        : handles(core->GetHandles())
+        : core(core)
+        , handles(core->GetHandles())
         , ds(ds)
+        , layout(nullptr)
     {
     }
 
     DescriptorSetUpdater::DescriptorSetUpdater(Core* core, DescriptorSet* ds, int numDescriptors)
-        : handles(core->GetHandles())
+        : core(core)
+        , handles(core->GetHandles())
         , ds(ds)
+        , layout(nullptr)
     {
         descriptorWrites.reserve(numDescriptors);
     }
 
+    DescriptorSetUpdater::DescriptorSetUpdater(Core* core, DescriptorSetLayout* layout)
+        : core(core)
+        , handles(core->GetHandles())
+        , ds(nullptr)
+        , layout(layout)
+    {
+    }
+
     DescriptorSetUpdater& DescriptorSetUpdater::AddTexture(uint32_t binding, uint32_t arrayElement, DescriptorType type,
                                                            Texture* tex, Sampler* samp)
     {
@@ -227,8 +368,123 @@ namespace R2::VK
         return *this;
     }
 
+    void DescriptorSetUpdater::fillImageInfo(const DSWrite& dw, VkDescriptorImageInfo& dii)
+    {
+        dii = {};
+        if (dw.TextureLayout == ImageLayout::Undefined)
+        {
+            if (dw.Type != DescriptorType::StorageImage)
+                dii.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            else
+                dii.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        }
+        else
+        {
+            dii.imageLayout = (VkImageLayout)dw.TextureLayout;
+        }
+
+        if (dw.WriteType == DSWriteType::Texture)
+            dii.imageView = dw.Texture->GetView();
+        else
+            dii.imageView = dw.TextureView->GetNativeHandle();
+
+        if (dw.Sampler != nullptr)
+            dii.sampler = dw.Sampler->GetNativeHandle();
+    }
+
+    void DescriptorSetUpdater::fillBufferInfo(const DSWrite& dw, VkDescriptorBufferInfo& dbi)
+    {
+        dbi = {};
+        dbi.buffer = dw.Buffer->GetNativeHandle();
+        dbi.offset = 0;
+        dbi.range = VK_WHOLE_SIZE;
+    }
+
+    bool DescriptorSetUpdater::updateWithTemplate()
+    {
+        const DescriptorSetLayout* layout = ds->setLayout;
+
+        if (layout == nullptr || layout->updateTemplate == VK_NULL_HANDLE)
+            return false;
+
+        // A template writes the whole set, so it can only be used when every descriptor is given
+        if (descriptorWrites.size() != layout->numTemplateDescriptors)
+            return false;
+
+        TemplateDescriptor payload[MAX_TEMPLATE_DESCRIPTORS];
+        bool written[MAX_TEMPLATE_DESCRIPTORS] = {};
+
+        for (const DSWrite& dw : descriptorWrites)
+        {
+            uint32_t index;
+            if (!layout->getTemplateIndex(dw.Binding, dw.ArrayElement, dw.Type, index) || written[index])
+                return false;
+
+            written[index] = true;
+
+            if (dw.WriteType == DSWriteType::Buffer)
+                fillBufferInfo(dw, payload[index].Buffer);
+            else
+                fillImageInfo(dw, payload[index].Image);
+        }
+
+        vkUpdateDescriptorSetWithTemplate(handles->Device, ds->GetNativeHandle(), layout->updateTemplate, payload);
+        return true;
+    }
+
+    template <typename T>
+    void appendCacheKey(std::string& key, const T& value)
+    {
+        key.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void DescriptorSetUpdater::writeCacheKey(std::string& key, std::vector<const void*>& resources) const
+    {
+        appendCacheKey(key, layout);
+        resources.push_back(layout);
+
+        for (const DSWrite& dw : descriptorWrites)
+        {
+            // Texture, TextureView and Buffer share the union, so any of them gives the pointer
+            const void* resource = dw.Texture;
+
+            appendCacheKey(key, dw.Binding);
+            appendCacheKey(key, dw.ArrayElement);
+            appendCacheKey(key, dw.Type);
+            appendCacheKey(key, dw.WriteType);
+            appendCacheKey(key, dw.TextureLayout);
+            appendCacheKey(key, resource);
+            appendCacheKey(key, dw.Sampler);
+
+            resources.push_back(resource);
+            if (dw.Sampler != nullptr)
+                resources.push_back(dw.Sampler);
+        }
+    }
+
+    DescriptorSet* DescriptorSetUpdater::GetCachedSet()
+    {
+        assert(layout != nullptr);
+
+        std::string key;
+        std::vector<const void*> resources;
+        writeCacheKey(key, resources);
+
+        DescriptorSet* cached = core->descriptorSetCache->Find(key);
+        if (cached != nullptr)
+            return cached;
+
+        ds = core->CreateDescriptorSet(layout);
+        Update();
+
+        return core->descriptorSetCache->Add(key, ds, resources);
+    }
+
     void DescriptorSetUpdater::Update()
     {
+        if (updateWithTemplate())
+            return;
+
         std::vector<VkWriteDescriptorSet> writes;
         std::vector<VkDescriptorImageInfo> imageInfos;
         std::vector<VkDescriptorBufferInfo> bufferInfos;
@@ -265,39 +521,16 @@ namespace R2::VK
             case DSWriteType::Texture:
             case DSWriteType::TextureView:
                 {
-                    VkDescriptorImageInfo dii{};
-                    if (dw.TextureLayout == ImageLayout::Undefined)
-                    {
-                        if (dw.Type != DescriptorType::StorageImage)
-                            dii.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                        else
-                            dii.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-                    }
-                    else
-                    {
-                        dii.imageLayout = (VkImageLayout)dw.TextureLayout;
-                    }
-
-                    if (dw.WriteType == DSWriteType::Texture)
-                        dii.imageView = dw.Texture->GetView();
-                    else
-                        dii.imageView = dw.TextureView->GetNativeHandle();
-
-                    if (dw.Sampler != nullptr)
-                        dii.sampler = dw.Sampler->GetNativeHandle();
-
-                    imageInfos.push_back(dii);
-                    vw.pImageInfo = &imageInfos[imageInfos.size() - 1];
+                    imageInfos.emplace_back();
+                    fillImageInfo(dw, imageInfos.back());
+                    vw.pImageInfo = &imageInfos.back();
                     break;
                 }
             case DSWriteType::Buffer:
                 {
-                    VkDescriptorBufferInfo bii{};
-                    bii.buffer = dw.Buffer->GetNativeHandle();
-                    bii.offset = 0;
-                    bii.range = VK_WHOLE_SIZE;
-                    bufferInfos.push_back(bii);
-                    vw.pBufferInfo = &bufferInfos[bufferInfos.size() - 1];
+                    bufferInfos.emplace_back();
+                    fillBufferInfo(dw, bufferInfos.back());
+                    vw.pBufferInfo = &bufferInfos.back();
                     break;
                 }
             }
@@ -4,9 +4,10 @@
 namespace R2::VK
 {
     FrameSeparatedBuffer::FrameSeparatedBuffer(Core* core, const BufferCreateInfo& bci)
-        : core(core)
+        : numBuffers(core->GetNumFramesInFlight())
+        , core(core)
     {
-        for (int i = 0; i < 2; i++)
+        for (uint32_t i = 0; i < numBuffers; i++)
         {
             buffers[i] = core->CreateBuffer(bci);
         }
@@ -14,7 +15,7 @@ namespace R2::VK
 
     FrameSeparatedBuffer::~FrameSeparatedBuffer()
     {
-        for (int i = 0; i < 2; i++)
+        for (uint32_t i = 0; i < numBuffers; i++)
         {
             core->DestroyBuffer(buffers[i]);
         }
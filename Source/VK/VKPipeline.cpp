@@ -5,11 +5,40 @@
 #include <R2/VKTexture.hpp>
 #include <volk.h>
 #include <RenderPassCache.hpp>
+#include <PipelineCreateData.hpp>
+#include <string.h>
+#include <assert.h>
 
 namespace R2::VK
 {
+    uint64_t hashSpirv(const uint32_t* data, size_t dataLength)
+    {
+        // FNV-1a over whole words, seeded with the length. SPIR-V is always a multiple of 4 bytes.
+        uint64_t hash = 14695981039346656037ull ^ dataLength;
+        size_t numWords = dataLength / sizeof(uint32_t);
+
+        for (size_t i = 0; i < numWords; i++)
+        {
+            hash ^= data[i];
+            hash *= 1099511628211ull;
+        }
+
+        return hash;
+    }
+
+    std::atomic<uint64_t> nextShaderModuleId = 1;
+
     ShaderModule::ShaderModule(const Handles* handles, const uint32_t* data, size_t dataLength)
+        : ShaderModule(handles, data, dataLength, hashSpirv(data, dataLength))
+    {
+    }
+
+    ShaderModule::ShaderModule(const Handles* handles, const uint32_t* data, size_t dataLength, uint64_t codeHash)
         : handles(handles)
+        , refCount(1)
+        , core(nullptr)
+        , codeHash(codeHash)
+        , id(nextShaderModuleId++)
     {
         VkShaderModuleCreateInfo smci{ VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
         smci.codeSize = dataLength;
@@ -27,9 +56,75 @@ namespace R2::VK
         return mod;
     }
 
+    void ShaderModule::AddRef()
+    {
+        refCount++;
+    }
+
+    void ShaderModule::Release()
+    {
+        if (core != nullptr)
+        {
+            core->releaseShaderModule(this);
+            return;
+        }
+
+        if (--refCount == 0)
+            delete this;
+    }
+
+    ShaderModule* Core::LoadShaderModule(const uint32_t* data, size_t dataLength)
+    {
+        assert(dataLength % sizeof(uint32_t) == 0);
+        uint64_t hash = hashSpirv(data, dataLength);
+
+        std::unique_lock lock{ shaderModuleMutex };
+
+        auto it = shaderModules.find(hash);
+        if (it != shaderModules.end())
+        {
+            ShaderModule* existing = it->second;
+
+            if (existing->code.size() * sizeof(uint32_t) == dataLength &&
+                memcmp(existing->code.data(), data, dataLength) == 0)
+            {
+                existing->refCount++;
+                return existing;
+            }
+
+            // Different SPIR-V with the same hash, so this one just doesn't get cached. It has
+            // its own ID, so it doesn't share pipelines with the cached one either.
+            return new ShaderModule(&handles, data, dataLength, hash);
+        }
+
+        ShaderModule* mod = new ShaderModule(&handles, data, dataLength, hash);
+        mod->core = this;
+        mod->code.assign(data, data + dataLength / sizeof(uint32_t));
+        shaderModules.emplace(hash, mod);
+
+        return mod;
+    }
+
+    void Core::releaseShaderModule(ShaderModule* mod)
+    {
+        {
+            std::unique_lock lock{ shaderModuleMutex };
+
+            if (--mod->refCount > 0)
+                return;
+
+            shaderModules.erase(mod->codeHash);
+        }
+
+        delete mod;
+    }
+
+    std::atomic<uint64_t> nextPipelineLayoutId = 1;
+
     PipelineLayout::PipelineLayout(const Handles* handles, VkPipelineLayout layout)
         : handles(handles)
         , layout(layout)
+        , id(nextPipelineLayoutId++)
     {}
 
     PipelineLayout::~PipelineLayout()
@@ -82,6 +177,8 @@ namespace R2::VK
     Pipeline::Pipeline(Core* core, VkPipeline pipeline)
         : core(core)
         , pipeline(pipeline)
+        , refCount(1)
+        , isShared(false)
     {}
 
     Pipeline::~Pipeline()
@@ -95,6 +192,77 @@ namespace R2::VK
         return pipeline;
     }
 
+    void Pipeline::AddRef()
+    {
+        refCount++;
+    }
+
+    void Pipeline::Release()
+    {
+        // Shared pipelines can be found again while they're being released, so Core has to
+        // do it under its lock
+        if (isShared)
+        {
+            core->releaseSharedPipeline(this);
+            return;
+        }
+
+        if (--refCount == 0)
+            delete this;
+    }
+
+    Pipeline* Core::findSharedPipeline(const std::string& key)
+    {
+        std::unique_lock lock{ sharedPipelineMutex };
+
+        auto it = sharedPipelines.find(key);
+        if (it == sharedPipelines.end())
+            return nullptr;
+
+        it->second->refCount++;
+        return it->second;
+    }
+
+    Pipeline* Core::addSharedPipeline(const std::string& key, Pipeline* pipeline)
+    {
+        std::unique_lock lock{ sharedPipelineMutex };
+
+        // Another thread may have built the same pipeline in the meantime
+        auto it = sharedPipelines.find(key);
+        if (it != sharedPipelines.end())
+        {
+            it->second->refCount++;
+            delete pipeline;
+            return it->second;
+        }
+
+        pipeline->sharedKey = key;
+        pipeline->isShared = true;
+        sharedPipelines.emplace(key, pipeline);
+
+        return pipeline;
+    }
+
+    void Core::releaseSharedPipeline(Pipeline* pipeline)
+    {
+        {
+            std::unique_lock lock{ sharedPipelineMutex };
+
+            if (--pipeline->refCount > 0)
+                return;
+
+            sharedPipelines.erase(pipeline->sharedKey);
+        }
+
+        delete pipeline;
+    }
+
+    template <typename T>
+    void appendKey(std::string& key, const T& value)
+    {
+        key.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
     PipelineBuilder::PipelineBuilder(Core* core)
         : core(core)
     {
@@ -152,6 +320,7 @@ namespace R2::VK
     PipelineBuilder& PipelineBuilder::Layout(PipelineLayout* layout)
     {
         this->layout = layout->GetNativeHandle();
+        layoutId = layout->id;
         return *this;
     }
 
@@ -221,13 +390,128 @@ namespace R2::VK
         return *this;
     }
 
+    PipelineBuilder& PipelineBuilder::PolygonMode(VK::PolygonMode mode)
+    {
+        assert(mode == VK::PolygonMode::Fill || core->GetSupportedFeatures().NonSolidFill);
+        polygonMode = mode;
+        return *this;
+    }
+
+    PipelineBuilder& PipelineBuilder::ExtendedDynamicState(bool enable)
+    {
+        assert(!enable || core->GetSupportedFeatures().ExtendedDynamicState);
+        extendedDynamicState = enable;
+        return *this;
+    }
+
+    // Without dynamicPrimitiveTopologyUnrestricted, the dynamic topology has to be in the same
+    // class as the one the pipeline was made with
+    Topology getTopologyClass(Topology topology)
+    {
+        switch (topology)
+        {
+        case Topology::PointList:
+            return Topology::PointList;
+        case Topology::LineList:
+        case Topology::LineStrip:
+            return Topology::LineList;
+        default:
+            return Topology::TriangleList;
+        }
+    }
+
     Pipeline* PipelineBuilder::Build()
     {
+        GraphicsPipelineCreateData data;
+        fillCreateData(data);
 
-        // Convert vertex bindings
-        std::vector<VkVertexInputBindingDescription> bindingDescs;
-        std::vector<VkVertexInputAttributeDescription> attributeDescs;
+        VkPipeline pipeline;
+        VKCHECK(vkCreateGraphicsPipelines(core->GetHandles()->Device, core->GetHandles()->PipelineCache, 1, &data.CreateInfo, core->GetHandles()->AllocCallbacks, &pipeline));
+
+        return new Pipeline(core, pipeline);
+    }
+
+    Pipeline* PipelineBuilder::BuildShared()
+    {
+        std::string key;
+        writeStateKey(key);
 
+        Pipeline* pipeline = core->findSharedPipeline(key);
+        if (pipeline != nullptr)
+            return pipeline;
+
+        return core->addSharedPipeline(key, Build());
+    }
+
+    // Everything that goes into the pipeline, with counts in front of the variable length parts.
+    // Shader modules and layouts are compared by ID, since handles of destroyed objects can be
+    // reused for different ones.
+    void PipelineBuilder::writeStateKey(std::string& key) const
+    {
+        appendKey(key, 'G');
+
+        appendKey(key, (uint32_t)shaderStages.size());
+        for (const ShaderStageCreateInfo& stage : shaderStages)
+        {
+            appendKey(key, stage.module.id);
+            appendKey(key, stage.stage);
+        }
+
+        appendKey(key, (uint32_t)attachmentFormats.size());
+        for (TextureFormat format : attachmentFormats)
+        {
+            appendKey(key, format);
+        }
+        appendKey(key, depthFormat);
+
+        appendKey(key, (uint32_t)vertexBindings.size());
+        for (const VertexBinding& vb : vertexBindings)
+        {
+            appendKey(key, vb.Binding);
+            appendKey(key, vb.Size);
+            appendKey(key, (uint32_t)vb.Attributes.size());
+
+            for (const VertexAttribute& va : vb.Attributes)
+            {
+                appendKey(key, va.Index);
+                appendKey(key, va.Format);
+                appendKey(key, va.Offset);
+            }
+        }
+
+        appendKey(key, layoutId);
+        appendKey(key, alphaBlend);
+        appendKey(key, alphaToCoverage);
+        appendKey(key, additiveBlend);
+        appendKey(key, numSamples);
+        appendKey(key, viewMask);
+        appendKey(key, extendedDynamicState);
+
+        // Dynamic state doesn't go into the pipeline, so it's left out of the key
+        if (extendedDynamicState)
+        {
+            appendKey(key, getTopologyClass(topology));
+
+            if (!core->GetSupportedFeatures().DynamicPolygonMode)
+                appendKey(key, polygonMode);
+
+            return;
+        }
+
+        appendKey(key, topology);
+        appendKey(key, cullMode);
+        appendKey(key, depthTest);
+        appendKey(key, depthWrite);
+        appendKey(key, depthBias);
+        appendKey(key, constantDepthBias);
+        appendKey(key, slopeDepthBias);
+        appendKey(key, depthCompareOp);
+        appendKey(key, polygonMode);
+    }
+
+    void PipelineBuilder::fillCreateData(GraphicsPipelineCreateData& data) const
+    {
+        // Convert vertex bindings
         for (const VertexBinding& vb : vertexBindings)
         {
             VkVertexInputBindingDescription desc{};
@@ -243,34 +527,56 @@ namespace R2::VK
                 adesc.offset = va.Offset;
                 adesc.format = static_cast<VkFormat>(va.Format);
 
-                attributeDescs.push_back(adesc);
+                data.AttributeDescs.push_back(adesc);
             }
 
-            bindingDescs.push_back(desc);
+            data.BindingDescs.push_back(desc);
         }
 
         // Vertex input state
-        VkPipelineVertexInputStateCreateInfo vertexInputStateCI{ VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
-        vertexInputStateCI.pVertexBindingDescriptions = bindingDescs.data();
-        vertexInputStateCI.vertexBindingDescriptionCount = (uint32_t)bindingDescs.size();
+        VkPipelineVertexInputStateCreateInfo& vertexInputStateCI = data.VertexInputState;
+        vertexInputStateCI = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+        vertexInputStateCI.pVertexBindingDescriptions = data.BindingDescs.data();
+        vertexInputStateCI.vertexBindingDescriptionCount = (uint32_t)data.BindingDescs.size();
 
-        vertexInputStateCI.pVertexAttributeDescriptions = attributeDescs.data();
-        vertexInputStateCI.vertexAttributeDescriptionCount = (uint32_t)attributeDescs.size();
+        vertexInputStateCI.pVertexAttributeDescriptions = data.AttributeDescs.data();
+        vertexInputStateCI.vertexAttributeDescriptionCount = (uint32_t)data.AttributeDescs.size();
 
         // Input assembly state
-        VkPipelineInputAssemblyStateCreateInfo inputAssemblyStateCI{ VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
-        inputAssemblyStateCI.topology = static_cast<VkPrimitiveTopology>(topology);
+        VkPipelineInputAssemblyStateCreateInfo& inputAssemblyStateCI = data.InputAssemblyState;
+        inputAssemblyStateCI = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
+        inputAssemblyStateCI.topology = static_cast<VkPrimitiveTopology>(extendedDynamicState ? getTopologyClass(topology) : topology);
 
         // Dynamic state
-        VkPipelineDynamicStateCreateInfo dynamicStateCI{ VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
-        VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_FRAGMENT_SHADING_RATE_KHR, VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
-        dynamicStateCI.pDynamicStates = dynamicStates;
-        dynamicStateCI.dynamicStateCount = 3;
+        VkPipelineDynamicStateCreateInfo& dynamicStateCI = data.DynamicState;
+        dynamicStateCI = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
+        data.DynamicStates[0] = VK_DYNAMIC_STATE_FRAGMENT_SHADING_RATE_KHR;
+        data.DynamicStates[1] = VK_DYNAMIC_STATE_VIEWPORT;
+        data.DynamicStates[2] = VK_DYNAMIC_STATE_SCISSOR;
+        uint32_t numDynamicStates = 3;
+
+        if (extendedDynamicState)
+        {
+            data.DynamicStates[numDynamicStates++] = VK_DYNAMIC_STATE_CULL_MODE;
+            data.DynamicStates[numDynamicStates++] = VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY;
+            data.DynamicStates[numDynamicStates++] = VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE;
+            data.DynamicStates[numDynamicStates++] = VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE;
+            data.DynamicStates[numDynamicStates++] = VK_DYNAMIC_STATE_DEPTH_COMPARE_OP;
+            data.DynamicStates[numDynamicStates++] = VK_DYNAMIC_STATE_DEPTH_BIAS_ENABLE;
+            data.DynamicStates[numDynamicStates++] = VK_DYNAMIC_STATE_DEPTH_BIAS;
+
+            if (core->GetSupportedFeatures().DynamicPolygonMode)
+                data.DynamicStates[numDynamicStates++] = VK_DYNAMIC_STATE_POLYGON_MODE_EXT;
+        }
+
+        dynamicStateCI.pDynamicStates = data.DynamicStates;
+        dynamicStateCI.dynamicStateCount = numDynamicStates;
 
         // Rasterization state
-        VkPipelineRasterizationStateCreateInfo rasterizationStateCI{ VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
+        VkPipelineRasterizationStateCreateInfo& rasterizationStateCI = data.RasterizationState;
+        rasterizationStateCI = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
         rasterizationStateCI.cullMode = static_cast<VkCullModeFlagBits>(cullMode);
-        rasterizationStateCI.polygonMode = VK_POLYGON_MODE_FILL;
+        rasterizationStateCI.polygonMode = static_cast<VkPolygonMode>(polygonMode);
         rasterizationStateCI.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
         rasterizationStateCI.lineWidth = 1.0f;
         rasterizationStateCI.depthBiasEnable = depthBias;
@@ -278,13 +584,15 @@ namespace R2::VK
         rasterizationStateCI.depthBiasSlopeFactor = slopeDepthBias;
 
         // Depth stencil state
-        VkPipelineDepthStencilStateCreateInfo depthStencilStateCI{ VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
+        VkPipelineDepthStencilStateCreateInfo& depthStencilStateCI = data.DepthStencilState;
+        depthStencilStateCI = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
         depthStencilStateCI.depthTestEnable = depthTest;
         depthStencilStateCI.depthWriteEnable = depthWrite;
         depthStencilStateCI.depthCompareOp = static_cast<VkCompareOp>(depthCompareOp);
 
         // Multisample state
-        VkPipelineMultisampleStateCreateInfo multisampleStateCI{ VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
+        VkPipelineMultisampleStateCreateInfo& multisampleStateCI = data.MultisampleState;
+        multisampleStateCI = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
         multisampleStateCI.rasterizationSamples = (VkSampleCountFlagBits)numSamples;
         if (alphaToCoverage)
         {
@@ -292,8 +600,6 @@ namespace R2::VK
         }
 
         // Attachment blend states
-        std::vector<VkPipelineColorBlendAttachmentState> attachmentBlendStates;
-
         for (size_t i = 0; i < attachmentFormats.size(); i++)
         {
             VkPipelineColorBlendAttachmentState cbas{};
@@ -323,28 +629,29 @@ namespace R2::VK
             {
                 cbas.blendEnable = VK_FALSE;
             }
-            attachmentBlendStates.push_back(cbas);
+            data.AttachmentBlendStates.push_back(cbas);
         }
 
         // Blend info
-        VkPipelineColorBlendStateCreateInfo colorBlendStateCI{ VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
+        VkPipelineColorBlendStateCreateInfo& colorBlendStateCI = data.ColorBlendState;
+        colorBlendStateCI = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
         colorBlendStateCI.attachmentCount = (uint32_t)attachmentFormats.size();
-        colorBlendStateCI.pAttachments = attachmentBlendStates.data();
+        colorBlendStateCI.pAttachments = data.AttachmentBlendStates.data();
         colorBlendStateCI.logicOpEnable = VK_FALSE;
 
         // Viewport state
-        VkPipelineViewportStateCreateInfo viewportStateCI{ VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
+        VkPipelineViewportStateCreateInfo& viewportStateCI = data.ViewportState;
+        viewportStateCI = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
 
         // Since we use dynamic viewport, there isn't much meaning to what we set here
-        VkRect2D scissorRect{ 0, 0, 1280, 720 };
-        VkViewport viewport{ 0.0f, 0.0f, 1280.0f, 720.0f };
-        viewportStateCI.pScissors = &scissorRect;
+        data.Scissor = VkRect2D{ 0, 0, 1280, 720 };
+        data.Viewport = VkViewport{ 0.0f, 0.0f, 1280.0f, 720.0f };
+        viewportStateCI.pScissors = &data.Scissor;
         viewportStateCI.scissorCount = 1;
-        viewportStateCI.pViewports = &viewport;
+        viewportStateCI.pViewports = &data.Viewport;
         viewportStateCI.viewportCount = 1;
 
-        std::vector<VkPipelineShaderStageCreateInfo> vkShaderStages;
-        vkShaderStages.reserve(shaderStages.size());
+        data.ShaderStages.reserve(shaderStages.size());
 
         for (const ShaderStageCreateInfo& stage : shaderStages)
         {
@@ -352,13 +659,14 @@ namespace R2::VK
             vkStage.stage = convertShaderStage(stage.stage);
             vkStage.module = stage.module.GetNativeHandle();
             vkStage.pName = "main";
-            vkShaderStages.push_back(vkStage);
+            data.ShaderStages.push_back(vkStage);
         }
 
-        VkGraphicsPipelineCreateInfo pci{ VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+        VkGraphicsPipelineCreateInfo& pci = data.CreateInfo;
+        pci = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
         pci.renderPass = VK_NULL_HANDLE;
-        pci.pStages = vkShaderStages.data();
-        pci.stageCount = (uint32_t)vkShaderStages.size();
+        pci.pStages = data.ShaderStages.data();
+        pci.stageCount = (uint32_t)data.ShaderStages.size();
         pci.pVertexInputState = &vertexInputStateCI;
         pci.pInputAssemblyState = &inputAssemblyStateCI;
         pci.pRasterizationState = &rasterizationStateCI;
@@ -373,10 +681,16 @@ namespace R2::VK
         if (g_renderPassCache == nullptr)
         {
             // Rendering state
-            VkPipelineRenderingCreateInfo renderingCI{ VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO };
-            renderingCI.colorAttachmentCount = (uint32_t)attachmentFormats.size();
-            if (attachmentFormats.size() > 0)
-                renderingCI.pColorAttachmentFormats = reinterpret_cast<VkFormat*>(&attachmentFormats[0]);
+            for (TextureFormat format : attachmentFormats)
+            {
+                data.AttachmentFormats.push_back(static_cast<VkFormat>(format));
+            }
+
+            VkPipelineRenderingCreateInfo& renderingCI = data.RenderingInfo;
+            renderingCI = { VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO };
+            renderingCI.colorAttachmentCount = (uint32_t)data.AttachmentFormats.size();
+            if (data.AttachmentFormats.size() > 0)
+                renderingCI.pColorAttachmentFormats = data.AttachmentFormats.data();
             renderingCI.depthAttachmentFormat = static_cast<VkFormat>(depthFormat);
             renderingCI.viewMask = viewMask;
             pci.pNext = &renderingCI;
@@ -414,11 +728,6 @@ namespace R2::VK
 
             pci.renderPass = g_renderPassCache->GetPass(rpKey);
         }
-
-        VkPipeline pipeline;
-        VKCHECK(vkCreateGraphicsPipelines(core->GetHandles()->Device, nullptr, 1, &pci, core->GetHandles()->AllocCallbacks, &pipeline));
-
-        return new Pipeline(core, pipeline);
     }
 
     ComputePipelineBuilder::ComputePipelineBuilder(Core* core)
@@ -435,22 +744,43 @@ namespace R2::VK
     ComputePipelineBuilder& ComputePipelineBuilder::Layout(PipelineLayout* pl)
     {
         pipelineLayout = pl->GetNativeHandle();
+        layoutId = pl->id;
         return *this;
     }
 
     Pipeline* ComputePipelineBuilder::Build()
+    {
+        VkComputePipelineCreateInfo cpci;
+        fillCreateInfo(cpci);
+
+        VkPipeline pipeline;
+        VKCHECK(vkCreateComputePipelines(core->GetHandles()->Device, core->GetHandles()->PipelineCache, 1, &cpci, core->GetHandles()->AllocCallbacks, &pipeline));
+
+        return new Pipeline(core, pipeline);
+    }
+
+    Pipeline* ComputePipelineBuilder::BuildShared()
+    {
+        std::string key;
+        appendKey(key, 'C');
+        appendKey(key, shaderModule->id);
+        appendKey(key, layoutId);
+
+        Pipeline* pipeline = core->findSharedPipeline(key);
+        if (pipeline != nullptr)
+            return pipeline;
+
+        return core->addSharedPipeline(key, Build());
+    }
+
+    void ComputePipelineBuilder::fillCreateInfo(VkComputePipelineCreateInfo& cpci) const
     {
         VkPipelineShaderStageCreateInfo sci{VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO};
         sci.pName = "main";
         sci.module = shaderModule->GetNativeHandle();
         sci.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-        VkComputePipelineCreateInfo cpci{VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO};
+        cpci = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
         cpci.stage = sci;
         cpci.layout = pipelineLayout;
-
-        VkPipeline pipeline;
-        VKCHECK(vkCreateComputePipelines(core->GetHandles()->Device, nullptr, 1, &cpci, core->GetHandles()->AllocCallbacks, &pipeline));
-
-        return new Pipeline(core, pipeline);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,191 @@
+#include <R2/VKPipelineCompiler.hpp>
+#include <R2/VKPipeline.hpp>
+#include <R2/VKCore.hpp>
+#include <volk.h>
+#include <PipelineCreateData.hpp>
+#include <assert.h>
+
+namespace R2::VK
+{
+    // Either graphics or compute pipelines, created with one vkCreate*Pipelines call
+    struct PipelineCompiler::Job
+    {
+        std::vector<std::unique_ptr<GraphicsPipelineCreateData>> Graphics;
+        std::vector<VkComputePipelineCreateInfo> Compute;
+        std::vector<std::shared_ptr<PendingPipeline::State>> Results;
+    };
+
+    PendingPipeline::PendingPipeline()
+        : state(std::make_shared<State>())
+    {
+        state->Result = nullptr;
+        state->Ready = false;
+    }
+
+    bool PendingPipeline::IsReady() const
+    {
+        return state->Ready.load(std::memory_order_acquire);
+    }
+
+    Pipeline* PendingPipeline::Get() const
+    {
+        return IsReady() ? state->Result.load() : nullptr;
+    }
+
+    Pipeline* PendingPipeline::Wait() const
+    {
+        std::unique_lock lock{ state->Mutex };
+        state->Done.wait(lock, [&]() { return state->Ready.load(); });
+
+        return state->Result;
+    }
+
+    PipelineCompiler::PipelineCompiler(Core* core, uint32_t numThreads)
+        : core(core)
+        , numQueued(0)
+        , stopping(false)
+    {
+        assert(numThreads > 0);
+
+        for (uint32_t i = 0; i < numThreads; i++)
+        {
+            workers.emplace_back(&PipelineCompiler::workerThread, this);
+        }
+    }
+
+    PipelineCompiler::~PipelineCompiler()
+    {
+        {
+            std::unique_lock lock{ queueMutex };
+            stopping = true;
+        }
+
+        queueCondition.notify_all();
+
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    PendingPipeline PipelineCompiler::Compile(const PipelineBuilder& builder)
+    {
+        PendingPipeline pending;
+        CompileBatch(&builder, 1, &pending);
+
+        return pending;
+    }
+
+    PendingPipeline PipelineCompiler::Compile(const ComputePipelineBuilder& builder)
+    {
+        PendingPipeline pending;
+
+        Job* job = new Job;
+        job->Compute.emplace_back();
+        builder.fillCreateInfo(job->Compute.back());
+        job->Results.push_back(pending.state);
+
+        queueJob(job);
+        return pending;
+    }
+
+    void PipelineCompiler::CompileBatch(const PipelineBuilder* builders, uint32_t count, PendingPipeline* pendingPipelines)
+    {
+        if (count == 0)
+            return;
+
+        // Filled in here rather than on the worker so the builders can go away straight after
+        Job* job = new Job;
+        job->Graphics.reserve(count);
+        job->Results.reserve(count);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            job->Graphics.push_back(std::make_unique<GraphicsPipelineCreateData>());
+            builders[i].fillCreateData(*job->Graphics.back());
+            job->Results.push_back(pendingPipelines[i].state);
+        }
+
+        queueJob(job);
+    }
+
+    uint32_t PipelineCompiler::GetNumQueued() const
+    {
+        return numQueued;
+    }
+
+    void PipelineCompiler::queueJob(Job* job)
+    {
+        numQueued += (uint32_t)job->Results.size();
+
+        {
+            std::unique_lock lock{ queueMutex };
+            queue.push_back(job);
+        }
+
+        queueCondition.notify_one();
+    }
+
+    void PipelineCompiler::workerThread()
+    {
+        while (true)
+        {
+            Job* job;
+
+            {
+                std::unique_lock lock{ queueMutex };
+                queueCondition.wait(lock, [&]() { return stopping || !queue.empty(); });
+
+                // Finish whatever's queued before stopping, so nobody's left waiting
+                if (queue.empty())
+                    return;
+
+                job = queue.front();
+                queue.pop_front();
+            }
+
+            runJob(job);
+            delete job;
+        }
+    }
+
+    void PipelineCompiler::runJob(Job* job)
+    {
+        const Handles* handles = core->GetHandles();
+        std::vector<VkPipeline> pipelines(job->Results.size());
+
+        if (!job->Graphics.empty())
+        {
+            std::vector<VkGraphicsPipelineCreateInfo> createInfos;
+            createInfos.reserve(job->Graphics.size());
+
+            for (const std::unique_ptr<GraphicsPipelineCreateData>& data : job->Graphics)
+            {
+                createInfos.push_back(data->CreateInfo);
+            }
+
+            VKCHECK(vkCreateGraphicsPipelines(handles->Device, handles->PipelineCache, (uint32_t)createInfos.size(),
+                createInfos.data(), handles->AllocCallbacks, pipelines.data()));
+        }
+        else
+        {
+            VKCHECK(vkCreateComputePipelines(handles->Device, handles->PipelineCache, (uint32_t)job->Compute.size(),
+                job->Compute.data(), handles->AllocCallbacks, pipelines.data()));
+        }
+
+        for (size_t i = 0; i < job->Results.size(); i++)
+        {
+            PendingPipeline::State& state = *job->Results[i];
+            state.Result = new Pipeline(core, pipelines[i]);
+
+            {
+                std::unique_lock lock{ state.Mutex };
+                state.Ready.store(true, std::memory_order_release);
+            }
+
+            state.Done.notify_all();
+        }
+
+        numQueued -= (uint32_t)job->Results.size();
+    }
+}
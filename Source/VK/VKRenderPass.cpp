@@ -1,5 +1,6 @@
 #include <cassert>
 #include <R2/VKRenderPass.hpp>
+#include <R2/VKCore.hpp>
 #include <R2/VKCommandBuffer.hpp>
 #include <R2/VKEnums.hpp>
 #include <R2/VKTexture.hpp>
@@ -110,7 +111,23 @@ namespace R2::VK
         return *this;
     }
 
+    bool formatHasStencil(TextureFormat format)
+    {
+        return format == TextureFormat::S8_UINT || format == TextureFormat::D16_UNORM_S8_UINT ||
+               format == TextureFormat::D24_UNORM_S8_UINT || format == TextureFormat::D32_SFLOAT_S8_UINT;
+    }
+
     void RenderPass::Begin(CommandBuffer cb)
+    {
+        begin(cb, false);
+    }
+
+    void RenderPass::BeginSecondary(CommandBuffer cb)
+    {
+        begin(cb, true);
+    }
+
+    void RenderPass::begin(CommandBuffer cb, bool secondaryContents)
     {
         for (int i = 0; i < numColorAttachments; i++)
         {
@@ -127,6 +144,8 @@ namespace R2::VK
             renderInfo.layerCount = 1;
             renderInfo.colorAttachmentCount = numColorAttachments;
             renderInfo.viewMask = viewMask;
+            if (secondaryContents)
+                renderInfo.flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT;
 
             VkRenderingAttachmentInfo depthAttachmentInfo{ VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO };
             if (depthAttachment.Texture)
@@ -178,41 +197,9 @@ namespace R2::VK
         }
         else
         {
-            // For now we only support a max of 1 color attachment
-            assert(numColorAttachments <= 1);
-
             const AttachmentInfo& colorAttachment = colorAttachments[0];
 
-            RenderPassKey key
-            {
-                .viewMask = viewMask
-            };
-
-            if (depthAttachment.Texture)
-            {
-                key.depthAttachment = RenderPassAttachment
-                {
-                    .format = (VkFormat)depthAttachment.Texture->GetFormat(),
-                    .loadOp = convertLoadOp(depthAttachment.LoadOp),
-                    .storeOp = convertStoreOp(depthAttachment.StoreOp),
-                    .samples = (VkSampleCountFlagBits)depthAttachment.Texture->GetSamples()
-                };
-                key.useDepth = true;
-            }
-
-            if (numColorAttachments > 0)
-            {
-                key.colorAttachment = RenderPassAttachment
-                {
-                    .format = (VkFormat)colorAttachment.Texture->GetFormat(),
-                    .loadOp = convertLoadOp(colorAttachment.LoadOp),
-                    .storeOp = convertStoreOp(colorAttachment.StoreOp),
-                    .samples = (VkSampleCountFlagBits)colorAttachment.Texture->GetSamples()
-                };
-                key.useColor = true;
-            }
-
-            VkRenderPass renderPass = g_renderPassCache->GetPass(key);
+            VkRenderPass renderPass = getLegacyRenderPass();
             FramebufferKey framebufferKey
             {
                 .width = width,
@@ -280,8 +267,97 @@ namespace R2::VK
                 .pClearValues = clearVals
             };
 
-            vkCmdBeginRenderPass(cb.GetNativeHandle(), &beginInfo, VK_SUBPASS_CONTENTS_INLINE);
+            vkCmdBeginRenderPass(cb.GetNativeHandle(), &beginInfo,
+                secondaryContents ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
+        }
+    }
+
+    VkRenderPass RenderPass::getLegacyRenderPass() const
+    {
+        // For now we only support a max of 1 color attachment
+        assert(numColorAttachments <= 1);
+
+        const AttachmentInfo& colorAttachment = colorAttachments[0];
+
+        RenderPassKey key
+        {
+            .viewMask = viewMask
+        };
+
+        if (depthAttachment.Texture)
+        {
+            key.depthAttachment = RenderPassAttachment
+            {
+                .format = (VkFormat)depthAttachment.Texture->GetFormat(),
+                .loadOp = convertLoadOp(depthAttachment.LoadOp),
+                .storeOp = convertStoreOp(depthAttachment.StoreOp),
+                .samples = (VkSampleCountFlagBits)depthAttachment.Texture->GetSamples()
+            };
+            key.useDepth = true;
+        }
+
+        if (numColorAttachments > 0)
+        {
+            key.colorAttachment = RenderPassAttachment
+            {
+                .format = (VkFormat)colorAttachment.Texture->GetFormat(),
+                .loadOp = convertLoadOp(colorAttachment.LoadOp),
+                .storeOp = convertStoreOp(colorAttachment.StoreOp),
+                .samples = (VkSampleCountFlagBits)colorAttachment.Texture->GetSamples()
+            };
+            key.useColor = true;
+        }
+
+        return g_renderPassCache->GetPass(key);
+    }
+
+    void RenderPass::beginSecondaryCommandBuffer(VkCommandBuffer secondary) const
+    {
+        VkCommandBufferInheritanceInfo inheritanceInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO };
+        VkCommandBufferInheritanceRenderingInfo renderingInheritance{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO };
+        VkFormat colorFormats[4];
+
+        if (g_renderPassCache == nullptr)
+        {
+            for (uint32_t i = 0; i < numColorAttachments; i++)
+            {
+                colorFormats[i] = (VkFormat)colorAttachments[i].Texture->GetFormat();
+            }
+
+            renderingInheritance.viewMask = viewMask;
+            renderingInheritance.colorAttachmentCount = numColorAttachments;
+            renderingInheritance.pColorAttachmentFormats = colorFormats;
+            renderingInheritance.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+            if (numColorAttachments > 0)
+            {
+                renderingInheritance.rasterizationSamples =
+                    (VkSampleCountFlagBits)colorAttachments[0].Texture->GetSamples();
+            }
+
+            if (depthAttachment.Texture)
+            {
+                TextureFormat depthFormat = depthAttachment.Texture->GetFormat();
+                renderingInheritance.depthAttachmentFormat = (VkFormat)depthFormat;
+                if (formatHasStencil(depthFormat))
+                    renderingInheritance.stencilAttachmentFormat = (VkFormat)depthFormat;
+
+                renderingInheritance.rasterizationSamples =
+                    (VkSampleCountFlagBits)depthAttachment.Texture->GetSamples();
+            }
+
+            inheritanceInfo.pNext = &renderingInheritance;
         }
+        else
+        {
+            inheritanceInfo.renderPass = getLegacyRenderPass();
+            inheritanceInfo.subpass = 0;
+        }
+
+        VkCommandBufferBeginInfo cbbi{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+        cbbi.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+        cbbi.pInheritanceInfo = &inheritanceInfo;
+        VKCHECK(vkBeginCommandBuffer(secondary, &cbbi));
     }
 
     void RenderPass::End(CommandBuffer cb)
@@ -18,6 +18,8 @@ namespace R2::VK
 
     Sampler::~Sampler()
     {
+        core->invalidateCachedDescriptors(this);
+
         DeletionQueue* dq = core->perFrameResources[core->frameIndex].DeletionQueue;
         DQ_QueueObjectDeletion(dq, sampler, VK_OBJECT_TYPE_SAMPLER);
     }
@@ -122,13 +122,10 @@ namespace R2::VK
         NumMips = ceil(log2(biggerDimension)) + 1;
     }
 
-    Texture::Texture(Core* core, const TextureCreateInfo& createInfo)
-        : core(core)
-        , lastLayout(ImageLayout::Undefined)
-        , lastAccess(AccessFlags::None)
-        , lastPipelineStage(PipelineStageFlags::AllCommands)
+    // Fills in everything about the image apart from its memory. Returns true if the view has to
+    // reinterpret the image as sRGB.
+    bool fillImageCreateInfo(VkPhysicalDevice physicalDevice, const TextureCreateInfo& createInfo, VkImageCreateInfo& ici)
     {
-        VkImageCreateInfo ici{ VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
         ici.extent.width = createInfo.Width;
         ici.extent.height = createInfo.Height;
         ici.extent.depth = createInfo.Depth;
@@ -167,7 +164,7 @@ namespace R2::VK
             ici.usage = VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
         }
 
-        if (supportsStorage(core->GetHandles()->PhysicalDevice, createInfo.Format) && createInfo.CanUseAsStorage)
+        if (supportsStorage(physicalDevice, createInfo.Format) && createInfo.CanUseAsStorage)
             ici.usage |= VK_IMAGE_USAGE_STORAGE_BIT;
 
         bool forceSRGBView = false;
@@ -192,13 +189,23 @@ namespace R2::VK
             }
         }
 
-        usageFlags = ici.usage;
-        imageFlags = ici.flags;
-
         ici.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
+        return forceSRGBView;
+    }
+
+    Texture::Texture(Core* core, const TextureCreateInfo& createInfo)
+        : core(core)
+        , uniformState{ ImageLayout::Undefined, AccessFlags::None, PipelineStageFlags::AllCommands,
+                        AccessFlags::None, PipelineStageFlags::None }
+        , uploadFrame(0)
+        , uploadOnTransferQueue(false)
+    {
         const Handles* handles = core->GetHandles();
 
+        VkImageCreateInfo ici{ VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+        bool forceSRGBView = fillImageCreateInfo(handles->PhysicalDevice, createInfo, ici);
+
         VmaAllocationCreateInfo vaci{};
 #ifdef __ANDROID__
         vaci.usage = createInfo.IsTransient ? VMA_MEMORY_USAGE_GPU_LAZILY_ALLOCATED : VMA_MEMORY_USAGE_AUTO;
@@ -207,6 +214,35 @@ namespace R2::VK
 #endif
         VKCHECK(vmaCreateImage(handles->Allocator, &ici, &vaci, &image, &allocation, nullptr));
 
+        createView(createInfo, ici, forceSRGBView);
+    }
+
+    Texture::Texture(Core* core, const TextureCreateInfo& createInfo, VmaAllocation memory, uint64_t memoryOffset)
+        : core(core)
+        , allocation(nullptr)
+        , uniformState{ ImageLayout::Undefined, AccessFlags::None, PipelineStageFlags::AllCommands,
+                        AccessFlags::None, PipelineStageFlags::None }
+        , uploadFrame(0)
+        , uploadOnTransferQueue(false)
+    {
+        const Handles* handles = core->GetHandles();
+
+        VkImageCreateInfo ici{ VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+        bool forceSRGBView = fillImageCreateInfo(handles->PhysicalDevice, createInfo, ici);
+
+        // The memory is shared with other textures, so it stays with whoever allocated it
+        VKCHECK(vkCreateImage(handles->Device, &ici, handles->AllocCallbacks, &image));
+        VKCHECK(vmaBindImageMemory2(handles->Allocator, memory, memoryOffset, image, nullptr));
+
+        createView(createInfo, ici, forceSRGBView);
+    }
+
+    void Texture::createView(const TextureCreateInfo& createInfo, const VkImageCreateInfo& ici, bool forceSRGBView)
+    {
+        const Handles* handles = core->GetHandles();
+        usageFlags = ici.usage;
+        imageFlags = ici.flags;
+
         // Now copy everything...
         width = createInfo.Width;
         height = createInfo.Height;
@@ -229,7 +265,7 @@ namespace R2::VK
 
         VkImageViewUsageCreateInfo usageCI{ VK_STRUCTURE_TYPE_IMAGE_VIEW_USAGE_CREATE_INFO };
         usageCI.usage = ici.usage & ~VK_IMAGE_USAGE_STORAGE_BIT;
-        if (!supportsStorage(core->GetHandles()->PhysicalDevice, createInfo.Format))
+        if (!supportsStorage(handles->PhysicalDevice, createInfo.Format))
         {
             ivci.pNext = &usageCI;
         }
@@ -243,15 +279,41 @@ namespace R2::VK
         VKCHECK(vkCreateImageView(handles->Device, &ivci, handles->AllocCallbacks, &imageView));
     }
 
+    void Texture::getMemoryRequirements(Core* core, const TextureCreateInfo& createInfo, VkMemoryRequirements& requirements)
+    {
+        const Handles* handles = core->GetHandles();
+
+        VkImageCreateInfo ici{ VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+        fillImageCreateInfo(handles->PhysicalDevice, createInfo, ici);
+
+        if (vkGetDeviceImageMemoryRequirements != NULL)
+        {
+            VkDeviceImageMemoryRequirements dimr{ VK_STRUCTURE_TYPE_DEVICE_IMAGE_MEMORY_REQUIREMENTS };
+            dimr.pCreateInfo = &ici;
+
+            VkMemoryRequirements2 mr2{ VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2 };
+            vkGetDeviceImageMemoryRequirements(handles->Device, &dimr, &mr2);
+            requirements = mr2.memoryRequirements;
+            return;
+        }
+
+        // Without maintenance4 the only way to ask is with a real image
+        VkImage tmpImage;
+        VKCHECK(vkCreateImage(handles->Device, &ici, handles->AllocCallbacks, &tmpImage));
+        vkGetImageMemoryRequirements(handles->Device, tmpImage, &requirements);
+        vkDestroyImage(handles->Device, tmpImage, handles->AllocCallbacks);
+    }
+
     Texture::Texture(Core* core, VkImage image, ImageLayout layout, const TextureCreateInfo& createInfo, uint32_t usageFlags)
         : image(image)
         , allocation(nullptr)
         , core(core)
-        , lastLayout(layout)
-        , lastAccess(AccessFlags::MemoryRead | AccessFlags::MemoryWrite)
-        , lastPipelineStage(PipelineStageFlags::AllCommands)
+        , uniformState{ layout, AccessFlags::MemoryRead | AccessFlags::MemoryWrite, PipelineStageFlags::AllCommands,
+                        AccessFlags::None, PipelineStageFlags::None }
         , usageFlags(usageFlags)
         , imageFlags(0)
+        , uploadFrame(0)
+        , uploadOnTransferQueue(false)
     {
         // Now copy everything...
         width = createInfo.Width;
@@ -352,163 +414,339 @@ namespace R2::VK
 
     void Texture::Acquire(CommandBuffer cb, ImageLayout layout, AccessFlags access, PipelineStageFlags stage)
     {
-        if (vkCmdPipelineBarrier2 != NULL)
+        Acquire(cb, TextureSubresourceRange::All(), layout, access, stage);
+    }
+
+    void Texture::Acquire(CommandBuffer cb, TextureSubresourceRange range, ImageLayout layout, AccessFlags access, PipelineStageFlags stage)
+    {
+        // The generic attachment layout needs sync2, so pick the specific one without it
+        if (vkCmdPipelineBarrier2 == NULL && layout == ImageLayout::AttachmentOptimal)
         {
-            VkImageMemoryBarrier2 imb{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
-            imb.oldLayout = (VkImageLayout)lastLayout;
-            imb.newLayout = (VkImageLayout)layout;
-            imb.subresourceRange = VkImageSubresourceRange{ getAspectFlags(), 0, (uint32_t)numMips, 0, (uint32_t)layers };
-            imb.image = image;
-            imb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imb.srcAccessMask = (VkAccessFlags2)lastAccess;
-            imb.dstAccessMask = (VkAccessFlags2)access;
+            VkImageAspectFlags aspectFlags = getAspectFlags();
 
-            imb.srcStageMask = (VkPipelineStageFlags2)lastPipelineStage;
-            imb.dstStageMask = (VkPipelineStageFlags2)stage;
+            if (aspectFlags == VK_IMAGE_ASPECT_DEPTH_BIT)
+            {
+                layout = ImageLayout::DepthStencilAttachmentOptimal;
+            }
+            else
+            {
+                layout = ImageLayout::ColorAttachmentOptimal;
+            }
+        }
 
-            VkDependencyInfo depInfo{ VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
-            depInfo.imageMemoryBarrierCount = 1;
-            depInfo.pImageMemoryBarriers = &imb;
-            depInfo.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+        range = resolveRange(range);
 
-            vkCmdPipelineBarrier2(cb.GetNativeHandle(), &depInfo);
+        uint32_t emitted = 0;
+        uint32_t elided = 0;
+        uint32_t merged = 0;
+        AccessFlags srcAccess;
+        PipelineStageFlags srcStage;
+        SubresourceState newState;
+
+        // Barriers are queued on the command buffer and recorded together with the others
+        // before the next command that uses the texture
+        if (hasUniformState())
+        {
+            if (planAccess(uniformState, layout, access, stage, srcAccess, srcStage, newState))
+            {
+                VkImageMemoryBarrier2 imb{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
+                fillBarrier(imb, range, uniformState.Layout, layout, srcAccess, srcStage, access, stage);
+                if (cb.addBarrier(imb))
+                    emitted++;
+                else
+                    merged++;
+            }
+            else
+            {
+                elided++;
+            }
+
+            setSubresourceState(range, newState);
         }
         else
         {
-            VkImageMemoryBarrier imb{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+            std::vector<SubresourceRun> runs;
+            getSubresourceRuns(range, runs);
 
-            if (layout == ImageLayout::AttachmentOptimal)
+            for (const SubresourceRun& run : runs)
             {
-                VkImageAspectFlags aspectFlags = getAspectFlags();
-
-                if (aspectFlags == VK_IMAGE_ASPECT_DEPTH_BIT)
+                if (planAccess(run.State, layout, access, stage, srcAccess, srcStage, newState))
                 {
-                    layout = ImageLayout::DepthStencilAttachmentOptimal;
+                    VkImageMemoryBarrier2 imb{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
+                    fillBarrier(imb, run.Range, run.State.Layout, layout, srcAccess, srcStage, access, stage);
+                    if (cb.addBarrier(imb))
+                        emitted++;
+                    else
+                        merged++;
                 }
                 else
                 {
-                    layout = ImageLayout::ColorAttachmentOptimal;
+                    elided++;
                 }
+
+                setSubresourceState(run.Range, newState);
             }
-            
-            imb.oldLayout = (VkImageLayout)lastLayout;
-            imb.newLayout = (VkImageLayout)layout;
-            imb.subresourceRange = VkImageSubresourceRange{ getAspectFlags(), 0, (uint32_t)numMips, 0, (uint32_t)layers };
-            imb.image = image;
-            imb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imb.srcAccessMask = getOldAccessFlags(lastAccess);
-            imb.dstAccessMask = getOldAccessFlags(access);
-
-            vkCmdPipelineBarrier(
-                cb.GetNativeHandle(),
-                getOldPipelineStageFlags(lastPipelineStage),
-                getOldPipelineStageFlags(stage),
-                VK_DEPENDENCY_BY_REGION_BIT,
-                0, nullptr,
-                0, nullptr,
-                1, &imb
-            );
-        }
-
-        lastLayout = layout;
-        lastAccess = access;
-        lastPipelineStage = stage;
-    }
-
-    void Texture::WriteLayoutTransition(CommandBuffer cb, ImageLayout layout)
-    {
-        if (vkCmdPipelineBarrier2 != NULL)
-        {
-            VkImageMemoryBarrier2 imb{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
-            imb.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-            imb.newLayout = (VkImageLayout)layout;
-            imb.subresourceRange = VkImageSubresourceRange{ getAspectFlags(), 0, (uint32_t)numMips, 0, (uint32_t)layers };
-            imb.image = image;
-            imb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imb.srcAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
-            imb.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
-            
-            VkDependencyInfo depInfo{ VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
-            depInfo.imageMemoryBarrierCount = 1;
-            depInfo.pImageMemoryBarriers = &imb;
-            depInfo.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-
-            vkCmdPipelineBarrier2(cb.GetNativeHandle(), &depInfo);
         }
-        else
+
+        core->countBarriers(emitted, elided, merged);
+    }
+
+    bool Texture::planAccess(const SubresourceState& from, ImageLayout layout, AccessFlags access, PipelineStageFlags stage,
+        AccessFlags& srcAccess, PipelineStageFlags& srcStage, SubresourceState& to)
+    {
+        if (layout == from.Layout && !isWriteAccess(access))
         {
-            VkImageMemoryBarrier imb{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
-            imb.oldLayout = (VkImageLayout)lastLayout;
-            imb.newLayout = (VkImageLayout)layout;
-            imb.subresourceRange = VkImageSubresourceRange{ getAspectFlags(), 0, (uint32_t)numMips, 0, (uint32_t)layers };
-            imb.image = image;
-            imb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imb.srcAccessMask = getOldAccessFlags(lastAccess);
-            imb.dstAccessMask = getOldAccessFlags(lastAccess);
-
-            vkCmdPipelineBarrier(
-                cb.GetNativeHandle(),
-                getOldPipelineStageFlags(lastPipelineStage),
-                getOldPipelineStageFlags(lastPipelineStage),
-                VK_DEPENDENCY_BY_REGION_BIT,
-                0, nullptr,
-                0, nullptr,
-                1, &imb
-            );
-        }
-    }
-
-    void Texture::WriteLayoutTransition(CommandBuffer cb, ImageLayout oldLayout, ImageLayout newLayout)
-    {
-        if (vkCmdPipelineBarrier2 != NULL)
-        {
-            VkImageMemoryBarrier2 imb{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
-            imb.oldLayout = (VkImageLayout)oldLayout;
-            imb.newLayout = (VkImageLayout)newLayout;
-            imb.subresourceRange = VkImageSubresourceRange{ getAspectFlags(), 0, (uint32_t)numMips, 0, (uint32_t)layers };
-            imb.image = image;
-            imb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imb.srcAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
-            imb.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
-
-            VkDependencyInfo depInfo{ VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
-            depInfo.imageMemoryBarrierCount = 1;
-            depInfo.pImageMemoryBarriers = &imb;
-            depInfo.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-
-            vkCmdPipelineBarrier2(cb.GetNativeHandle(), &depInfo);
+            // Reads don't need to wait for each other, only for the last write
+            to = from;
+            to.ReadAccess = from.ReadAccess | access;
+            to.ReadStage = from.ReadStage | stage;
+
+            if (hasAccessBit(from.ReadAccess, access) && hasStageBit(from.ReadStage, stage))
+                return false;
+
+            if (from.WriteAccess == AccessFlags::None && from.WriteStage == PipelineStageFlags::None)
+                return false;
+
+            srcAccess = from.WriteAccess;
+            srcStage = from.WriteStage;
+            return true;
         }
-        else
+
+        // Writes and layout transitions have to wait for the reads as well
+        srcAccess = from.WriteAccess;
+        srcStage = from.WriteStage | from.ReadStage;
+        to = stateAfterBarrier(layout, access, stage);
+        return true;
+    }
+
+    Texture::SubresourceState Texture::stateAfterBarrier(ImageLayout layout, AccessFlags access, PipelineStageFlags stage)
+    {
+        if (isWriteAccess(access))
+        {
+            return SubresourceState{ layout, access, stage, AccessFlags::None, PipelineStageFlags::None };
+        }
+
+        // A layout transition happens before the barrier's second scope, so later reads at other
+        // stages wait on that scope. The transition's writes were already made available by it.
+        return SubresourceState{ layout, AccessFlags::None, stage, access, stage };
+    }
+
+    void Texture::ReleaseOwnership(CommandBuffer cb, QueueType srcQueue, QueueType dstQueue, ImageLayout layout)
+    {
+        uint32_t srcFamily = core->getQueueFamilyIndex(srcQueue);
+        uint32_t dstFamily = core->getQueueFamilyIndex(dstQueue);
+
+        ownershipRuns.clear();
+        getSubresourceRuns(TextureSubresourceRange::All(), ownershipRuns);
+
+        // Both queues share a family, so there's no ownership to give up. The acquire
+        // becomes a normal barrier from the last use.
+        if (srcFamily == dstFamily)
+            return;
+
+        for (const SubresourceRun& run : ownershipRuns)
+        {
+            writeOwnershipBarrier(cb, srcFamily, dstFamily, run.Range, run.State.Layout, layout,
+                run.State.WriteAccess, run.State.WriteStage | run.State.ReadStage,
+                AccessFlags::None, PipelineStageFlags::None);
+        }
+
+        setSubresourceState(TextureSubresourceRange::All(), SubresourceState{ layout, AccessFlags::None,
+            PipelineStageFlags::None, AccessFlags::None, PipelineStageFlags::None });
+    }
+
+    void Texture::AcquireOwnership(CommandBuffer cb, QueueType srcQueue, QueueType dstQueue, AccessFlags access, PipelineStageFlags stage)
+    {
+        uint32_t srcFamily = core->getQueueFamilyIndex(srcQueue);
+        uint32_t dstFamily = core->getQueueFamilyIndex(dstQueue);
+
+        if (srcFamily == dstFamily)
+        {
+            std::vector<SubresourceRun> runs;
+            getSubresourceRuns(TextureSubresourceRange::All(), runs);
+
+            for (const SubresourceRun& run : runs)
+            {
+                Acquire(cb, run.Range, run.State.Layout, access, stage);
+            }
+            return;
+        }
+
+        // The acquire has to repeat the release's layout transitions exactly
+        ImageLayout layout = uniformState.Layout;
+        for (const SubresourceRun& run : ownershipRuns)
+        {
+            writeOwnershipBarrier(cb, srcFamily, dstFamily, run.Range, run.State.Layout, layout,
+                AccessFlags::None, PipelineStageFlags::None, access, stage);
+        }
+
+        setSubresourceState(TextureSubresourceRange::All(), stateAfterBarrier(layout, access, stage));
+    }
+
+    void Texture::writeOwnershipBarrier(CommandBuffer cb, uint32_t srcFamily, uint32_t dstFamily, TextureSubresourceRange range,
+        ImageLayout oldLayout, ImageLayout newLayout, AccessFlags srcAccess, PipelineStageFlags srcStage,
+        AccessFlags dstAccess, PipelineStageFlags dstStage)
+    {
+        VkImageMemoryBarrier2 imb{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
+        fillBarrier(imb, range, oldLayout, newLayout, srcAccess, srcStage, dstAccess, dstStage);
+        imb.srcQueueFamilyIndex = srcFamily;
+        imb.dstQueueFamilyIndex = dstFamily;
+
+        cb.addBarrier(imb);
+    }
+
+    void Texture::fillBarrier(VkImageMemoryBarrier2& imb, TextureSubresourceRange range, ImageLayout oldLayout, ImageLayout newLayout,
+        AccessFlags srcAccess, PipelineStageFlags srcStage, AccessFlags dstAccess, PipelineStageFlags dstStage) const
+    {
+        imb.oldLayout = (VkImageLayout)oldLayout;
+        imb.newLayout = (VkImageLayout)newLayout;
+        imb.subresourceRange = VkImageSubresourceRange{ getAspectFlags(), range.MipStart, range.MipCount, range.LayerStart, range.LayerCount };
+        imb.image = image;
+        imb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        imb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        imb.srcAccessMask = (VkAccessFlags2)srcAccess;
+        imb.dstAccessMask = (VkAccessFlags2)dstAccess;
+        imb.srcStageMask = (VkPipelineStageFlags2)srcStage;
+        imb.dstStageMask = (VkPipelineStageFlags2)dstStage;
+    }
+
+    TextureSubresourceRange Texture::resolveRange(TextureSubresourceRange range) const
+    {
+        assert(range.MipStart < (uint32_t)numMips && range.LayerStart < (uint32_t)layers);
+
+        if (range.MipCount == TextureSubresourceRange::Remaining)
+            range.MipCount = numMips - range.MipStart;
+
+        if (range.LayerCount == TextureSubresourceRange::Remaining)
+            range.LayerCount = layers - range.LayerStart;
+
+        assert(range.MipStart + range.MipCount <= (uint32_t)numMips);
+        assert(range.LayerStart + range.LayerCount <= (uint32_t)layers);
+        return range;
+    }
+
+    bool Texture::isWholeTexture(TextureSubresourceRange range) const
+    {
+        return range.MipStart == 0 && range.MipCount == (uint32_t)numMips &&
+            range.LayerStart == 0 && range.LayerCount == (uint32_t)layers;
+    }
+
+    void Texture::Discard()
+    {
+        Discard(PipelineStageFlags::None, AccessFlags::None);
+    }
+
+    void Texture::Discard(PipelineStageFlags otherStages, AccessFlags otherWrites)
+    {
+        std::vector<SubresourceRun> runs;
+        getSubresourceRuns(TextureSubresourceRange::All(), runs);
+
+        PipelineStageFlags stage = otherStages;
+        AccessFlags writes = otherWrites;
+        for (const SubresourceRun& run : runs)
         {
-            VkImageMemoryBarrier imb{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
-            imb.oldLayout = (VkImageLayout)oldLayout;
-            imb.newLayout = (VkImageLayout)newLayout;
-            imb.subresourceRange = VkImageSubresourceRange{ getAspectFlags(), 0, (uint32_t)numMips, 0, (uint32_t)layers };
-            imb.image = image;
-            imb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-            imb.srcAccessMask = getOldAccessFlags(lastAccess);
-            imb.dstAccessMask = getOldAccessFlags(lastAccess);
+            stage |= run.State.WriteStage | run.State.ReadStage;
+            writes = writes | run.State.WriteAccess;
+        }
+
+        // Nothing has to be made visible any more, but a write still can't overtake earlier
+        // accesses, and earlier writes to the memory have to be made available before it
+        setSubresourceState(TextureSubresourceRange::All(),
+            SubresourceState{ ImageLayout::Undefined, writes, stage, AccessFlags::None, PipelineStageFlags::None });
+    }
+
+    bool Texture::hasUniformState() const
+    {
+        return subresourceStates.empty();
+    }
+
+    void Texture::getSubresourceRuns(TextureSubresourceRange range, std::vector<SubresourceRun>& runs) const
+    {
+        range = resolveRange(range);
+
+        if (hasUniformState())
+        {
+            runs.push_back({ range, uniformState });
+            return;
+        }
 
-            vkCmdPipelineBarrier(
-                    cb.GetNativeHandle(),
-                    getOldPipelineStageFlags(lastPipelineStage),
-                    getOldPipelineStageFlags(lastPipelineStage),
-                    VK_DEPENDENCY_BY_REGION_BIT,
-                    0, nullptr,
-                    0, nullptr,
-                    1, &imb
-            );
+        size_t firstRun = runs.size();
+
+        for (uint32_t mip = range.MipStart; mip < range.MipStart + range.MipCount; mip++)
+        {
+            size_t firstRunOfMip = runs.size();
+            uint32_t layer = range.LayerStart;
+            uint32_t layerEnd = range.LayerStart + range.LayerCount;
+
+            while (layer < layerEnd)
+            {
+                const SubresourceState& state = subresourceStates[mip * layers + layer];
+                uint32_t runStart = layer;
+
+                while (layer < layerEnd && subresourceStates[mip * layers + layer] == state)
+                    layer++;
+
+                // Neighbouring mips are often in the same state, so grow a run that ends on
+                // the previous mip rather than starting a new one where possible
+                bool extended = false;
+                for (size_t i = firstRun; i < firstRunOfMip; i++)
+                {
+                    SubresourceRun& run = runs[i];
+                    if (run.Range.MipStart + run.Range.MipCount == mip &&
+                        run.Range.LayerStart == runStart && run.Range.LayerCount == layer - runStart &&
+                        run.State == state)
+                    {
+                        run.Range.MipCount++;
+                        extended = true;
+                        break;
+                    }
+                }
+
+                if (!extended)
+                    runs.push_back({ TextureSubresourceRange{ mip, 1, runStart, layer - runStart }, state });
+            }
         }
     }
 
+    void Texture::setSubresourceState(TextureSubresourceRange range, const SubresourceState& state)
+    {
+        range = resolveRange(range);
+
+        if (isWholeTexture(range))
+        {
+            subresourceStates.clear();
+            uniformState = state;
+            return;
+        }
+
+        if (hasUniformState())
+        {
+            subresourceStates.assign((size_t)numMips * layers, uniformState);
+        }
+
+        for (uint32_t mip = range.MipStart; mip < range.MipStart + range.MipCount; mip++)
+        {
+            for (uint32_t layer = range.LayerStart; layer < range.LayerStart + range.LayerCount; layer++)
+            {
+                subresourceStates[mip * layers + layer] = state;
+            }
+        }
+
+        // Go back to the single state once every subresource agrees again
+        for (const SubresourceState& s : subresourceStates)
+        {
+            if (s != state)
+                return;
+        }
+
+        subresourceStates.clear();
+        uniformState = state;
+    }
+
     Texture::~Texture()
     {
+        core->invalidateCachedDescriptors(this);
+
         const Handles* handles = core->GetHandles();
         DeletionQueue* dq;
 
@@ -569,6 +807,8 @@ namespace R2::VK
 
     TextureView::~TextureView()
     {
+        core->invalidateCachedDescriptors(this);
+
         DeletionQueue* dq;
 
         dq = core->perFrameResources[core->frameIndex].DeletionQueue;
@@ -86,4 +86,11 @@ namespace R2::VK
 
         return pFlags;
     }
-}
\ No newline at end of file
+
+    bool isWriteAccess(AccessFlags access)
+    {
+        return hasAF(access, AccessFlags::ShaderWrite | AccessFlags::ColorAttachmentWrite |
+            AccessFlags::DepthStencilAttachmentWrite | AccessFlags::TransferWrite | AccessFlags::HostWrite |
+            AccessFlags::MemoryWrite | AccessFlags::ShaderStorageWrite);
+    }
+}